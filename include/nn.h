@@ -6,6 +6,7 @@ extern "C" {
 #endif
 
 #include <stdio.h>
+#include <stdint.h>
 
 typedef float (*func)(float);
 
@@ -25,11 +26,21 @@ float dcxe(float y, float t);
 
 enum { R, C, D, B };
 
+enum { NCHW, NHWC };
+
+/*
+ * strides are in floats and follow dims; views share vals with the tensor
+ * they were made from and leave owner clear, so destroying them is a no-op.
+ */
 typedef struct tens {
     int dims[4];
+    int strides[4];
 	float *vals;
+    int layout;
+    int owner;
 } tens;
 
+/* tens_at and tens_at_nhwc assume a packed tensor, tens_at_strided takes any view. */
 #define tens_at(t, r, c, d, b) \
     ((t).vals[ \
         ((b) * (t).dims[D] * (t).dims[R] * (t).dims[C]) + \
@@ -38,7 +49,36 @@ typedef struct tens {
         (c) \
     ])
 
+#define tens_at_nhwc(t, r, c, d, b) \
+    ((t).vals[ \
+        ((b) * (t).dims[R] * (t).dims[C] * (t).dims[D]) + \
+        ((r) * (t).dims[C] * (t).dims[D]) + \
+        ((c) * (t).dims[D]) + \
+        (d) \
+    ])
+
+#define tens_at_strided(t, r, c, d, b) \
+    ((t).vals[ \
+        ((b) * (t).strides[B]) + \
+        ((d) * (t).strides[D]) + \
+        ((r) * (t).strides[R]) + \
+        ((c) * (t).strides[C]) \
+    ])
+
 tens tens_alloc(int r, int c, int d, int b);
+tens tens_lazy(int r, int c, int d, int b);
+tens tens_view(float *vals, int r, int c, int d, int b);
+void tens_ensure(tens *t);
+void tens_set_layout(tens *t, int layout);
+int tens_is_contiguous(tens t);
+tens tens_contiguous(tens t);
+tens tens_reshape(tens t, int r, int c, int d, int b);
+tens tens_permute(tens t, int perm[4]);
+long tens_allocations(void);
+
+void gemm(int trans_a, int trans_b, int m, int n, int k, float alpha,
+          const float *a, int lda, const float *b, int ldb,
+          float beta, float *c, int ldc);
 
 void tens_rand(tens t, float min, float max);
 void tens_normal(tens t, float mean, float stddev);
@@ -47,25 +87,47 @@ void tens_copy(tens dest, tens t);
 void tens_add(tens dest, tens t1, tens t2);
 void tens_sub(tens dest, tens t1, tens t2);
 void tens_dot(tens dest, tens t1, tens t2);
+void tens_dot_T1(tens dest, tens t1, tens t2);
+void tens_dot_T2(tens dest, tens t1, tens t2);
 void tens_had(tens dest, tens t1, tens t2);
 void tens_trans(tens dest, tens t, int perm[4]);
 void tens_180(tens dest, tens t, int flip[4]);
 void tens_scale(tens dest, tens t, float a);
 void tens_func(tens dest, tens t, func f);
 void tens_softmax(tens dest, tens t);
+float tens_softmax_cxe(tens dest, tens t, const int *labels);
 void tens_pad(tens dest, tens t, int padding[4]);
 void tens_print(tens t);
 void tens_destroy(tens t);
 void tens_save(tens t, FILE *f);
 void tens_load(tens t, FILE *f);
 
+#define LAYER_MAX_PARAMS 16
+
+enum { TRAINING, INFERENCE };
+
+enum { DENSE, CONV, MAXPOOL, RESHAPE, DROPOUT, BATCHNORM,
+       SIG, TANH, RELU, GELU, SOFTMAX, EMBEDDING, ATTENTION,
+       LAYERNORM, ENCODER };
+
 typedef struct layer {
+    int type;
+    int mode;
+    int layout;
+    int layouts; /* supported layouts as 1 << layout, 0 if it follows its input */
+    int x_dims[4];
+    int y_dims[4];
     void *data;
 
     void (*forward)(struct layer l, tens x, tens *y);
-    void (*backprop)(struct layer l, tens dy, tens *dx, float rate);
+    void (*backprop)(struct layer l, tens dy, tens *dx);
     void (*destroy)(struct layer l);
 
+    int (*params)(struct layer l, tens **params, tens **grads, int *decay);
+    int (*state)(struct layer l, tens **state);
+    void (*invalidate)(struct layer l);
+    int (*fuse)(struct layer l, func act, func dact);
+
     void (*init)(struct layer l);
     void (*print)(struct layer l);
     void (*save)(struct layer l, FILE *f);
@@ -78,12 +140,11 @@ typedef struct {
     int x_b;
 	tens w;
 	tens b;
-    tens x_reshaped;
-    tens dot;
-    tens x_reshaped_T;
-    tens w_T;
-    tens dy_reshaped;
-    tens dx_reshaped;
+    tens x_cache;
+    func act;
+    func dact;
+    tens z_cache;
+    tens dz;
     tens dw;
     tens db;
 } dense_layer;
@@ -91,9 +152,11 @@ typedef struct {
 layer dense_layer_alloc(int x_r, int y_r, int x_b);
 
 void dense_forward(layer l, tens x, tens *y);
-void dense_backprop(layer l, tens dy, tens *dx, float rate);
+void dense_backprop(layer l, tens dy, tens *dx);
 void dense_destroy(layer l);
 
+int dense_params(layer l, tens **params, tens **grads, int *decay);
+int dense_fuse(layer l, func act, func dact);
 void dense_init(layer l);
 void dense_print(layer l);
 void dense_save(layer l, FILE *f);
@@ -101,6 +164,8 @@ void dense_load(layer l, FILE *f);
 
 enum { TOP, BOTTOM, LEFT, RIGHT };
 
+enum { CONV_DIRECT, CONV_IM2COL, CONV_IMPLICIT, CONV_WINOGRAD };
+
 typedef struct conv_layer {
     int x_r;
     int x_c;
@@ -113,12 +178,22 @@ typedef struct conv_layer {
     int convolutions;
     int stride;
     int x_padding[4];
-    int dy_padding[4];
+    int algo;
 	tens w;
 	tens b;
-    tens x_padded;
-    tens dy_padded;
-    tens w_180;
+    tens x_cache;
+    tens col;
+    tens w_wino;
+    tens w_wino_180;
+    tens wino_v;
+    tens wino_m;
+    tens w_hwio;
+    tens dw_hwio;
+    int w_valid;
+    func act;
+    func dact;
+    tens z_cache;
+    tens dz;
     tens dw;
     tens db;
 } conv_layer;
@@ -127,14 +202,24 @@ layer conv_layer_alloc(int x_r, int x_c, int x_d,
                        int x_b, int w_r, int w_c,
                        int convolutions, int stride, int padding[4]);
 void conv_forward(layer l, tens x, tens *y);
-void conv_backprop(layer l, tens dy, tens *dx, float rate);
+void conv_backprop(layer l, tens dy, tens *dx);
 void conv_destroy(layer l);
 
+void conv_scale(layer l, tens scale, tens shift);
+
+int conv_params(layer l, tens **params, tens **grads, int *decay);
+void conv_invalidate(layer l);
+int conv_fuse(layer l, func act, func dact);
 void conv_init(layer l);
 void conv_print(layer l);
 void conv_save(layer l, FILE *f);
 void conv_load(layer l, FILE *f);
 
+void winograd_filter(float *u, const float *w, int convolutions, int x_d, int backprop);
+void winograd_conv(const float *x, float *y, const float *u,
+                   int in_d, int out_d, int rows, int cols,
+                   float *v, float *m);
+
 typedef struct sig_layer {
     int x_r;
     int x_c;
@@ -147,7 +232,7 @@ layer sig_layer_alloc(int x_r, int x_c,
                       int x_d, int x_b);
 
 void sig_forward(layer l, tens x, tens *y);
-void sig_backprop(layer l, tens dy, tens *dx, float rate);
+void sig_backprop(layer l, tens dy, tens *dx);
 void sig_destroy(layer l);
 
 typedef struct tanh_layer {
@@ -162,7 +247,7 @@ layer tanh_layer_alloc(int x_r, int x_c,
                        int x_d, int x_b);
 
 void tanh_forward(layer l, tens x, tens *y);
-void tanh_backprop(layer l, tens dy, tens *dx, float rate);
+void tanh_backprop(layer l, tens dy, tens *dx);
 void tanh_destroy(layer l);
 
 typedef struct relu_layer {
@@ -177,7 +262,7 @@ layer relu_layer_alloc(int x_r, int x_c,
                        int x_d, int x_b);
 
 void relu_forward(layer l, tens x, tens *y);
-void relu_backprop(layer l, tens dy, tens *dx, float rate);
+void relu_backprop(layer l, tens dy, tens *dx);
 void relu_destroy(layer l);
 
 typedef struct gelu_layer {
@@ -192,7 +277,7 @@ layer gelu_layer_alloc(int x_r, int x_c,
                        int x_d, int x_b);
 
 void gelu_forward(layer l, tens x, tens *y);
-void gelu_backprop(layer l, tens dy, tens *dx, float rate);
+void gelu_backprop(layer l, tens dy, tens *dx);
 void gelu_destroy(layer l);
 
 typedef struct softmax_layer {
@@ -207,7 +292,7 @@ layer softmax_layer_alloc(int x_r, int x_c,
                           int x_d, int x_b);
 
 void softmax_forward(layer l, tens x, tens *y);
-void softmax_backprop(layer l, tens dy, tens *dx, float rate);
+void softmax_backprop(layer l, tens dy, tens *dx);
 void softmax_destroy(layer l);
 
 typedef struct maxpool_layer {
@@ -225,7 +310,7 @@ typedef struct maxpool_layer {
 layer maxpool_layer_alloc(int x_r, int x_c, int x_d,
                           int x_b, int pooling_r, int pooling_c);
 void maxpool_forward(layer l, tens x, tens *y);
-void maxpool_backprop(layer l, tens dy, tens *dx, float rate);
+void maxpool_backprop(layer l, tens dy, tens *dx);
 void maxpool_destroy(layer l);
 
 typedef struct reshape_layer {
@@ -244,7 +329,7 @@ layer reshape_layer_alloc(int x_r, int x_c, int x_d,
                           int y_d, int y_b);
 
 void reshape_forward(layer l, tens x, tens *y);
-void reshape_backprop(layer l, tens dy, tens *dx, float rate);
+void reshape_backprop(layer l, tens dy, tens *dx);
 void reshape_destroy(layer l);
 
 typedef struct dropout_layer {
@@ -253,7 +338,7 @@ typedef struct dropout_layer {
     int x_d;
     int x_b;
     float rate;
-    tens mask;
+    uint32_t *mask;
 } dropout_layer;
 
 layer dropout_layer_alloc(int x_r, int x_c,
@@ -261,7 +346,7 @@ layer dropout_layer_alloc(int x_r, int x_c,
 
 
 void dropout_forward(layer l, tens x, tens *y);
-void dropout_backprop(layer l, tens dy, tens *dx, float rate);
+void dropout_backprop(layer l, tens dy, tens *dx);
 void dropout_destroy(layer l);
 
 typedef struct batchnorm_layer {
@@ -271,8 +356,14 @@ typedef struct batchnorm_layer {
     int x_b;
     tens gamma;
     tens beta;
+    tens running_mean;
+    tens running_var;
     tens var_cache;
     tens z_cache;
+    func act;
+    func dact;
+    tens a_cache;
+    tens da;
     tens dgamma;
     tens dbeta;
 } batchnorm_layer;
@@ -281,9 +372,14 @@ layer batchnorm_layer_alloc(int x_r, int x_c,
                             int x_d, int x_b);
 
 void batchnorm_forward(layer l, tens x, tens *y);
-void batchnorm_backprop(layer l, tens dy, tens *dx, float rate);
+void batchnorm_backprop(layer l, tens dy, tens *dx);
 void batchnorm_destroy(layer l);
 
+void batchnorm_affine(layer l, tens scale, tens shift);
+
+int batchnorm_params(layer l, tens **params, tens **grads, int *decay);
+int batchnorm_state(layer l, tens **state);
+int batchnorm_fuse(layer l, func act, func dact);
 void batchnorm_init(layer l);
 void batchnorm_print(layer l);
 void batchnorm_save(layer l, FILE *f);
@@ -296,14 +392,21 @@ typedef struct embedding_layer {
     int v_R;
     tens e;
     tens p;
+    tens x_cache;
+    tens de;
+    int *offsets;
+    int count;
 } embedding_layer;
 
 layer embedding_layer_alloc(int x_r, int x_b, int e_R, int v_R);
 
 void embedding_forward(layer l, tens x, tens *y);
-void embedding_backprop(layer l, tens dy, tens *dx, float rate);
+void embedding_backprop(layer l, tens dy, tens *dx);
 void embedding_destroy(layer l);
 
+void embedding_pack(layer l, const int *offsets, int count);
+
+int embedding_params(layer l, tens **params, tens **grads, int *decay);
 void embedding_init(layer l);
 void embedding_print(layer l);
 void embedding_save(layer l, FILE *f);
@@ -315,42 +418,229 @@ typedef struct attention_layer {
     int d_k;
     int h_R;
     int x_b;
-    tens w_q;
-    tens w_k;
-    tens w_v;
+    tens w_qkv;
     tens w_o;
-    tens alpha_cache;
-    tens z_cache;
-    tens concat_cache;
+    tens x_cache;
+    tens qkv;
+    tens o;
+    tens lse;
+    tens d_o;
+    tens dqkv;
+    tens delta;
+    tens dw_qkv;
+    tens dw_o;
+    tens k_cache;
+    tens v_cache;
+    tens qkv_step;
+    tens o_step;
+    int cache_len;
+    int cache_next;
+    int causal;
+    int *lengths;
+    int *offsets;
+    int count;
 } attention_layer;
 
 layer attention_layer_alloc(int seq_len, int d_model,
                             int d_k, int x_b);
 
 void attention_forward(layer l, tens x, tens *y);
-void attention_backprop(layer l, tens dy, tens *dx, float rate);
+void attention_backprop(layer l, tens dy, tens *dx);
 void attention_destroy(layer l);
 
+void attention_decode(layer l, tens x, tens *y);
+void attention_reset(layer l);
+void attention_mask(layer l, int causal, const int *lengths);
+void attention_pack(layer l, const int *offsets, int count);
+int *pack_offsets(const int *offsets, int count, int max_len, int tokens);
+
+int attention_params(layer l, tens **params, tens **grads, int *decay);
 void attention_init(layer l);
 void attention_print(layer l);
 void attention_save(layer l, FILE *f);
 void attention_load(layer l, FILE *f);
 
+typedef struct layernorm_layer {
+    int x_r;
+    int x_c;
+    int x_d;
+    int x_b;
+    tens gamma;
+    tens beta;
+    tens z_cache;
+    tens rstd_cache;
+    tens dgamma;
+    tens dbeta;
+} layernorm_layer;
+
+layer layernorm_layer_alloc(int x_r, int x_c,
+                            int x_d, int x_b);
+
+void layernorm_forward(layer l, tens x, tens *y);
+void layernorm_backprop(layer l, tens dy, tens *dx);
+void layernorm_destroy(layer l);
+
+int layernorm_params(layer l, tens **params, tens **grads, int *decay);
+void layernorm_init(layer l);
+void layernorm_print(layer l);
+void layernorm_save(layer l, FILE *f);
+void layernorm_load(layer l, FILE *f);
+
+typedef struct encoder_block {
+    int seq_len;
+    int d_model;
+    int d_k;
+    int d_ff;
+    int x_b;
+    layer attention;
+    layer attention_norm;
+    layer mlp_hidden;
+    layer mlp_output;
+    layer mlp_norm;
+    tens a;
+    tens n;
+    tens h;
+    tens f;
+    int stepping;
+    layer steps[4];
+    tens a_step;
+    tens n_step;
+    tens h_step;
+    tens f_step;
+} encoder_block;
+
+layer encoder_block_alloc(int seq_len, int d_model,
+                          int d_k, int d_ff, int x_b);
+
+void encoder_forward(layer l, tens x, tens *y);
+void encoder_backprop(layer l, tens dy, tens *dx);
+void encoder_destroy(layer l);
+
+void encoder_decode(layer l, tens x, tens *y);
+void encoder_reset(layer l);
+void encoder_mask(layer l, int causal, const int *lengths);
+void encoder_pack(layer l, const int *offsets, int count);
+
+int encoder_params(layer l, tens **params, tens **grads, int *decay);
+void encoder_init(layer l);
+void encoder_print(layer l);
+void encoder_save(layer l, FILE *f);
+void encoder_load(layer l, FILE *f);
+
+typedef struct optimizer {
+    void *data;
+
+    void (*step)(struct optimizer o, tens *params, tens *grads, const int *decay, int count);
+    void (*destroy)(struct optimizer o);
+} optimizer;
+
+typedef struct sgd_optimizer {
+    float rate;
+    float momentum;
+    int size;
+    float *v;
+} sgd_optimizer;
+
+optimizer sgd_optimizer_alloc(float rate, float momentum);
+
+void sgd_step(optimizer o, tens *params, tens *grads, const int *decay, int count);
+void sgd_destroy(optimizer o);
+
+typedef struct adam_optimizer {
+    float rate;
+    float beta1;
+    float beta2;
+    float eps;
+    float weight_decay;
+    int t;
+    int size;
+    float *m;
+    float *v;
+} adam_optimizer;
+
+optimizer adam_optimizer_alloc(float rate, float beta1,
+                               float beta2, float eps);
+optimizer adamw_optimizer_alloc(float rate, float beta1, float beta2,
+                                float eps, float weight_decay);
+
+void adam_step(optimizer o, tens *params, tens *grads, const int *decay, int count);
+void adam_destroy(optimizer o);
+
 typedef struct nn {
+    int mode;
     int max_layers;
     int num_layers;
     layer *layers;
+    tens params;
+    tens grads;
+    tens state;
+    int num_params;
+    tens *param_list;
+    tens *grad_list;
+    int *decay;
+    int y_size;
+    int dx_size;
+    float *y_buffers[2];
+    float *dx_buffers[2];
+    float *t_buffer;
+    void *map;
+    size_t map_size;
 } nn;
 
 nn nn_alloc(int max_layers);
 void nn_add_layer(nn *n, layer l);
+void nn_set_mode(nn *n, int mode);
+void nn_fold(nn *n);
+void nn_fuse(nn *n);
+void nn_set_layout(nn *n, int layout);
 void nn_forward(nn n, tens x, tens *y);
-void nn_backprop(nn n, tens dy, tens *dx, float rate);
+void nn_backprop(nn n, tens dy, tens *dx, optimizer *o);
+void nn_update(nn n, optimizer o);
+void nn_params_changed(nn n);
 void nn_destroy(nn n);
 void nn_init(nn n);
 void nn_print(nn n);
 void nn_save(nn n, FILE *f);
-void nn_load(nn n, FILE *f);
+int nn_load(nn n, FILE *f);
+int nn_load_mmap(nn *n, const char *path);
+
+/*
+ * Data parallel training over forked worker processes that average
+ * tensors through a ring all-reduce in shared memory.
+ */
+typedef struct parallel {
+    int rank;
+    int workers;
+    int threads;
+    int size;
+    float *slots;
+    void *map;
+    size_t map_size;
+} parallel;
+
+parallel parallel_alloc(int workers);
+void parallel_fork(parallel *p, int size);
+void parallel_allreduce(parallel p, tens t);
+void parallel_broadcast(parallel p, tens t);
+void parallel_join(parallel p);
+void parallel_destroy(parallel p);
+
+/*
+ * Streams batches of fixed size records, one label byte followed by
+ * x_d * x_r * x_c planar pixel bytes, from memory mapped files while a
+ * background thread decodes the next batch.
+ */
+typedef struct loader loader;
+
+loader *loader_alloc(char **files, int count, int x_r, int x_c, int x_d,
+                     int x_b, int classes, int rank, int workers);
+void loader_shuffle(loader *ld, uint64_t seed);
+void loader_augment(loader *ld, int pad, int flip);
+void loader_normalize(loader *ld, const float *mean, const float *stddev);
+int loader_batches(loader *ld);
+void loader_next(loader *ld, tens *x, tens *t);
+const int *loader_labels(loader *ld);
+void loader_destroy(loader *ld);
 
 #ifdef __cplusplus
 }
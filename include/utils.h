@@ -2,14 +2,24 @@
 #define UTILS_H
 
 #include <stdlib.h>
+#include <stdint.h>
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+uint64_t rand_counter(uint64_t seed, uint64_t counter);
+void rand_seed(uint64_t seed);
+uint64_t rand_stream(void);
 float rand_float(float min, float max);
 float rand_normal(float mean, float stddev);
+void rand_uniform_fill(float *dest, int size, uint64_t stream, uint64_t counter,
+                       float min, float max);
+void rand_normal_fill(float *dest, int size, uint64_t stream, uint64_t counter,
+                      float mean, float stddev);
+void rand_bits_fill(uint32_t *dest, int size, uint64_t stream, uint64_t counter, float p);
 void shuffle(void *arr, size_t type_size, int arr_size);
+void rand_permutation(int *perm, int size, uint64_t seed);
 void get_path(char *path, char *file_name);
 
 #ifdef __cplusplus
@@ -0,0 +1,97 @@
+#include <stdlib.h>
+#include <assert.h>
+#include <math.h>
+#include <omp.h>
+#include "nn.h"
+
+optimizer adam_optimizer_alloc(float rate, float beta1,
+                               float beta2, float eps)
+{
+    return adamw_optimizer_alloc(rate, beta1, beta2, eps, 0.0f);
+}
+
+optimizer adamw_optimizer_alloc(float rate, float beta1, float beta2,
+                                float eps, float weight_decay)
+{
+    adam_optimizer *ao = malloc(sizeof(adam_optimizer));
+
+    ao->rate = rate;
+    ao->beta1 = beta1;
+    ao->beta2 = beta2;
+    ao->eps = eps;
+    ao->weight_decay = weight_decay;
+
+    ao->t = 0;
+    ao->size = 0;
+    ao->m = NULL;
+    ao->v = NULL;
+
+    optimizer o;
+
+    o.data = ao;
+
+    o.step = adam_step;
+    o.destroy = adam_destroy;
+
+    return o;
+}
+
+/* Weight decay only applies to the tensors flagged in decay, e.g. not to biases. */
+void adam_step(optimizer o, tens *params, tens *grads, const int *decay, int count)
+{
+    adam_optimizer *ao = (adam_optimizer *)o.data;
+
+    int size = 0;
+
+    for (int i = 0; i < count; ++i) {
+        size += params[i].dims[R] * params[i].dims[C] * params[i].dims[D] * params[i].dims[B];
+    }
+
+    if (ao->m == NULL) {
+        ao->size = size;
+        ao->m = calloc(2 * size, sizeof(float));
+        ao->v = ao->m + size;
+    }
+
+    assert(ao->size == size);
+
+    ++ao->t;
+
+    float beta1 = ao->beta1;
+    float beta2 = ao->beta2;
+    float eps = ao->eps;
+    float shrink = 1.0f - ao->rate * ao->weight_decay;
+    float rate = ao->rate * sqrtf(1.0f - powf(beta2, ao->t)) / (1.0f - powf(beta1, ao->t));
+
+    #pragma omp parallel
+    {
+        int offset = 0;
+
+        for (int i = 0; i < count; ++i) {
+            float *w = params[i].vals;
+            float *dw = grads[i].vals;
+            float *m = ao->m + offset;
+            float *v = ao->v + offset;
+            int elements = params[i].dims[R] * params[i].dims[C] * params[i].dims[D] * params[i].dims[B];
+            float w_decay = decay != NULL && decay[i] ? shrink : 1.0f;
+
+            #pragma omp for simd schedule(static) nowait
+            for (int j = 0; j < elements; ++j) {
+                m[j] = beta1 * m[j] + (1.0f - beta1) * dw[j];
+                v[j] = beta2 * v[j] + (1.0f - beta2) * dw[j] * dw[j];
+                w[j] = w_decay * w[j] - rate * m[j] / (sqrtf(v[j]) + eps);
+            }
+
+            offset += elements;
+        }
+    }
+}
+
+void adam_destroy(optimizer o)
+{
+    adam_optimizer *ao = (adam_optimizer *)o.data;
+
+    free(ao->m);
+
+    free(ao);
+}
@@ -1,40 +1,79 @@
 #include <stdlib.h>
+#include <string.h>
 #include <math.h>
+#include <float.h>
 #include <assert.h>
 #include <omp.h>
 #include "nn.h"
 
-layer attention_layer_alloc(int d_model, int seq_len,
-                            int d_k, int batch_size)
+#define ATTENTION_TILE 64
+
+layer attention_layer_alloc(int seq_len, int d_model,
+                            int d_k, int x_b)
 {
     assert(d_model % d_k == 0);
 
     attention_layer *al = malloc(sizeof(attention_layer));
 
-    al->d_model = d_model;
     al->seq_len = seq_len;
+    al->d_model = d_model;
     al->d_k = d_k;
-    al->h_size = d_model / d_k;
-    al->batch_size = batch_size;
+    al->h_R = d_model / d_k;
+    al->x_b = x_b;
+
+    /* Columns of w_qkv are the q, k and v projections side by side. */
+    al->w_qkv = tens_alloc(d_model, 3 * d_model, 1, 1);
+    al->w_o = tens_alloc(d_model, d_model, 1, 1);
 
-    al->w_q = tens3D_alloc(d_k, d_model, al->h_size);
-    al->w_k = tens3D_alloc(d_k, d_model, al->h_size);
-    al->w_v = tens3D_alloc(d_k, d_model, al->h_size);
-    al->w_o = mat_alloc(d_model, d_model);
+    al->x_cache = tens_lazy(seq_len, d_model, 1, x_b);
+    al->qkv = tens_lazy(seq_len, 3 * d_model, 1, x_b);
+    al->o = tens_lazy(seq_len, d_model, 1, x_b);
+    al->lse = tens_lazy(seq_len * x_b, 1, al->h_R, 1);
 
-    al->x_cache = tens3D_alloc(d_model, seq_len, batch_size);
-    al->alpha_cache = tens4D_alloc(d_k, seq_len, al->h_size, batch_size);
-    al->z_cache = tens4D_alloc(d_k, seq_len, al->h_size, batch_size);
-    al->concat_cache = tens3D_alloc(d_model, seq_len, batch_size);
+    al->d_o = tens_lazy(seq_len, d_model, 1, x_b);
+    al->dqkv = tens_lazy(seq_len, 3 * d_model, 1, x_b);
+    al->delta = tens_lazy(seq_len * x_b, 1, al->h_R, 1);
+
+    al->dw_qkv = tens_alloc(d_model, 3 * d_model, 1, 1);
+    al->dw_o = tens_alloc(d_model, d_model, 1, 1);
+
+    al->k_cache = tens_lazy(seq_len, d_model, 1, x_b);
+    al->v_cache = tens_lazy(seq_len, d_model, 1, x_b);
+    al->qkv_step = tens_lazy(1, 3 * d_model, 1, x_b);
+    al->o_step = tens_lazy(1, d_model, 1, x_b);
+    al->cache_len = 0;
+    al->cache_next = 0;
+
+    al->causal = 0;
+    al->lengths = NULL;
+    al->offsets = NULL;
+    al->count = 0;
 
     layer l;
 
+    l.type = ATTENTION;
     l.data = al;
+    l.layouts = 1 << NCHW;
+
+    l.x_dims[R] = seq_len;
+    l.x_dims[C] = d_model;
+    l.x_dims[D] = 1;
+    l.x_dims[B] = x_b;
+
+    l.y_dims[R] = seq_len;
+    l.y_dims[C] = d_model;
+    l.y_dims[D] = 1;
+    l.y_dims[B] = x_b;
 
     l.forward = attention_forward;
     l.backprop = attention_backprop;
     l.destroy = attention_destroy;
 
+    l.params = attention_params;
+    l.state = NULL;
+    l.invalidate = NULL;
+    l.fuse = NULL;
+
     l.init = attention_init;
     l.print = attention_print;
     l.save = attention_save;
@@ -43,296 +82,566 @@ layer attention_layer_alloc(int d_model, int seq_len,
     return l;
 }
 
-void attention_forward(layer l, tens x, tens *y)
+static int attention_spans(attention_layer *al)
 {
-    attention_layer *al = (attention_layer *)l.data;
+    return al->offsets != NULL ? al->count : al->x_b;
+}
+
+/* The first token and the length of sequence i, packed or padded. */
+static void attention_span(attention_layer *al, int i, int *start, int *len)
+{
+    if (al->offsets != NULL) {
+        *start = al->offsets[i];
+        *len = al->offsets[i + 1] - al->offsets[i];
+    }
+    else {
+        *start = i * al->seq_len;
+        *len = al->lengths != NULL ? al->lengths[i] : al->seq_len;
+    }
+}
+
+/* s = scale * a b^T for br rows of a and bc rows of b. */
+static void attention_scores(float *s, const float *a, int lda, const float *b, int ldb,
+                             int br, int bc, int d_k, float scale)
+{
+    for (int r = 0; r < br; ++r) {
+        for (int c = 0; c < bc; ++c) {
+            const float *a_r = a + r * lda;
+            const float *b_c = b + c * ldb;
+            float dot = 0.0f;
+
+            #pragma omp simd reduction(+:dot)
+            for (int d = 0; d < d_k; ++d) {
+                dot += a_r[d] * b_c[d];
+            }
+
+            s[r * ATTENTION_TILE + c] = scale * dot;
+        }
+    }
+}
 
-    assert(x.type == TENS3D);
-    assert(x.t3.rows == al->d_model);
-    assert(x.t3.cols == al->seq_len);
-    assert(x.t3.depth == al->batch_size);
+/*
+ * One head of one sequence, a query tile at a time. Key and value tiles are
+ * streamed past it and folded into o with a running max and sum, so the
+ * queries x keys score matrix never exists. lse keeps max + log(sum) per query.
+ * When causal, query i sees keys 0..i only and key tiles past the diagonal are
+ * never visited.
+ */
+static void attention_head_forward(const float *q, int ld_q,
+                                   const float *k, const float *v, int ld_kv,
+                                   float *o, int ld_o, float *lse,
+                                   int queries, int keys, int causal,
+                                   int d_k, float scale)
+{
+    float s[ATTENTION_TILE * ATTENTION_TILE];
+    float m[ATTENTION_TILE];
+    float sum[ATTENTION_TILE];
 
-    y->type = TENS3D;
-    y->t3 = tens3D_alloc(al->d_model, al->seq_len, al->batch_size);
+    for (int i0 = 0; i0 < queries; i0 += ATTENTION_TILE) {
+        int br = queries - i0 < ATTENTION_TILE ? queries - i0 : ATTENTION_TILE;
 
-    tens3D_copy(al->x_cache, x.t3);
+        for (int r = 0; r < br; ++r) {
+            float *o_r = o + (i0 + r) * ld_o;
 
-    tens4D q = tens4D_alloc(al->d_k, al->seq_len, al->h_size, al->batch_size);
-    tens4D k = tens4D_alloc(al->d_k, al->seq_len, al->h_size, al->batch_size);
-    tens4D v = tens4D_alloc(al->d_k, al->seq_len, al->h_size, al->batch_size);
+            m[r] = -FLT_MAX;
+            sum[r] = 0.0f;
 
-    #pragma omp parallel for collapse(2) schedule(static)
-    for (int i = 0; i < al->h_size; ++i) {
-        for (int j = 0; j < al->batch_size; ++j) {
-            mat_dot(q.tens3Ds[j].mats[i], al->w_q.mats[i], x.t3.mats[j]);
-            mat_dot(k.tens3Ds[j].mats[i], al->w_k.mats[i], x.t3.mats[j]);
-            mat_dot(v.tens3Ds[j].mats[i], al->w_v.mats[i], x.t3.mats[j]);
+            #pragma omp simd
+            for (int d = 0; d < d_k; ++d) {
+                o_r[d] = 0.0f;
+            }
         }
-    }
 
-    tens4D_copy(al->q_cache, q);
-    tens4D_copy(al->k_cache, k);
-    tens4D_copy(al->v_cache, v);
+        int key_end = causal && i0 + br < keys ? i0 + br : keys;
+
+        for (int j0 = 0; j0 < key_end; j0 += ATTENTION_TILE) {
+            int bc = key_end - j0 < ATTENTION_TILE ? key_end - j0 : ATTENTION_TILE;
+
+            attention_scores(s, q + i0 * ld_q, ld_q, k + j0 * ld_kv, ld_kv, br, bc, d_k, scale);
+
+            for (int r = 0; r < br; ++r) {
+                float *s_r = s + r * ATTENTION_TILE;
+                float *o_r = o + (i0 + r) * ld_o;
+                int n = causal && i0 + r - j0 + 1 < bc ? i0 + r - j0 + 1 : bc;
+                float max = m[r];
+                float row = 0.0f;
 
-    tens4D k_T = tens4d_alloc(al->seq_len, al->d_k, al->h_size, al->batch_size);
-    tens4D_trans(k_T, k);
+                for (int c = 0; c < n; ++c) {
+                    if (s_r[c] > max) max = s_r[c];
+                }
 
-    tens4D k_T_q  = tens4D_alloc(al->seq_len, al->seq_len, al->h_size, al->batch_size);
-    tens4D_dot(k_T_q, k_T, q);
+                #pragma omp simd reduction(+:row)
+                for (int c = 0; c < n; ++c) {
+                    s_r[c] = expf(s_r[c] - max);
+                    row += s_r[c];
+                }
 
-    tens4D a = tens4D_alloc(al->seq_len, al->seq_len, al->h_size, al->batch_size);
-    tens4D_scale(a, k_T_q, 1.0f / sqrtf(al->d_k));
+                float correction = expf(m[r] - max);
 
-    tens4D alpha = tens4D_alloc(al->seq_len, al->seq_len, al->h_size, al->batch_size);
-    tens4D_softmax(alpha, a);
-    tens4D_copy(al->alpha_cache, alpha);
+                sum[r] = sum[r] * correction + row;
+                m[r] = max;
 
-    tens4D z = tens4D_alloc(al->d_k, al->seq_len, al->h_size, al->batch_size);
-    tens4D_dot(z, v, alpha);
-    tens4D_copy(al->z_cache, z);
+                #pragma omp simd
+                for (int d = 0; d < d_k; ++d) {
+                    o_r[d] *= correction;
+                }
 
-    tens3D concat = tens3D_alloc(al->d_model, al->seq_len, al->batch_size);
+                for (int c = 0; c < n; ++c) {
+                    const float *v_c = v + (j0 + c) * ld_kv;
+                    float p = s_r[c];
 
-    #pragma omp parallel for collapse(4) schedule(static)
-    for (int i = 0; i < al->d_k; ++i) {
-        for (int j = 0; j < al->seq_len; ++j) {
-            for (int k = 0; k < al->h_size; ++k) {
-                for (int l = 0; l < al->batch_size; ++l) {
-                    tens3D_at(concat, k * cl->d_k + i, j, l) = tens4D_at(z, i, j, k, l);
+                    #pragma omp simd
+                    for (int d = 0; d < d_k; ++d) {
+                        o_r[d] += p * v_c[d];
+                    }
                 }
             }
         }
-    }
 
-    tens3D_copy(al->concat_cache, concat);
+        for (int r = 0; r < br; ++r) {
+            float *o_r = o + (i0 + r) * ld_o;
+            float inv = 1.0f / sum[r];
+
+            #pragma omp simd
+            for (int d = 0; d < d_k; ++d) {
+                o_r[d] *= inv;
+            }
+
+            lse[i0 + r] = m[r] + logf(sum[r]);
+        }
+    }
+}
 
-    for (int i = 0; i < al->batch_size; ++i) {
-        mat_dot(y->t3.mats[i], al->w_o, concat.mats[i]);
+/*
+ * Probability tiles are recomputed from q, k and lse rather than cached.
+ * Key tiles are outermost so their dk and dv rows stay in cache while every
+ * query tile passes; dq, dk and dv are accumulated in place. When causal, a
+ * key tile is only met by the query tiles at or below the diagonal.
+ */
+static void attention_head_backprop(const float *q, const float *k, const float *v,
+                                    float *dq, float *dk, float *dv, int ld,
+                                    const float *d_o, int ld_o,
+                                    const float *lse, const float *delta,
+                                    int len, int causal, int d_k, float scale)
+{
+    float p[ATTENTION_TILE * ATTENTION_TILE];
+    float ds[ATTENTION_TILE * ATTENTION_TILE];
+
+    for (int i = 0; i < len; ++i) {
+        #pragma omp simd
+        for (int d = 0; d < d_k; ++d) {
+            dq[i * ld + d] = 0.0f;
+            dk[i * ld + d] = 0.0f;
+            dv[i * ld + d] = 0.0f;
+        }
     }
 
-    tens4D_destroy(q);
-    tens4D_destroy(k);
-    tens4D_destroy(v);
+    for (int j0 = 0; j0 < len; j0 += ATTENTION_TILE) {
+        int bc = len - j0 < ATTENTION_TILE ? len - j0 : ATTENTION_TILE;
+
+        for (int i0 = causal ? j0 : 0; i0 < len; i0 += ATTENTION_TILE) {
+            int br = len - i0 < ATTENTION_TILE ? len - i0 : ATTENTION_TILE;
+
+            attention_scores(p, q + i0 * ld, ld, k + j0 * ld, ld, br, bc, d_k, scale);
+            attention_scores(ds, d_o + i0 * ld_o, ld_o, v + j0 * ld, ld, br, bc, d_k, 1.0f);
+
+            for (int r = 0; r < br; ++r) {
+                float *p_r = p + r * ATTENTION_TILE;
+                float *ds_r = ds + r * ATTENTION_TILE;
+                int n = causal && i0 + r - j0 + 1 < bc ? i0 + r - j0 + 1 : bc;
+
+                #pragma omp simd
+                for (int c = 0; c < n; ++c) {
+                    p_r[c] = expf(p_r[c] - lse[i0 + r]);
+                    ds_r[c] = scale * p_r[c] * (ds_r[c] - delta[i0 + r]);
+                }
+
+                for (int c = n; c < bc; ++c) {
+                    p_r[c] = 0.0f;
+                    ds_r[c] = 0.0f;
+                }
+            }
+
+            for (int c = 0; c < bc; ++c) {
+                float *dk_c = dk + (j0 + c) * ld;
+                float *dv_c = dv + (j0 + c) * ld;
+
+                for (int r = 0; r < br; ++r) {
+                    const float *q_r = q + (i0 + r) * ld;
+                    const float *d_o_r = d_o + (i0 + r) * ld_o;
+                    float p_rc = p[r * ATTENTION_TILE + c];
+                    float ds_rc = ds[r * ATTENTION_TILE + c];
+
+                    #pragma omp simd
+                    for (int d = 0; d < d_k; ++d) {
+                        dv_c[d] += p_rc * d_o_r[d];
+                        dk_c[d] += ds_rc * q_r[d];
+                    }
+                }
+            }
+
+            for (int r = 0; r < br; ++r) {
+                float *dq_r = dq + (i0 + r) * ld;
 
-    tens4D_destroy(k_T);
-    tens4D_destroy(k_T_q);
-    tens4D_destroy(a);
-    tens4D_destroy(alpha);
-    tens4D_destroy(z);
-    tens3D_destroy(concat);
+                for (int c = 0; c < bc; ++c) {
+                    const float *k_c = k + (j0 + c) * ld;
+                    float ds_rc = ds[r * ATTENTION_TILE + c];
+
+                    #pragma omp simd
+                    for (int d = 0; d < d_k; ++d) {
+                        dq_r[d] += ds_rc * k_c[d];
+                    }
+                }
+            }
+        }
+    }
 }
 
-void attention_backprop(layer l, tens dy, tens *dx)
+void attention_forward(layer l, tens x, tens *y)
 {
     attention_layer *al = (attention_layer *)l.data;
 
-    assert(dy.type == TENS3D);
-    assert(dy.t3.rows == al->d_model);
-    assert(dy.t3.cols == al->seq_len);
-    assert(dy.t3.depth == al->batch_size);
+    assert(x.dims[R] == al->seq_len);
+    assert(x.dims[C] == al->d_model);
+    assert(x.dims[D] == 1);
+    assert(x.dims[B] == al->x_b);
+
+    assert(y->dims[R] == al->seq_len);
+    assert(y->dims[C] == al->d_model);
+    assert(y->dims[D] == 1);
+    assert(y->dims[B] == al->x_b);
 
-    dx->type = TENS3D;
-    dx->t3 = tens3D_alloc(al->d_model, al->seq_len, al->batch_size);
+    if (l.mode == TRAINING) {
+        tens_ensure(&al->x_cache);
+        tens_copy(al->x_cache, x);
+    }
+
+    tens_ensure(&al->qkv);
+    tens_ensure(&al->o);
+    tens_ensure(&al->lse);
+
+    int tokens = al->x_b * al->seq_len;
+
+    tens x_mat = tens_reshape(x, tokens, al->d_model, 1, 1);
+    tens y_mat = tens_reshape(*y, tokens, al->d_model, 1, 1);
+    tens qkv_mat = tens_reshape(al->qkv, tokens, 3 * al->d_model, 1, 1);
+    tens o_mat = tens_reshape(al->o, tokens, al->d_model, 1, 1);
 
-    tens3D x_T = tens3D_alloc(al->seq_len, al->d_model, al->batch_size);
-    tens3D_trans(x_T, al->x_cache);
+    tens_dot(qkv_mat, x_mat, al->w_qkv);
 
-    tens3D y_T = tens3D_alloc(al->seq_len, al->d_model, al->batch_size);
-    tens3D_trans(y_T, al->y_cache);
+    float scale = 1.0f / sqrtf(al->d_k);
+    int spans = attention_spans(al);
 
-    tens4D v_T = tens4D_alloc(al->seq_len, al->d_k, al->h_size, al->batch_size);
-    tens4D_trans(v_T, al->v_cache);
+    /* Padding is never attended from, so its rows of o stay zero. */
+    if (al->lengths != NULL || al->offsets != NULL) {
+        tens_fill(al->o, 0.0f);
+    }
 
-    tens4D alpha_T = tens4D_alloc(al->seq_len, al->seq_len, al->h_size, al->batch_size);
-    tens4D_trans(alpha_T, al->alpha_cache);
+    #pragma omp parallel for collapse(2) schedule(dynamic)
+    for (int i = 0; i < spans; ++i) {
+        for (int j = 0; j < al->h_R; ++j) {
+            int start, len;
+            attention_span(al, i, &start, &len);
 
-    tens3D concat_T = tens3D_alloc(al->seq_len, al->d_model, al->batch_size);
-    tens3D_trans(concat_T, al->concat_cache);
+            float *q = al->qkv.vals + start * 3 * al->d_model + j * al->d_k;
+            float *k = q + al->d_model;
+            float *v = k + al->d_model;
 
-    tens4D z_T = tens4D_alloc(al->seq_len, al->d_k, al->h_size, al->batch_size);
-    tens4D_trans(z_T, al->z_cache);
+            attention_head_forward(q, 3 * al->d_model, k, v, 3 * al->d_model,
+                                   al->o.vals + start * al->d_model + j * al->d_k, al->d_model,
+                                   &tens_at(al->lse, start, 0, j, 0),
+                                   len, len, al->causal, al->d_k, scale);
+        }
+    }
 
-    tens3D w_q_T = tens3D_alloc(al->d_model, al->d_k, al->h_size);
-    tens3D_trans(w_q_T, al->w_q);
+    tens_dot(y_mat, o_mat, al->w_o);
+}
 
-    tens3D w_k_T = tens3D_alloc(al->d_model, al->d_k, al->h_size);
-    tens3D_trans(w_k_T, al->w_k);
+void attention_backprop(layer l, tens dy, tens *dx)
+{
+    attention_layer *al = (attention_layer *)l.data;
 
-    tens3D w_v_T = tens3D_alloc(al->d_model, al->d_k, al->h_size);
-    tens3D_trans(w_v_T, al->w_v);
+    assert(dy.dims[R] == al->seq_len);
+    assert(dy.dims[C] == al->d_model);
+    assert(dy.dims[D] == 1);
+    assert(dy.dims[B] == al->x_b);
 
-    mat w_o_T = tens3D_alloc(al->d_model, al->d_model);
-    mat_trans(w_o_T, al->w_o);
+    assert(dx->dims[R] == al->seq_len);
+    assert(dx->dims[C] == al->d_model);
+    assert(dx->dims[D] == 1);
+    assert(dx->dims[B] == al->x_b);
 
-    tens4D dq = tens4D_alloc(al->d_k, al->seq_len, al->h_size, al->batch_size);
-    tens4D dk = tens4D_alloc(al->d_k, al->seq_len, al->h_size, al->batch_size);
-    tens4D dv = tens4D_alloc(al->d_k, al->seq_len, al->h_size, al->batch_size);
+    tens_ensure(&al->d_o);
+    tens_ensure(&al->dqkv);
+    tens_ensure(&al->delta);
 
-    tens4D dalpha = tens4D_alloc(al->seq_len, al->seq_len, al->h_size, al->batch_size);
-    tens4D da = tens4D_alloc(al->seq_len, al->seq_len, al->h_size, al->batch_size);
-    tens4D dz = tens4D_alloc(al->s_k, al->seq_len, al->h_size, al->batch_size);
-    tens3D dconcat = tens3D_alloc(al->d_model, al->seq_len, al->batch_size);
+    int tokens = al->x_b * al->seq_len;
 
-    tens4D da_T = tens4D_alloc(al->seq_len, al->seq_len, al->h_size, al->batch_size);
+    tens x_mat = tens_reshape(al->x_cache, tokens, al->d_model, 1, 1);
+    tens o_mat = tens_reshape(al->o, tokens, al->d_model, 1, 1);
+    tens dy_mat = tens_reshape(dy, tokens, al->d_model, 1, 1);
+    tens dx_mat = tens_reshape(*dx, tokens, al->d_model, 1, 1);
+    tens d_o_mat = tens_reshape(al->d_o, tokens, al->d_model, 1, 1);
+    tens dqkv_mat = tens_reshape(al->dqkv, tokens, 3 * al->d_model, 1, 1);
 
-    tens3D dw_q_current = tens3D_alloc(al->d_k, al->d_model, al->h_size);
-    tens3D dw_k_current = tens3D_alloc(al->d_k, al->d_model, al->h_size);
-    tens3D dw_v_current = tens3D_alloc(al->d_k, al->d_model, al->h_size);
-    mat dw_o_current = tens3D_alloc(al->d_model, al->d_model);
+    tens_dot_T2(d_o_mat, dy_mat, al->w_o);
+    tens_dot_T1(al->dw_o, o_mat, dy_mat);
 
-    tens3D dw_q = tens3D_alloc(al->d_k, al->d_model, al->h_size);
-    tens3D_fill(dw_q, 0.0f);
+    float scale = 1.0f / sqrtf(al->d_k);
+    int spans = attention_spans(al);
 
-    tens3D dw_k = tens3D_alloc(al->d_k, al->d_model, al->h_size);
-    tens3D_fill(dw_k, 0.0f);
+    if (al->lengths != NULL || al->offsets != NULL) {
+        tens_fill(al->dqkv, 0.0f);
+    }
 
-    tens3D dw_v = tens3D_alloc(al->d_k, al->d_model, al->h_size);
-    tens3D_fill(dw_v, 0.0f);
+    #pragma omp parallel for collapse(2) schedule(dynamic)
+    for (int i = 0; i < spans; ++i) {
+        for (int j = 0; j < al->h_R; ++j) {
+            int start, len;
+            attention_span(al, i, &start, &len);
 
-    mat dw_o = tens3D_alloc(al->d_model, al->d_model);
-    mat_fill(dw_o, 0.0f);
+            float *q = al->qkv.vals + start * 3 * al->d_model + j * al->d_k;
+            float *dq = al->dqkv.vals + start * 3 * al->d_model + j * al->d_k;
+            float *o = al->o.vals + start * al->d_model + j * al->d_k;
+            float *d_o = al->d_o.vals + start * al->d_model + j * al->d_k;
+            float *delta = &tens_at(al->delta, start, 0, j, 0);
 
-    for (int i = 0; i < al->batch_size; ++i) {
-        mat_dot(dconcat.mats[i], w_o_T, dy.t3.mats[i]);
+            for (int k = 0; k < len; ++k) {
+                float sum = 0.0f;
 
-        for (int j = 0; j < al->d_k; ++j) {
-            for (int k = 0; k < al->seq_len; ++k) {
-                for (int l = 0; l < al->h_size; ++l) {
-                    tens4D_at(dz, j, k, l, i) = tens3D_at(dconcat, l * al->d_k + j, k, i);
+                #pragma omp simd reduction(+:sum)
+                for (int d = 0; d < al->d_k; ++d) {
+                    sum += o[k * al->d_model + d] * d_o[k * al->d_model + d];
                 }
+
+                delta[k] = sum;
             }
+
+            attention_head_backprop(q, q + al->d_model, q + 2 * al->d_model,
+                                    dq, dq + al->d_model, dq + 2 * al->d_model,
+                                    3 * al->d_model, d_o, al->d_model,
+                                    &tens_at(al->lse, start, 0, j, 0), delta,
+                                    len, al->causal, al->d_k, scale);
         }
+    }
 
-        tens3D_dot(dalpha.tens3Ds[i], v_T.tens3Ds[i], dz.tens3Ds[i]);
+    tens_dot_T1(al->dw_qkv, x_mat, dqkv_mat);
+    tens_dot_T2(dx_mat, dqkv_mat, al->w_qkv);
 
-        tens3D_had(da.tens3Ds[i], dalpha.tens3Ds[i], al->alpha_cache.tens3Ds[i]);
+    tens_scale(al->dw_qkv, al->dw_qkv, 1.0f / al->x_b);
+    tens_scale(al->dw_o, al->dw_o, 1.0f / al->x_b);
+}
 
-        for (int j = 0; j < al->h_size; ++j) {
-            for (int k = 0; k < al->seq_len; ++k) {
-                float sum = 0.0f;
+/*
+ * Appends one token per sequence to the K/V cache and attends from it alone.
+ * The cache is a ring of seq_len rows, so past seq_len tokens the oldest are
+ * dropped. x and y are 1 x d_model per sequence.
+ */
+void attention_decode(layer l, tens x, tens *y)
+{
+    attention_layer *al = (attention_layer *)l.data;
 
-                for (int l = 0; l < al->seq_len; ++l) {
-                    sum += tens4D_at(dalpha, k, l, j, i) * tens4D_at(al->alpha_cache, k, l, j, i);
-                }
+    assert(x.dims[R] == 1);
+    assert(x.dims[C] == al->d_model);
+    assert(x.dims[D] == 1);
+    assert(x.dims[B] == al->x_b);
+
+    assert(y->dims[R] == 1);
+    assert(y->dims[C] == al->d_model);
+    assert(y->dims[D] == 1);
+    assert(y->dims[B] == al->x_b);
+
+    tens_ensure(&al->k_cache);
+    tens_ensure(&al->v_cache);
+    tens_ensure(&al->qkv_step);
+    tens_ensure(&al->o_step);
+
+    tens x_mat = tens_reshape(x, al->x_b, al->d_model, 1, 1);
+    tens y_mat = tens_reshape(*y, al->x_b, al->d_model, 1, 1);
+    tens qkv_mat = tens_reshape(al->qkv_step, al->x_b, 3 * al->d_model, 1, 1);
+    tens o_mat = tens_reshape(al->o_step, al->x_b, al->d_model, 1, 1);
+
+    tens_dot(qkv_mat, x_mat, al->w_qkv);
+
+    int row = al->cache_next;
+    int keys = al->cache_len < al->seq_len ? al->cache_len + 1 : al->seq_len;
+    float scale = 1.0f / sqrtf(al->d_k);
+
+    #pragma omp parallel for schedule(static)
+    for (int i = 0; i < al->x_b; ++i) {
+        memcpy(&tens_at(al->k_cache, row, 0, 0, i), &tens_at(al->qkv_step, 0, al->d_model, 0, i),
+               al->d_model * sizeof(float));
+        memcpy(&tens_at(al->v_cache, row, 0, 0, i), &tens_at(al->qkv_step, 0, 2 * al->d_model, 0, i),
+               al->d_model * sizeof(float));
+    }
 
-                for (int l = 0; l < al->seq_len; ++l) {
-                    tens4D_at(da, k, l, j, i) -= sum * tens4D_at(al->alpha_cache, k, l, j, i);
-                }
-            }
+    #pragma omp parallel for collapse(2) schedule(static)
+    for (int i = 0; i < al->x_b; ++i) {
+        for (int j = 0; j < al->h_R; ++j) {
+            float lse;
+
+            attention_head_forward(&tens_at(al->qkv_step, 0, j * al->d_k, 0, i), 3 * al->d_model,
+                                   &tens_at(al->k_cache, 0, j * al->d_k, 0, i),
+                                   &tens_at(al->v_cache, 0, j * al->d_k, 0, i), al->d_model,
+                                   &tens_at(al->o_step, 0, j * al->d_k, 0, i), al->d_model,
+                                   &lse, 1, keys, 0, al->d_k, scale);
+        }
+    }
+
+    tens_dot(y_mat, o_mat, al->w_o);
+
+    al->cache_len = keys;
+    al->cache_next = (row + 1) % al->seq_len;
+}
+
+void attention_reset(layer l)
+{
+    attention_layer *al = (attention_layer *)l.data;
+
+    al->cache_len = 0;
+    al->cache_next = 0;
+}
+
+/*
+ * Causal masking lets token i attend to tokens 0..i only. lengths gives the
+ * real length of each of the x_b sequences, the rest being padding: padded
+ * keys are never attended and padded queries produce zero. NULL means every
+ * sequence is full.
+ */
+void attention_mask(layer l, int causal, const int *lengths)
+{
+    attention_layer *al = (attention_layer *)l.data;
+
+    al->causal = causal;
+
+    free(al->lengths);
+    al->lengths = NULL;
+
+    if (lengths != NULL) {
+        al->lengths = malloc(al->x_b * sizeof(int));
+
+        for (int i = 0; i < al->x_b; ++i) {
+            assert(lengths[i] >= 0 && lengths[i] <= al->seq_len);
+            al->lengths[i] = lengths[i];
         }
+    }
+}
 
-        tens3D_dot(dk.tens3Ds[i], da.tens3Ds[i], al->q_cache.tens3Ds[i]);
-        tens3D_scale(dk.tens3Ds[i], dq.tens3Ds[i], 1.0f / sqrtf(al->d_k));
+/*
+ * Copies the count + 1 cumulative offsets of a packed batch: sequence i is
+ * tokens offsets[i] .. offsets[i + 1] - 1. Every sequence has to fit in
+ * max_len and all of them in tokens. NULL stays NULL.
+ */
+int *pack_offsets(const int *offsets, int count, int max_len, int tokens)
+{
+    if (offsets == NULL) return NULL;
 
-        tens3D_trans(da_trans.tens3Ds[i], da.tens3Ds[i]);
+    assert(count >= 0 && offsets[0] == 0 && offsets[count] <= tokens);
 
-        tens3D_dot(dq.tens3Ds[i], da_trans.tens3Ds[i], al->k_cache.tens3Ds[i]);
-        tens3D_scale(dq.tens3Ds[i], dq.tens3Ds[i], 1.0f / sqrtf(al->d_k));
+    int *copy = malloc((count + 1) * sizeof(int));
 
-        tens3D_dot(dw_q_current, dq.tens3Ds[i], x_T);
-        tens3D_dot(dw_k_current, d_k.tens3Ds[i], x_T);
-        tens3D_dot(dw_v_current, dv.tens3Ds[i], x_T);
-        mat_dot(dw_o_current, dy.t3.mats[i], concat_T.mats[i]);
+    copy[0] = 0;
 
-        tens3D_add(dw_q, dw_q, dw_q_current);
-        tens3D_add(dw_k, dw_k, dw_k_current);
-        tens3D_add(dw_v, dw_v, dw_v_current);
-        tens3D_add(dw_o, dw_o, dw_o_current);
+    for (int i = 0; i < count; ++i) {
+        assert(offsets[i + 1] >= offsets[i] && offsets[i + 1] - offsets[i] <= max_len);
+        copy[i + 1] = offsets[i + 1];
     }
 
-    tens3D_scale(dw_q, dw_q, rate / al->batch_size);
-    tens3D_func(dw_q, dw_q, clip);
-    tens3D_sub(al->w_q, al->w_q, dw_q);
-
-    tens3D_scale(dw_k, dw_k, rate / al->batch_size);
-    tens3D_func(dw_k, dw_k, clip);
-    tens3D_sub(al->w_k, al->w_k, dw_k);
-
-    tens3D_scale(dw_v, dw_v, rate / al->batch_size);
-    tens3D_func(dw_v, dw_v, clip);
-    tens3D_sub(al->w_v, al->w_v, dw_v);
-
-    tens3D_scale(dw_o, dw_o, rate / al->batch_size);
-    tens3D_func(dw_o, dw_o, clip);
-    tens3D_sub(al->w_o, al->w_o, dw_o);
- 
-    tens3D_destroy(x_T);
-    tens4D_destroy(v_T);
-    tens4D_destroy(alpha_T);
-    tens4D_destroy(z_T);
-    tens3D_destroy(w_o_T);
-
-    tens4D_destroy(dq);
-    tens4D_destroy(d_k);
-    tens4D_destroy(dv);
-
-    tens4D_destroy(dalpha);
-    tens4D_destroy(da);
-    tens4D_destroy(dz);
-
-    tens4D_destroy(da_T);
-
-    tens3D_destroy(dw_q_current);
-    tens3D_destroy(dw_k_current);
-    tens3D_destroy(dw_v_current);
-    free(dw_o_current.vals);
-
-    tens3D_destroy(dw_q);
-    tens3D_destroy(dw_k);
-    tens3D_destroy(dw_v);
-    free(dw_o.vals);
+    return copy;
+}
+
+/*
+ * Switches the layer to packed batches: the x_b * seq_len token rows hold
+ * count sequences back to back, sequence i being rows offsets[i] up to
+ * offsets[i + 1], and attention stays within each of them. Rows past
+ * offsets[count] are unused. This takes the place of any lengths given to
+ * attention_mask; NULL goes back to one sequence per batch entry.
+ */
+void attention_pack(layer l, const int *offsets, int count)
+{
+    attention_layer *al = (attention_layer *)l.data;
+
+    free(al->offsets);
+
+    al->offsets = pack_offsets(offsets, count, al->seq_len, al->seq_len * al->x_b);
+    al->count = count;
 }
 
 void attention_destroy(layer l)
 {
     attention_layer *al = (attention_layer *)l.data;
 
-    tens3D_destroy(al->w_q);
-    tens3D_destroy(al->w_k);
-    tens3D_destroy(al->w_v);
-    tens3D_destroy(al->w_o);
+    tens_destroy(al->w_qkv);
+    tens_destroy(al->w_o);
+
+    tens_destroy(al->x_cache);
+    tens_destroy(al->qkv);
+    tens_destroy(al->o);
+    tens_destroy(al->lse);
 
+    tens_destroy(al->d_o);
+    tens_destroy(al->dqkv);
+    tens_destroy(al->delta);
+
+    tens_destroy(al->dw_qkv);
+    tens_destroy(al->dw_o);
+
+    tens_destroy(al->k_cache);
+    tens_destroy(al->v_cache);
+    tens_destroy(al->qkv_step);
+    tens_destroy(al->o_step);
+
+    free(al->lengths);
+    free(al->offsets);
     free(al);
 }
 
+int attention_params(layer l, tens **params, tens **grads, int *decay)
+{
+    attention_layer *al = (attention_layer *)l.data;
+
+    params[0] = &al->w_qkv;
+    params[1] = &al->w_o;
+
+    grads[0] = &al->dw_qkv;
+    grads[1] = &al->dw_o;
+
+    decay[0] = 1;
+    decay[1] = 1;
+
+    return 2;
+}
+
 void attention_init(layer l)
 {
     attention_layer *al = (attention_layer *)l.data;
 
-    float range = sqrtf(6.0f / (al->d_model + al->d_k));
+    float range = sqrtf(3.0f / al->d_model);
 
-    tens3D_rand(al->w_q, -range, range);
-    tens3D_rand(al->w_k, -range, range);
-    tens3D_tand(al->w_v, -range, range);
-    tens3D_rand(al->w_o, -range, range);
+    tens_rand(al->w_qkv, -range, range);
+    tens_rand(al->w_o, -range, range);
 }
 
 void attention_print(layer l)
 {
     attention_layer *al = (attention_layer *)l.data;
 
-    tens3D_print(al->w_q);
-    tens3D_print(al->w_k);
-    tens3D_print(al->w_v);
-    tens3D_print(al->w_o);
+    tens_print(al->w_qkv);
+    tens_print(al->w_o);
 }
 
 void attention_save(layer l, FILE *f)
 {
     attention_layer *al = (attention_layer *)l.data;
 
-    tens3D_save(al->w_q, f);
-    tens3D_save(al->w_k, f);
-    tens3D_save(al->w_v, f);
-    tens3D_save(al->w_o, f);
+    tens_save(al->w_qkv, f);
+    tens_save(al->w_o, f);
 }
 
 void attention_load(layer l, FILE *f)
 {
-    attentino_layer *al = (attention_layer *)l.data;
+    attention_layer *al = (attention_layer *)l.data;
 
-    tens3D_load(al->w_q, f);
-    tens3D_load(al->w_k, f);
-    tens3D_load(al->w_v, f);
-    tens3D_load(al->w_o, f);
+    tens_load(al->w_qkv, f);
+    tens_load(al->w_o, f);
 }
@@ -4,6 +4,9 @@
 #include <omp.h>
 #include "nn.h"
 
+#define BATCHNORM_MOMENTUM 0.1f
+#define BATCHNORM_EPS 1e-5f
+
 layer batchnorm_layer_alloc(int x_r, int x_c,
                             int x_d, int batch_size)
 {
@@ -17,20 +20,48 @@ layer batchnorm_layer_alloc(int x_r, int x_c,
     bl->gamma = tens_alloc(x_d, 1, 1, 1);
     bl->beta = tens_alloc(x_d, 1, 1, 1);
 
-    bl->var_cache = tens_alloc(x_d, 1, 1, 1);
-    bl->z_cache = tens_alloc(x_r, x_c, x_d, batch_size);
+    bl->running_mean = tens_alloc(x_d, 1, 1, 1);
+    bl->running_var = tens_alloc(x_d, 1, 1, 1);
+
+    tens_fill(bl->running_mean, 0.0f);
+    tens_fill(bl->running_var, 1.0f);
+
+    bl->var_cache = tens_lazy(x_d, 1, 1, 1);
+    bl->z_cache = tens_lazy(x_r, x_c, x_d, batch_size);
+
+    bl->act = NULL;
+    bl->dact = NULL;
+    bl->a_cache = tens_lazy(x_r, x_c, x_d, batch_size);
+    bl->da = tens_lazy(x_r, x_c, x_d, batch_size);
 
     bl->dgamma = tens_alloc(bl->x_d, 1, 1, 1);
     bl->dbeta = tens_alloc(bl->x_d, 1, 1, 1);
 
     layer l;
 
+    l.type = BATCHNORM;
     l.data = bl;
+    l.layouts = 1 << NCHW | 1 << NHWC;
+
+    l.x_dims[R] = bl->x_r;
+    l.x_dims[C] = bl->x_c;
+    l.x_dims[D] = bl->x_d;
+    l.x_dims[B] = bl->x_b;
+
+    l.y_dims[R] = bl->x_r;
+    l.y_dims[C] = bl->x_c;
+    l.y_dims[D] = bl->x_d;
+    l.y_dims[B] = bl->x_b;
 
     l.forward = batchnorm_forward;
     l.backprop = batchnorm_backprop;
     l.destroy = batchnorm_destroy;
 
+    l.params = batchnorm_params;
+    l.state = batchnorm_state;
+    l.invalidate = NULL;
+    l.fuse = batchnorm_fuse;
+
     l.init = batchnorm_init;
     l.print = batchnorm_print;
     l.save = batchnorm_save;
@@ -39,6 +70,151 @@ layer batchnorm_layer_alloc(int x_r, int x_c,
     return l;
 }
 
+/*
+ * Channels-last tensors are an (n x x_d) matrix of pixels, so every per
+ * channel statistic is a row-wise reduction over contiguous channel vectors.
+ */
+static void batchnorm_nhwc_forward(batchnorm_layer *bl, tens x, tens y, int train)
+{
+    int d = bl->x_d;
+    int n = bl->x_r * bl->x_c * bl->x_b;
+    float scale[d], shift[d];
+
+    if (!train) {
+        for (int j = 0; j < d; ++j) {
+            scale[j] = tens_at(bl->gamma, j, 0, 0, 0) /
+                       sqrtf(tens_at(bl->running_var, j, 0, 0, 0) + BATCHNORM_EPS);
+            shift[j] = tens_at(bl->beta, j, 0, 0, 0) -
+                       tens_at(bl->running_mean, j, 0, 0, 0) * scale[j];
+        }
+
+        #pragma omp parallel for schedule(static)
+        for (int i = 0; i < n; ++i) {
+            const float *x_p = x.vals + i * d;
+            float *y_p = y.vals + i * d;
+
+            #pragma omp simd
+            for (int j = 0; j < d; ++j) {
+                y_p[j] = x_p[j] * scale[j] + shift[j];
+            }
+
+            if (bl->act == NULL) continue;
+
+            for (int j = 0; j < d; ++j) {
+                y_p[j] = bl->act(y_p[j]);
+            }
+        }
+
+        return;
+    }
+
+    float mean[d], var[d];
+    float m = BATCHNORM_MOMENTUM;
+
+    for (int j = 0; j < d; ++j) {
+        mean[j] = 0.0f;
+        var[j] = 0.0f;
+    }
+
+    #pragma omp parallel for schedule(static) reduction(+:mean[:d])
+    for (int i = 0; i < n; ++i) {
+        for (int j = 0; j < d; ++j) {
+            mean[j] += x.vals[i * d + j];
+        }
+    }
+
+    for (int j = 0; j < d; ++j) {
+        mean[j] /= n;
+    }
+
+    #pragma omp parallel for schedule(static) reduction(+:var[:d])
+    for (int i = 0; i < n; ++i) {
+        for (int j = 0; j < d; ++j) {
+            float diff = x.vals[i * d + j] - mean[j];
+            var[j] += diff * diff;
+        }
+    }
+
+    for (int j = 0; j < d; ++j) {
+        var[j] /= n;
+
+        tens_at(bl->var_cache, j, 0, 0, 0) = var[j];
+
+        float unbiased = n > 1 ? var[j] * n / (n - 1) : var[j];
+
+        tens_at(bl->running_mean, j, 0, 0, 0) =
+            (1.0f - m) * tens_at(bl->running_mean, j, 0, 0, 0) + m * mean[j];
+        tens_at(bl->running_var, j, 0, 0, 0) =
+            (1.0f - m) * tens_at(bl->running_var, j, 0, 0, 0) + m * unbiased;
+
+        scale[j] = 1.0f / sqrtf(var[j] + BATCHNORM_EPS);
+    }
+
+    #pragma omp parallel for schedule(static)
+    for (int i = 0; i < n; ++i) {
+        const float *x_p = x.vals + i * d;
+        float *z_p = bl->z_cache.vals + i * d;
+        float *y_p = y.vals + i * d;
+
+        for (int j = 0; j < d; ++j) {
+            float z = (x_p[j] - mean[j]) * scale[j];
+            float a = tens_at(bl->gamma, j, 0, 0, 0) * z + tens_at(bl->beta, j, 0, 0, 0);
+
+            z_p[j] = z;
+
+            if (bl->act == NULL) {
+                y_p[j] = a;
+                continue;
+            }
+
+            bl->a_cache.vals[i * d + j] = a;
+            y_p[j] = bl->act(a);
+        }
+    }
+}
+
+static void batchnorm_nhwc_backprop(batchnorm_layer *bl, tens dy, tens dx)
+{
+    int d = bl->x_d;
+    int n = bl->x_r * bl->x_c * bl->x_b;
+    float dgamma[d], dbeta[d], scale[d];
+
+    for (int j = 0; j < d; ++j) {
+        dgamma[j] = 0.0f;
+        dbeta[j] = 0.0f;
+    }
+
+    #pragma omp parallel for schedule(static) reduction(+:dgamma[:d], dbeta[:d])
+    for (int i = 0; i < n; ++i) {
+        for (int j = 0; j < d; ++j) {
+            float dy_val = dy.vals[i * d + j];
+
+            dgamma[j] += dy_val * bl->z_cache.vals[i * d + j];
+            dbeta[j] += dy_val;
+        }
+    }
+
+    for (int j = 0; j < d; ++j) {
+        tens_at(bl->dgamma, j, 0, 0, 0) = dgamma[j];
+        tens_at(bl->dbeta, j, 0, 0, 0) = dbeta[j];
+
+        scale[j] = tens_at(bl->gamma, j, 0, 0, 0) /
+                   sqrtf(tens_at(bl->var_cache, j, 0, 0, 0) + BATCHNORM_EPS);
+    }
+
+    #pragma omp parallel for schedule(static)
+    for (int i = 0; i < n; ++i) {
+        const float *dy_p = dy.vals + i * d;
+        const float *z_p = bl->z_cache.vals + i * d;
+        float *dx_p = dx.vals + i * d;
+
+        #pragma omp simd
+        for (int j = 0; j < d; ++j) {
+            dx_p[j] = (dy_p[j] - dbeta[j] / n - z_p[j] * dgamma[j] / n) * scale[j];
+        }
+    }
+}
+
 void batchnorm_forward(layer l, tens x, tens *y)
 {
     batchnorm_layer *bl = (batchnorm_layer *)l.data;
@@ -48,9 +224,53 @@ void batchnorm_forward(layer l, tens x, tens *y)
     assert(x.dims[D] == bl->x_d);
     assert(x.dims[B] == bl->x_b);
 
-    *y = tens_alloc(bl->x_r, bl->x_c, bl->x_d, bl->x_b);
+    assert(y->dims[R] == bl->x_r);
+    assert(y->dims[C] == bl->x_c);
+    assert(y->dims[D] == bl->x_d);
+    assert(y->dims[B] == bl->x_b);
+
+    if (l.mode == INFERENCE && l.layout == NHWC) {
+        batchnorm_nhwc_forward(bl, x, *y, 0);
+        return;
+    }
+
+    if (l.mode == INFERENCE) {
+        #pragma omp parallel for collapse(2) schedule(static)
+        for (int i = 0; i < bl->x_d; ++i) {
+            for (int j = 0; j < bl->x_b; ++j) {
+                float scale = tens_at(bl->gamma, i, 0, 0, 0) /
+                              sqrtf(tens_at(bl->running_var, i, 0, 0, 0) + BATCHNORM_EPS);
+                float shift = tens_at(bl->beta, i, 0, 0, 0) -
+                              tens_at(bl->running_mean, i, 0, 0, 0) * scale;
+
+                for (int k = 0; k < bl->x_r; ++k) {
+                    for (int l = 0; l < bl->x_c; ++l) {
+                        float a = tens_at(x, k, l, i, j) * scale + shift;
+                        tens_at(*y, k, l, i, j) = bl->act != NULL ? bl->act(a) : a;
+                    }
+                }
+            }
+        }
+
+        return;
+    }
+
+    tens_ensure(&bl->var_cache);
+    tens_ensure(&bl->z_cache);
+    tens_set_layout(&bl->z_cache, l.layout);
+
+    if (bl->act != NULL) {
+        tens_ensure(&bl->a_cache);
+        tens_set_layout(&bl->a_cache, l.layout);
+    }
+
+    if (l.layout == NHWC) {
+        batchnorm_nhwc_forward(bl, x, *y, 1);
+        return;
+    }
 
     int n = bl->x_r * bl->x_c * bl->x_b;
+    float m = BATCHNORM_MOMENTUM;
 
     #pragma omp parallel for schedule(static)
     for (int i = 0; i < bl->x_d; ++i) {
@@ -83,8 +303,14 @@ void batchnorm_forward(layer l, tens x, tens *y)
 
         tens_at(bl->var_cache, i, 0, 0, 0) = var;
 
-        float eps = 1e-5;
-        float stddev = sqrtf(var + eps);
+        float unbiased = n > 1 ? var * n / (n - 1) : var;
+
+        tens_at(bl->running_mean, i, 0, 0, 0) =
+            (1.0f - m) * tens_at(bl->running_mean, i, 0, 0, 0) + m * mean;
+        tens_at(bl->running_var, i, 0, 0, 0) =
+            (1.0f - m) * tens_at(bl->running_var, i, 0, 0, 0) + m * unbiased;
+
+        float stddev = sqrtf(var + BATCHNORM_EPS);
 
         for (int j = 0; j < bl->x_r; ++j) {
             for (int k = 0; k < bl->x_c; ++k) {
@@ -104,14 +330,22 @@ void batchnorm_forward(layer l, tens x, tens *y)
                     float gamma = tens_at(bl->gamma, i, 0, 0, 0);
                     float beta = tens_at(bl->beta, i, 0, 0, 0);
                     float z = tens_at(bl->z_cache, k, l, i, j);
-                    tens_at(*y, k, l, i, j) = gamma * z + beta;
+                    float a = gamma * z + beta;
+
+                    if (bl->act == NULL) {
+                        tens_at(*y, k, l, i, j) = a;
+                        continue;
+                    }
+
+                    tens_at(bl->a_cache, k, l, i, j) = a;
+                    tens_at(*y, k, l, i, j) = bl->act(a);
                 }
             }
         }
     }
 }
 
-void batchnorm_backprop(layer l, tens dy, tens *dx, float rate)
+void batchnorm_backprop(layer l, tens dy, tens *dx)
 {
     batchnorm_layer *bl = (batchnorm_layer *)l.data;
 
@@ -120,8 +354,27 @@ void batchnorm_backprop(layer l, tens dy, tens *dx, float rate)
     assert(dy.dims[D] == bl->x_d);
     assert(dy.dims[B] == bl->x_b);
 
-    *dx = tens_alloc(bl->x_r, bl->x_c, bl->x_d, bl->x_b);
- 
+    assert(dx->dims[R] == bl->x_r);
+    assert(dx->dims[C] == bl->x_c);
+    assert(dx->dims[D] == bl->x_d);
+    assert(dx->dims[B] == bl->x_b);
+
+    if (bl->act != NULL) {
+        tens_ensure(&bl->da);
+        tens_set_layout(&bl->da, dy.layout);
+        tens_func(bl->da, bl->a_cache, bl->dact);
+        tens_had(bl->da, bl->da, dy);
+
+        dy = bl->da;
+    }
+
+    if (l.layout == NHWC) {
+        batchnorm_nhwc_backprop(bl, dy, *dx);
+        tens_scale(bl->dgamma, bl->dgamma, 1.0f / bl->x_b);
+        tens_scale(bl->dbeta, bl->dbeta, 1.0f / bl->x_b);
+        return;
+    }
+
     #pragma omp parallel for schedule(static)
     for (int i = 0; i < bl->x_d; ++i) {
         float dgamma_sum = 0.0f;
@@ -157,23 +410,17 @@ void batchnorm_backprop(layer l, tens dy, tens *dx, float rate)
  
                     float gamma = tens_at(bl->gamma, i, 0, 0, 0);
                     float var = tens_at(bl->var_cache, i, 0, 0, 0);
-                    float eps = 1e-5;
-                    float stddev = sqrtf(var + eps);
+                    float stddev = sqrtf(var + BATCHNORM_EPS);
 
-                    tens_at(*dx, j, k, i, l) =
+                    tens_at(*dx, k, l, i, j) =
                         (dy_val - dbeta_val / n - z_val * dgamma_val / n) * gamma / stddev;
                 }
             }
         }
     }
 
-    tens_scale(bl->dgamma, bl->dgamma, rate / bl->x_b);
-    tens_func(bl->dgamma, bl->dgamma, clip);
-    tens_sub(bl->gamma, bl->gamma, bl->dgamma);
-
-    tens_scale(bl->dbeta, bl->dbeta, rate / bl->x_b);
-    tens_func(bl->dbeta, bl->dbeta, clip);
-    tens_sub(bl->beta, bl->beta, bl->dbeta);
+    tens_scale(bl->dgamma, bl->dgamma, 1.0f / bl->x_b);
+    tens_scale(bl->dbeta, bl->dbeta, 1.0f / bl->x_b);
 }
 
 void batchnorm_destroy(layer l)
@@ -183,11 +430,74 @@ void batchnorm_destroy(layer l)
     tens_destroy(bl->gamma);
     tens_destroy(bl->beta);
 
+    tens_destroy(bl->running_mean);
+    tens_destroy(bl->running_var);
+
     tens_destroy(bl->var_cache);
     tens_destroy(bl->z_cache);
+    tens_destroy(bl->a_cache);
+    tens_destroy(bl->da);
 
     tens_destroy(bl->dgamma);
     tens_destroy(bl->dbeta);
+
+    free(bl);
+}
+
+int batchnorm_params(layer l, tens **params, tens **grads, int *decay)
+{
+    batchnorm_layer *bl = (batchnorm_layer *)l.data;
+
+    params[0] = &bl->gamma;
+    params[1] = &bl->beta;
+
+    grads[0] = &bl->dgamma;
+    grads[1] = &bl->dbeta;
+
+    decay[0] = 0;
+    decay[1] = 0;
+
+    return 2;
+}
+
+int batchnorm_fuse(layer l, func act, func dact)
+{
+    batchnorm_layer *bl = (batchnorm_layer *)l.data;
+
+    if (bl->act != NULL) return -1;
+
+    bl->act = act;
+    bl->dact = dact;
+
+    return 0;
+}
+
+int batchnorm_state(layer l, tens **state)
+{
+    batchnorm_layer *bl = (batchnorm_layer *)l.data;
+
+    state[0] = &bl->running_mean;
+    state[1] = &bl->running_var;
+
+    return 2;
+}
+
+/* The per channel y = scale * x + shift that the layer computes in INFERENCE. */
+void batchnorm_affine(layer l, tens scale, tens shift)
+{
+    batchnorm_layer *bl = (batchnorm_layer *)l.data;
+
+    assert(scale.dims[R] == bl->x_d);
+    assert(shift.dims[R] == bl->x_d);
+
+    for (int i = 0; i < bl->x_d; ++i) {
+        float s = tens_at(bl->gamma, i, 0, 0, 0) /
+                  sqrtf(tens_at(bl->running_var, i, 0, 0, 0) + BATCHNORM_EPS);
+
+        tens_at(scale, i, 0, 0, 0) = s;
+        tens_at(shift, i, 0, 0, 0) = tens_at(bl->beta, i, 0, 0, 0) -
+                                     tens_at(bl->running_mean, i, 0, 0, 0) * s;
+    }
 }
 
 void batchnorm_init(layer l)
@@ -196,6 +506,9 @@ void batchnorm_init(layer l)
 
     tens_fill(bl->gamma, 1.0f);
     tens_fill(bl->beta, 0.0f);
+
+    tens_fill(bl->running_mean, 0.0f);
+    tens_fill(bl->running_var, 1.0f);
 }
 
 void batchnorm_print(layer l)
@@ -212,6 +525,8 @@ void batchnorm_save(layer l, FILE *f)
 
     tens_save(bl->gamma, f);
     tens_save(bl->beta, f);
+    tens_save(bl->running_mean, f);
+    tens_save(bl->running_var, f);
 }
 
 void batchnorm_load(layer l, FILE *f)
@@ -220,4 +535,6 @@ void batchnorm_load(layer l, FILE *f)
 
     tens_load(bl->gamma, f);
     tens_load(bl->beta, f);
+    tens_load(bl->running_mean, f);
+    tens_load(bl->running_var, f);
 }
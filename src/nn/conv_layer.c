@@ -5,15 +5,41 @@
 #include <omp.h>
 #include "nn.h"
 
+#define CONV_MAX_COL (1 << 24)
+
+static int conv_select_algo(conv_layer *cl)
+{
+    int padded = cl->x_padding[TOP] || cl->x_padding[BOTTOM] ||
+                 cl->x_padding[LEFT] || cl->x_padding[RIGHT];
+
+    if (cl->w_r == 1 && cl->w_c == 1 && cl->stride == 1 && !padded) {
+        return CONV_IMPLICIT;
+    }
+
+    if (cl->w_r == 3 && cl->w_c == 3 && cl->stride == 1 &&
+        cl->x_padding[TOP] == 1 && cl->x_padding[BOTTOM] == 1 &&
+        cl->x_padding[LEFT] == 1 && cl->x_padding[RIGHT] == 1) {
+        return CONV_WINOGRAD;
+    }
+
+    long col_size = (long)cl->x_d * cl->w_r * cl->w_c * cl->y_r * cl->y_c;
+
+    if (col_size > CONV_MAX_COL) {
+        return CONV_DIRECT;
+    }
+
+    return CONV_IM2COL;
+}
+
 layer conv_layer_alloc(int x_r, int x_c, int x_d,
                        int x_b, int w_r, int w_c,
                        int convolutions, int stride, int x_padding[4])
 {
     conv_layer *cl = malloc(sizeof(conv_layer));
 
-    int y_r = (x_r + x_padding[0] + x_padding[1] -
+    int y_r = (x_r + x_padding[TOP] + x_padding[BOTTOM] -
                w_r) / stride + 1;
-    int y_c = (x_c + x_padding[2] + x_padding[3] -
+    int y_c = (x_c + x_padding[LEFT] + x_padding[RIGHT] -
                w_c) / stride + 1;
 
     cl->x_r = x_r;
@@ -29,36 +55,79 @@ layer conv_layer_alloc(int x_r, int x_c, int x_d,
     cl->w_c = w_c;
     cl->stride = stride;
 
-    memcpy(cl->x_padding, x_padding, sizeof(x_padding));
+    memcpy(cl->x_padding, x_padding, 4 * sizeof(int));
 
-    int dy_padding[4] = { w_r - 1 - x_padding[TOP],
-                          w_r - 1 - x_padding[BOTTOM],
-                          w_c - 1 - x_padding[LEFT],
-                          w_c - 1 - x_padding[RIGHT] };
-    memcpy(cl->dy_padding, dy_padding, sizeof(dy_padding));
+    cl->algo = conv_select_algo(cl);
 
     cl->w = tens_alloc(w_r, w_c, x_d, convolutions);
     cl->b = tens_alloc(y_r, y_c, convolutions, 1);
 
-    cl->x_padded = tens_alloc(x_r + x_padding[TOP] + x_padding[BOTTOM],
-                              x_c + x_padding[LEFT] + x_padding[RIGHT],
-                              x_d, x_b);
-    cl->dy_padded = tens_alloc(y_r + dy_padding[TOP] + dy_padding[BOTTOM],
-                               y_c + dy_padding[LEFT] + dy_padding[RIGHT],
-                               convolutions, x_b);
-    cl->w_180 = tens_alloc(w_r, w_r, x_d, convolutions);
+    cl->x_cache = tens_lazy(x_r, x_c, x_d, x_b);
+
+    if (cl->algo == CONV_IM2COL) {
+        cl->col = tens_alloc(x_d * w_r * w_c, y_r * y_c, 1, 1);
+    }
+    else if (cl->algo == CONV_WINOGRAD) {
+        cl->col = tens_lazy(x_d * w_r * w_c, y_r * y_c, 1, 1);
+    }
+    else {
+        cl->col = tens_lazy(0, 0, 0, 0);
+    }
+
+    if (cl->algo == CONV_WINOGRAD) {
+        int tiles = ((y_r + 1) / 2) * ((y_c + 1) / 2);
+        int max_d = x_d > convolutions ? x_d : convolutions;
+
+        cl->w_wino = tens_lazy(convolutions, x_d, 16, 1);
+        cl->w_wino_180 = tens_lazy(x_d, convolutions, 16, 1);
+        cl->wino_v = tens_lazy(max_d, tiles, 16, 1);
+        cl->wino_m = tens_lazy(max_d, tiles, 16, 1);
+    }
+    else {
+        cl->w_wino = tens_lazy(0, 0, 0, 0);
+        cl->w_wino_180 = tens_lazy(0, 0, 0, 0);
+        cl->wino_v = tens_lazy(0, 0, 0, 0);
+        cl->wino_m = tens_lazy(0, 0, 0, 0);
+    }
+
+    cl->w_hwio = tens_lazy(x_d * w_r * w_c, convolutions, 1, 1);
+    cl->dw_hwio = tens_lazy(x_d * w_r * w_c, convolutions, 1, 1);
+
+    cl->w_valid = 0;
+
+    cl->act = NULL;
+    cl->dact = NULL;
+    cl->z_cache = tens_lazy(y_r, y_c, convolutions, x_b);
+    cl->dz = tens_lazy(y_r, y_c, convolutions, x_b);
 
-    cl->dw = tens_alloc(w_r, w_r, x_d, convolutions);
+    cl->dw = tens_alloc(w_r, w_c, x_d, convolutions);
     cl->db = tens_alloc(y_r, y_c, convolutions, 1);
 
     layer l;
 
+    l.type = CONV;
     l.data = cl;
+    l.layouts = cl->algo == CONV_DIRECT ? 1 << NCHW : 1 << NCHW | 1 << NHWC;
+
+    l.x_dims[R] = cl->x_r;
+    l.x_dims[C] = cl->x_c;
+    l.x_dims[D] = cl->x_d;
+    l.x_dims[B] = cl->x_b;
+
+    l.y_dims[R] = cl->y_r;
+    l.y_dims[C] = cl->y_c;
+    l.y_dims[D] = cl->convolutions;
+    l.y_dims[B] = cl->x_b;
 
     l.forward = conv_forward;
     l.backprop = conv_backprop;
     l.destroy = conv_destroy;
 
+    l.params = conv_params;
+    l.state = NULL;
+    l.invalidate = conv_invalidate;
+    l.fuse = conv_fuse;
+
     l.init = conv_init;
     l.print = conv_print;
     l.save = conv_save;
@@ -67,19 +136,67 @@ layer conv_layer_alloc(int x_r, int x_c, int x_d,
     return l;
 }
 
-void conv_forward(layer l, tens x, tens *y)
+static void im2col(conv_layer *cl, const float *x, float *col)
 {
-    conv_layer *cl = (conv_layer *)l.data;
+    int k_size = cl->x_d * cl->w_r * cl->w_c;
+    int p_size = cl->y_r * cl->y_c;
 
-    assert(x.dims[R] == cl->x_r);
-    assert(x.dims[C] == cl->x_c);
-    assert(x.dims[D] == cl->x_d);
-    assert(x.dims[B] == cl->x_b);
+    #pragma omp parallel for schedule(static)
+    for (int i = 0; i < k_size; ++i) {
+        int d = i / (cl->w_r * cl->w_c);
+        int n = i / cl->w_c % cl->w_r;
+        int o = i % cl->w_c;
+
+        const float *x_d = x + d * cl->x_r * cl->x_c;
+        float *col_row = col + i * p_size;
+
+        for (int j = 0; j < cl->y_r; ++j) {
+            int r = j * cl->stride + n - cl->x_padding[TOP];
+
+            for (int k = 0; k < cl->y_c; ++k) {
+                int c = k * cl->stride + o - cl->x_padding[LEFT];
+
+                col_row[j * cl->y_c + k] = r >= 0 && r < cl->x_r && c >= 0 && c < cl->x_c ?
+                                           x_d[r * cl->x_c + c] : 0.0f;
+            }
+        }
+    }
+}
+
+static void col2im(conv_layer *cl, const float *col, float *x)
+{
+    int p_size = cl->y_r * cl->y_c;
+
+    #pragma omp parallel for schedule(static)
+    for (int d = 0; d < cl->x_d; ++d) {
+        float *x_d = x + d * cl->x_r * cl->x_c;
+
+        memset(x_d, 0, cl->x_r * cl->x_c * sizeof(float));
+
+        for (int n = 0; n < cl->w_r; ++n) {
+            for (int o = 0; o < cl->w_c; ++o) {
+                const float *col_row = col + ((d * cl->w_r + n) * cl->w_c + o) * p_size;
+
+                for (int j = 0; j < cl->y_r; ++j) {
+                    int r = j * cl->stride + n - cl->x_padding[TOP];
 
-    *y = tens_alloc(cl->y_r, cl->y_c, cl->convolutions, cl->x_b);
+                    if (r < 0 || r >= cl->x_r) continue;
 
-    tens_pad(cl->x_padded, x, cl->x_padding);
+                    for (int k = 0; k < cl->y_c; ++k) {
+                        int c = k * cl->stride + o - cl->x_padding[LEFT];
 
+                        if (c >= 0 && c < cl->x_c) {
+                            x_d[r * cl->x_c + c] += col_row[j * cl->y_c + k];
+                        }
+                    }
+                }
+            }
+        }
+    }
+}
+
+static void conv_direct_forward(conv_layer *cl, tens x, tens y)
+{
     #pragma omp parallel for collapse(2) schedule(static)
     for (int i = 0; i < cl->x_b; ++i) {
         for (int j = 0; j < cl->convolutions; ++j) {
@@ -89,95 +206,484 @@ void conv_forward(layer l, tens x, tens *y)
 
                     for (int m = 0; m < cl->x_d; ++m) {
                         for (int n = 0; n < cl->w_r; ++n) {
+                            int r = k * cl->stride + n - cl->x_padding[TOP];
+
+                            if (r < 0 || r >= cl->x_r) continue;
+
                             for (int o = 0; o < cl->w_c; ++o) {
-                                float x_val = tens_at(cl->x_padded, k + n, l + o, m, i);
-                                float w_val = tens_at(cl->w, n, o, m, j);
-                                sum += x_val * w_val;
+                                int c = l * cl->stride + o - cl->x_padding[LEFT];
+
+                                if (c < 0 || c >= cl->x_c) continue;
+
+                                sum += tens_at(x, r, c, m, i) * tens_at(cl->w, n, o, m, j);
                             }
                         }
                     }
 
-                    tens_at(*y, k, l, j, i) = sum;
+                    tens_at(y, k, l, j, i) = sum;
                 }
             }
         }
     }
+}
+
+static void conv_direct_backprop(conv_layer *cl, tens dy, tens dx)
+{
+    tens_fill(dx, 0.0f);
 
     #pragma omp parallel for collapse(2) schedule(static)
     for (int i = 0; i < cl->x_b; ++i) {
-        for (int j = 0; j < cl->convolutions; ++j) {
+        for (int j = 0; j < cl->x_d; ++j) {
             for (int k = 0; k < cl->y_r; ++k) {
                 for (int l = 0; l < cl->y_c; ++l) {
-                    tens_at(*y, k, l, j, i) += tens_at(cl->b, k, l, j, 0);
+                    for (int m = 0; m < cl->convolutions; ++m) {
+                        float dy_val = tens_at(dy, k, l, m, i);
+
+                        for (int n = 0; n < cl->w_r; ++n) {
+                            int r = k * cl->stride + n - cl->x_padding[TOP];
+
+                            if (r < 0 || r >= cl->x_r) continue;
+
+                            for (int o = 0; o < cl->w_c; ++o) {
+                                int c = l * cl->stride + o - cl->x_padding[LEFT];
+
+                                if (c < 0 || c >= cl->x_c) continue;
+
+                                tens_at(dx, r, c, j, i) += dy_val * tens_at(cl->w, n, o, j, m);
+                            }
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    #pragma omp parallel for collapse(2) schedule(static)
+    for (int i = 0; i < cl->convolutions; ++i) {
+        for (int j = 0; j < cl->x_d; ++j) {
+            for (int k = 0; k < cl->w_r; ++k) {
+                for (int l = 0; l < cl->w_c; ++l) {
+                    float sum = 0.0f;
+
+                    for (int m = 0; m < cl->x_b; ++m) {
+                        for (int n = 0; n < cl->y_r; ++n) {
+                            int r = n * cl->stride + k - cl->x_padding[TOP];
+
+                            if (r < 0 || r >= cl->x_r) continue;
+
+                            for (int o = 0; o < cl->y_c; ++o) {
+                                int c = o * cl->stride + l - cl->x_padding[LEFT];
+
+                                if (c < 0 || c >= cl->x_c) continue;
+
+                                sum += tens_at(cl->x_cache, r, c, j, m) * tens_at(dy, n, o, i, m);
+                            }
+                        }
+                    }
+
+                    tens_at(cl->dw, k, l, j, i) = sum / cl->x_b;
                 }
             }
         }
     }
 }
 
-void conv_backprop(layer l, tens dy, tens *dx, float rate)
+/* Reallocating a derived form of the weights means it has to be rebuilt. */
+static void conv_ensure(conv_layer *cl, tens *t)
 {
-    conv_layer *cl = (conv_layer *)l.data;
+    if (t->vals == NULL) {
+        tens_ensure(t);
+        cl->w_valid = 0;
+    }
+}
 
-    assert(dy.dims[R] == cl->y_r);
-    assert(dy.dims[C] == cl->y_c);
-    assert(dy.dims[D] == cl->convolutions);
-    assert(dy.dims[B] == cl->x_b);
+/* Brings every allocated derived form of the weights up to date. */
+static void conv_prepare(conv_layer *cl)
+{
+    if (cl->w_valid) return;
+
+    if (cl->w_wino.vals != NULL) {
+        winograd_filter(cl->w_wino.vals, cl->w.vals, cl->convolutions, cl->x_d, 0);
+    }
 
-    *dx = tens_alloc(cl->x_r, cl->x_c, cl->x_d, cl->x_b);
+    if (cl->w_wino_180.vals != NULL) {
+        winograd_filter(cl->w_wino_180.vals, cl->w.vals, cl->convolutions, cl->x_d, 1);
+    }
+
+    if (cl->w_hwio.vals != NULL) {
+        #pragma omp parallel for collapse(2) schedule(static)
+        for (int i = 0; i < cl->convolutions; ++i) {
+            for (int j = 0; j < cl->x_d; ++j) {
+                for (int k = 0; k < cl->w_r; ++k) {
+                    for (int l = 0; l < cl->w_c; ++l) {
+                        int row = (k * cl->w_c + l) * cl->x_d + j;
+                        cl->w_hwio.vals[row * cl->convolutions + i] = tens_at(cl->w, k, l, j, i);
+                    }
+                }
+            }
+        }
+    }
 
-    tens_pad(cl->dy_padded, dy, cl->dy_padding);
+    cl->w_valid = 1;
+}
 
-    int flip[4] = { 1, 1, 0, 0 };
-    tens_180(cl->w_180, cl->w, flip);
+static void conv_winograd_forward(conv_layer *cl, tens x, tens y)
+{
+    conv_ensure(cl, &cl->w_wino);
+    tens_ensure(&cl->wino_v);
+    tens_ensure(&cl->wino_m);
+
+    conv_prepare(cl);
 
-    #pragma omp parallel for collapse(2) schedule(static)
     for (int i = 0; i < cl->x_b; ++i) {
-        for (int j = 0; j < cl->x_d; ++j) {
-            for (int k = 0; k < cl->x_r; ++k) {
-                for (int l = 0; l < cl->x_c; ++l) {
-                    float sum = 0.0f;
+        winograd_conv(x.vals + i * cl->x_d * cl->x_r * cl->x_c,
+                      y.vals + i * cl->convolutions * cl->y_r * cl->y_c,
+                      cl->w_wino.vals, cl->x_d, cl->convolutions,
+                      cl->x_r, cl->x_c, cl->wino_v.vals, cl->wino_m.vals);
+    }
+}
 
-                    for (int m = 0; m < cl->convolutions; ++m) {
-                        for (int n = 0; n < cl->w_r; ++n) {
-                            for (int o = 0; o < cl->w_c; ++o) {
-                                float dy_val = tens_at(cl->dy_padded, k + n, l + o, m, i);
-                                float w_180_val = tens_at(cl->w_180, n, o, j, i);
+/*
+ * Channels-last im2col: every row of col is one output pixel and consists
+ * of w_r * w_c contiguous runs of x_d channels, so it is mostly memcpy.
+ */
+static void im2col_nhwc(conv_layer *cl, const float *x, float *col)
+{
+    int k_size = cl->x_d * cl->w_r * cl->w_c;
+    int p_size = cl->y_r * cl->y_c;
 
-                                sum += dy_val * w_180_val;
-                            }
-                        }
-                    }
+    #pragma omp parallel for schedule(static)
+    for (int p = 0; p < p_size; ++p) {
+        float *col_row = col + p * k_size;
+
+        for (int n = 0; n < cl->w_r; ++n) {
+            int r = p / cl->y_c * cl->stride + n - cl->x_padding[TOP];
+
+            for (int o = 0; o < cl->w_c; ++o) {
+                int c = p % cl->y_c * cl->stride + o - cl->x_padding[LEFT];
+                float *dest = col_row + (n * cl->w_c + o) * cl->x_d;
 
-                    tens_at(*dx, k, l, j, i) = sum;
+                if (r >= 0 && r < cl->x_r && c >= 0 && c < cl->x_c) {
+                    memcpy(dest, x + (r * cl->x_c + c) * cl->x_d, cl->x_d * sizeof(float));
+                }
+                else {
+                    memset(dest, 0, cl->x_d * sizeof(float));
                 }
             }
         }
     }
+}
+
+/*
+ * Windows of neighbouring pixels overlap, so instead of scattering each
+ * window every input pixel gathers the window entries that cover it.
+ */
+static void col2im_nhwc(conv_layer *cl, const float *col, float *x)
+{
+    int k_size = cl->x_d * cl->w_r * cl->w_c;
+
+    #pragma omp parallel for collapse(2) schedule(static)
+    for (int r = 0; r < cl->x_r; ++r) {
+        for (int c = 0; c < cl->x_c; ++c) {
+            float *dest = x + (r * cl->x_c + c) * cl->x_d;
+
+            memset(dest, 0, cl->x_d * sizeof(float));
+
+            for (int n = 0; n < cl->w_r; ++n) {
+                int j = r + cl->x_padding[TOP] - n;
+
+                if (j < 0 || j % cl->stride != 0 || j / cl->stride >= cl->y_r) continue;
+
+                for (int o = 0; o < cl->w_c; ++o) {
+                    int k = c + cl->x_padding[LEFT] - o;
+
+                    if (k < 0 || k % cl->stride != 0 || k / cl->stride >= cl->y_c) continue;
+
+                    int p = j / cl->stride * cl->y_c + k / cl->stride;
+                    const float *src = col + p * k_size + (n * cl->w_c + o) * cl->x_d;
+
+                    #pragma omp simd
+                    for (int d = 0; d < cl->x_d; ++d) {
+                        dest[d] += src[d];
+                    }
+                }
+            }
+        }
+    }
+}
+
+static void conv_nhwc_forward(conv_layer *cl, tens x, tens y)
+{
+    int k_size = cl->x_d * cl->w_r * cl->w_c;
+    int p_size = cl->y_r * cl->y_c;
+
+    conv_ensure(cl, &cl->w_hwio);
+
+    if (cl->algo != CONV_IMPLICIT) {
+        tens_ensure(&cl->col);
+    }
+
+    conv_prepare(cl);
+
+    for (int i = 0; i < cl->x_b; ++i) {
+        const float *x_i = x.vals + i * cl->x_r * cl->x_c * cl->x_d;
+        const float *col = x_i;
+
+        if (cl->algo != CONV_IMPLICIT) {
+            im2col_nhwc(cl, x_i, cl->col.vals);
+            col = cl->col.vals;
+        }
+
+        gemm(0, 0, p_size, cl->convolutions, k_size, 1.0f,
+             col, k_size, cl->w_hwio.vals, cl->convolutions,
+             0.0f, y.vals + i * p_size * cl->convolutions, cl->convolutions);
+    }
+}
+
+static void conv_nhwc_backprop(conv_layer *cl, tens dy, tens dx)
+{
+    int k_size = cl->x_d * cl->w_r * cl->w_c;
+    int p_size = cl->y_r * cl->y_c;
+
+    tens_ensure(&cl->dw_hwio);
+
+    for (int i = 0; i < cl->x_b; ++i) {
+        const float *x_i = cl->x_cache.vals + i * cl->x_r * cl->x_c * cl->x_d;
+        const float *dy_i = dy.vals + i * p_size * cl->convolutions;
+        float *dx_i = dx.vals + i * cl->x_r * cl->x_c * cl->x_d;
+
+        const float *col = x_i;
+
+        if (cl->algo != CONV_IMPLICIT) {
+            im2col_nhwc(cl, x_i, cl->col.vals);
+            col = cl->col.vals;
+        }
+
+        gemm(1, 0, k_size, cl->convolutions, p_size, 1.0f / cl->x_b,
+             col, k_size, dy_i, cl->convolutions,
+             i == 0 ? 0.0f : 1.0f, cl->dw_hwio.vals, cl->convolutions);
+
+        if (cl->algo == CONV_IMPLICIT) {
+            gemm(0, 1, p_size, k_size, cl->convolutions, 1.0f,
+                 dy_i, cl->convolutions, cl->w_hwio.vals, cl->convolutions,
+                 0.0f, dx_i, k_size);
+        }
+        else {
+            gemm(0, 1, p_size, k_size, cl->convolutions, 1.0f,
+                 dy_i, cl->convolutions, cl->w_hwio.vals, cl->convolutions,
+                 0.0f, cl->col.vals, k_size);
+
+            col2im_nhwc(cl, cl->col.vals, dx_i);
+        }
+    }
 
     #pragma omp parallel for collapse(2) schedule(static)
     for (int i = 0; i < cl->convolutions; ++i) {
         for (int j = 0; j < cl->x_d; ++j) {
             for (int k = 0; k < cl->w_r; ++k) {
-                for (int l = 0; l < cl->w_r; ++l) {
-                    float sum = 0.0f;
+                for (int l = 0; l < cl->w_c; ++l) {
+                    int row = (k * cl->w_c + l) * cl->x_d + j;
+                    tens_at(cl->dw, k, l, j, i) = cl->dw_hwio.vals[row * cl->convolutions + i];
+                }
+            }
+        }
+    }
+}
 
-                    for (int m = 0; m < cl->x_b; ++m) {
-                        for (int n = 0; n < cl->y_r; ++n) {
-                            for (int o = 0; o < cl->y_c  ; ++o) {
-                                float x_val = tens_at(cl->x_padded, k + n, k + o, j, m);
-                                float dy_val = tens_at(dy, n, o, i, m);
+static void conv_gemm_forward(conv_layer *cl, tens x, tens y)
+{
+    int k_size = cl->x_d * cl->w_r * cl->w_c;
+    int p_size = cl->y_r * cl->y_c;
 
-                                sum += x_val * dy_val;
-                            }
+    for (int i = 0; i < cl->x_b; ++i) {
+        const float *x_i = x.vals + i * cl->x_d * cl->x_r * cl->x_c;
+        const float *col = x_i;
+
+        if (cl->algo == CONV_IM2COL) {
+            im2col(cl, x_i, cl->col.vals);
+            col = cl->col.vals;
+        }
+
+        gemm(0, 0, cl->convolutions, p_size, k_size, 1.0f,
+             cl->w.vals, k_size, col, p_size,
+             0.0f, y.vals + i * cl->convolutions * p_size, p_size);
+    }
+}
+
+static void conv_gemm_backprop(conv_layer *cl, tens dy, tens dx)
+{
+    int k_size = cl->x_d * cl->w_r * cl->w_c;
+    int p_size = cl->y_r * cl->y_c;
+
+    for (int i = 0; i < cl->x_b; ++i) {
+        const float *x_i = cl->x_cache.vals + i * cl->x_d * cl->x_r * cl->x_c;
+        const float *dy_i = dy.vals + i * cl->convolutions * p_size;
+        float *dx_i = dx.vals + i * cl->x_d * cl->x_r * cl->x_c;
+
+        if (cl->algo == CONV_IMPLICIT) {
+            gemm(0, 1, cl->convolutions, k_size, p_size, 1.0f / cl->x_b,
+                 dy_i, p_size, x_i, p_size,
+                 i == 0 ? 0.0f : 1.0f, cl->dw.vals, k_size);
+            gemm(1, 0, k_size, p_size, cl->convolutions, 1.0f,
+                 cl->w.vals, k_size, dy_i, p_size,
+                 0.0f, dx_i, p_size);
+        }
+        else if (cl->algo == CONV_WINOGRAD) {
+            im2col(cl, x_i, cl->col.vals);
+
+            gemm(0, 1, cl->convolutions, k_size, p_size, 1.0f / cl->x_b,
+                 dy_i, p_size, cl->col.vals, p_size,
+                 i == 0 ? 0.0f : 1.0f, cl->dw.vals, k_size);
+
+            winograd_conv(dy_i, dx_i, cl->w_wino_180.vals,
+                          cl->convolutions, cl->x_d, cl->y_r, cl->y_c,
+                          cl->wino_v.vals, cl->wino_m.vals);
+        }
+        else {
+            im2col(cl, x_i, cl->col.vals);
+
+            gemm(0, 1, cl->convolutions, k_size, p_size, 1.0f / cl->x_b,
+                 dy_i, p_size, cl->col.vals, p_size,
+                 i == 0 ? 0.0f : 1.0f, cl->dw.vals, k_size);
+            gemm(1, 0, k_size, p_size, cl->convolutions, 1.0f,
+                 cl->w.vals, k_size, dy_i, p_size,
+                 0.0f, cl->col.vals, p_size);
+
+            col2im(cl, cl->col.vals, dx_i);
+        }
+    }
+}
+
+void conv_forward(layer l, tens x, tens *y)
+{
+    conv_layer *cl = (conv_layer *)l.data;
+
+    assert(x.dims[R] == cl->x_r);
+    assert(x.dims[C] == cl->x_c);
+    assert(x.dims[D] == cl->x_d);
+    assert(x.dims[B] == cl->x_b);
+
+    assert(y->dims[R] == cl->y_r);
+    assert(y->dims[C] == cl->y_c);
+    assert(y->dims[D] == cl->convolutions);
+    assert(y->dims[B] == cl->x_b);
+
+    if (l.mode == TRAINING) {
+        tens_ensure(&cl->x_cache);
+        tens_set_layout(&cl->x_cache, x.layout);
+
+        if (cl->algo == CONV_WINOGRAD && l.layout == NCHW) {
+            tens_ensure(&cl->col);
+            conv_ensure(cl, &cl->w_wino_180);
+        }
+
+        tens_copy(cl->x_cache, x);
+    }
+
+    if (l.layout == NHWC) {
+        conv_nhwc_forward(cl, x, *y);
+    }
+    else if (cl->algo == CONV_DIRECT) {
+        conv_direct_forward(cl, x, *y);
+    }
+    else if (cl->algo == CONV_WINOGRAD) {
+        conv_winograd_forward(cl, x, *y);
+    }
+    else {
+        conv_gemm_forward(cl, x, *y);
+    }
+
+    int cache = l.mode == TRAINING && cl->act != NULL;
+
+    if (cache) {
+        tens_ensure(&cl->z_cache);
+        tens_set_layout(&cl->z_cache, l.layout);
+    }
+
+    if (l.layout == NHWC) {
+        #pragma omp parallel for collapse(2) schedule(static)
+        for (int i = 0; i < cl->x_b; ++i) {
+            for (int k = 0; k < cl->y_r; ++k) {
+                for (int l = 0; l < cl->y_c; ++l) {
+                    float *y_p = &tens_at_nhwc(*y, k, l, 0, i);
+                    float *z_p = cache ? &tens_at_nhwc(cl->z_cache, k, l, 0, i) : NULL;
+
+                    for (int j = 0; j < cl->convolutions; ++j) {
+                        float z = y_p[j] + tens_at(cl->b, k, l, j, 0);
+
+                        if (cache) {
+                            z_p[j] = z;
                         }
+
+                        y_p[j] = cl->act != NULL ? cl->act(z) : z;
                     }
+                }
+            }
+        }
+
+        return;
+    }
+
+    #pragma omp parallel for collapse(2) schedule(static)
+    for (int i = 0; i < cl->x_b; ++i) {
+        for (int j = 0; j < cl->convolutions; ++j) {
+            for (int k = 0; k < cl->y_r; ++k) {
+                for (int l = 0; l < cl->y_c; ++l) {
+                    float z = tens_at(*y, k, l, j, i) + tens_at(cl->b, k, l, j, 0);
 
-                    tens_at(cl->dw, k, l, j, i) = sum;
+                    if (cl->act == NULL) {
+                        tens_at(*y, k, l, j, i) = z;
+                        continue;
+                    }
+
+                    if (cache) {
+                        tens_at(cl->z_cache, k, l, j, i) = z;
+                    }
+
+                    tens_at(*y, k, l, j, i) = cl->act(z);
                 }
             }
         }
     }
+}
+
+void conv_backprop(layer l, tens dy, tens *dx)
+{
+    conv_layer *cl = (conv_layer *)l.data;
+
+    assert(dy.dims[R] == cl->y_r);
+    assert(dy.dims[C] == cl->y_c);
+    assert(dy.dims[D] == cl->convolutions);
+    assert(dy.dims[B] == cl->x_b);
+
+    assert(dx->dims[R] == cl->x_r);
+    assert(dx->dims[C] == cl->x_c);
+    assert(dx->dims[D] == cl->x_d);
+    assert(dx->dims[B] == cl->x_b);
+
+    if (cl->act != NULL) {
+        tens_ensure(&cl->dz);
+        tens_set_layout(&cl->dz, dy.layout);
+        tens_func(cl->dz, cl->z_cache, cl->dact);
+        tens_had(cl->dz, cl->dz, dy);
+
+        dy = cl->dz;
+    }
+
+    if (l.layout == NHWC) {
+        conv_prepare(cl);
+        conv_nhwc_backprop(cl, dy, *dx);
+    }
+    else if (cl->algo == CONV_DIRECT) {
+        conv_direct_backprop(cl, dy, *dx);
+    }
+    else {
+        if (cl->algo == CONV_WINOGRAD) {
+            conv_prepare(cl);
+        }
+
+        conv_gemm_backprop(cl, dy, *dx);
+    }
 
     #pragma omp parallel for schedule(static)
     for (int i = 0; i < cl->convolutions; ++i) {
@@ -186,21 +692,13 @@ void conv_backprop(layer l, tens dy, tens *dx, float rate)
                 float sum = 0;
 
                 for (int l = 0; l < cl->x_b; ++l) {
-                    sum += tens_at(dy, j, k, i, l);
+                    sum += tens_at_strided(dy, j, k, i, l);
                 }
 
-                tens_at(cl->db, j, k, i, 0) = sum;
+                tens_at(cl->db, j, k, i, 0) = sum / cl->x_b;
             }
         }
     }
-
-    tens_scale(cl->dw, cl->dw, rate / cl->x_b);
-    tens_func(cl->dw, cl->dw, clip);
-    tens_sub(cl->w, cl->w, cl->dw);
-
-    tens_scale(cl->db, cl->db, rate / cl->x_b);
-    tens_func(cl->db, cl->db, clip);
-    tens_sub(cl->b, cl->b, cl->db);
 }
 
 void conv_destroy(layer l)
@@ -210,9 +708,18 @@ void conv_destroy(layer l)
     tens_destroy(cl->w);
     tens_destroy(cl->b);
 
-    tens_destroy(cl->x_padded);
-    tens_destroy(cl->dy_padded);
-    tens_destroy(cl->w_180);
+    tens_destroy(cl->x_cache);
+    tens_destroy(cl->col);
+
+    tens_destroy(cl->w_wino);
+    tens_destroy(cl->w_wino_180);
+    tens_destroy(cl->wino_v);
+    tens_destroy(cl->wino_m);
+    tens_destroy(cl->w_hwio);
+    tens_destroy(cl->dw_hwio);
+
+    tens_destroy(cl->z_cache);
+    tens_destroy(cl->dz);
 
     tens_destroy(cl->dw);
     tens_destroy(cl->db);
@@ -220,12 +727,79 @@ void conv_destroy(layer l)
     free(cl);
 }
 
+/* Rescales every output channel so that the layer computes scale * y + shift. */
+void conv_scale(layer l, tens scale, tens shift)
+{
+    conv_layer *cl = (conv_layer *)l.data;
+
+    assert(scale.dims[R] == cl->convolutions);
+    assert(shift.dims[R] == cl->convolutions);
+
+    for (int i = 0; i < cl->convolutions; ++i) {
+        float s = tens_at(scale, i, 0, 0, 0);
+
+        for (int j = 0; j < cl->x_d; ++j) {
+            for (int k = 0; k < cl->w_r; ++k) {
+                for (int l = 0; l < cl->w_c; ++l) {
+                    tens_at(cl->w, k, l, j, i) *= s;
+                }
+            }
+        }
+
+        for (int j = 0; j < cl->y_r; ++j) {
+            for (int k = 0; k < cl->y_c; ++k) {
+                tens_at(cl->b, j, k, i, 0) =
+                    tens_at(cl->b, j, k, i, 0) * s + tens_at(shift, i, 0, 0, 0);
+            }
+        }
+    }
+
+    cl->w_valid = 0;
+}
+
+int conv_fuse(layer l, func act, func dact)
+{
+    conv_layer *cl = (conv_layer *)l.data;
+
+    if (cl->act != NULL) return -1;
+
+    cl->act = act;
+    cl->dact = dact;
+
+    return 0;
+}
+
+int conv_params(layer l, tens **params, tens **grads, int *decay)
+{
+    conv_layer *cl = (conv_layer *)l.data;
+
+    params[0] = &cl->w;
+    params[1] = &cl->b;
+
+    grads[0] = &cl->dw;
+    grads[1] = &cl->db;
+
+    decay[0] = 1;
+    decay[1] = 0;
+
+    return 2;
+}
+
+void conv_invalidate(layer l)
+{
+    conv_layer *cl = (conv_layer *)l.data;
+
+    cl->w_valid = 0;
+}
+
 void conv_init(layer l)
 {
     conv_layer *cl = (conv_layer *)l.data;
 
-    tens_normal(cl->w, 0, sqrt(2.0 / (cl->x_d * cl->w_r * cl->w_r)));
+    tens_normal(cl->w, 0, sqrt(2.0 / (cl->x_d * cl->w_r * cl->w_c)));
     tens_fill(cl->b, 0);
+
+    cl->w_valid = 0;
 }
 
 void conv_print(layer l)
@@ -250,4 +824,6 @@ void conv_load(layer l, FILE *f)
 
     tens_load(cl->w, f);
     tens_load(cl->b, f);
+
+    cl->w_valid = 0;
 }
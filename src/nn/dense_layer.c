@@ -16,26 +16,41 @@ layer dense_layer_alloc(int x_r, int y_r, int x_b)
     dl->w = tens_alloc(y_r, x_r, 1, 1);
     dl->b = tens_alloc(y_r, 1, 1, 1);
 
-    dl->x_reshaped = tens_alloc(x_r, x_b, 1, 1);
-    dl->dot = tens_alloc(y_r, x_b, 1, 1);
+    dl->x_cache = tens_lazy(x_r, 1, 1, x_b);
 
-    dl->x_reshaped_T = tens_alloc(x_b, x_r, 1, 1);
-    dl->w_T = tens_alloc(x_r, y_r, 1, 1);
-
-    dl->dy_reshaped = tens_alloc(y_r, x_b, 1, 1);
-    dl->dx_reshaped = tens_alloc(x_r, x_b, 1, 1);
+    dl->act = NULL;
+    dl->dact = NULL;
+    dl->z_cache = tens_lazy(y_r, 1, 1, x_b);
+    dl->dz = tens_lazy(y_r, 1, 1, x_b);
 
     dl->dw = tens_alloc(y_r, x_r, 1, 1);
     dl->db = tens_alloc(y_r, 1, 1, 1);
 
     layer l;
 
+    l.type = DENSE;
     l.data = dl;
+    l.layouts = 1 << NCHW;
+
+    l.x_dims[R] = dl->x_r;
+    l.x_dims[C] = 1;
+    l.x_dims[D] = 1;
+    l.x_dims[B] = dl->x_b;
+
+    l.y_dims[R] = dl->y_r;
+    l.y_dims[C] = 1;
+    l.y_dims[D] = 1;
+    l.y_dims[B] = dl->x_b;
 
     l.forward = dense_forward;
     l.backprop = dense_backprop;
     l.destroy = dense_destroy;
 
+    l.params = dense_params;
+    l.state = NULL;
+    l.invalidate = NULL;
+    l.fuse = dense_fuse;
+
     l.init = dense_init;
     l.print = dense_print;
     l.save = dense_save;
@@ -53,26 +68,47 @@ void dense_forward(layer l, tens x, tens *y)
     assert(x.dims[D] == 1);
     assert(x.dims[B] == dl->x_b);
 
-    *y = tens_alloc(dl->y_r, 1, 1, dl->x_b);
+    assert(y->dims[R] == dl->y_r);
+    assert(y->dims[C] == 1);
+    assert(y->dims[D] == 1);
+    assert(y->dims[B] == dl->x_b);
 
-    tens_reshape(dl->x_reshaped, x);
+    if (l.mode == TRAINING) {
+        tens_ensure(&dl->x_cache);
+        tens_copy(dl->x_cache, x);
+    }
+
+    tens x_mat = tens_reshape(x, dl->x_b, dl->x_r, 1, 1);
+    tens y_mat = tens_reshape(*y, dl->x_b, dl->y_r, 1, 1);
 
-    int perm[4] = { C, R, D, B };
-    tens_trans(dl->x_reshaped_T, dl->x_reshaped, perm);
+    tens_dot_T2(y_mat, x_mat, dl->w);
 
-    tens_dot(dl->dot, dl->w, dl->x_reshaped);
+    int cache = l.mode == TRAINING && dl->act != NULL;
 
-    tens_reshape(y, dl->dot);
+    if (cache) {
+        tens_ensure(&dl->z_cache);
+    }
 
     #pragma omp parallel for collapse(2) schedule(static)
-    for (int i = 0; i < dl->y_r; ++i) {
-        for (int j = 0; j < dl->x_b; ++j) {
-            tens_at(*y, i, 0, 0, j) = tens_at(dl->b, i, 0, 0, 0);
+    for (int i = 0; i < dl->x_b; ++i) {
+        for (int j = 0; j < dl->y_r; ++j) {
+            float z = tens_at(*y, j, 0, 0, i) + tens_at(dl->b, j, 0, 0, 0);
+
+            if (dl->act == NULL) {
+                tens_at(*y, j, 0, 0, i) = z;
+                continue;
+            }
+
+            if (cache) {
+                tens_at(dl->z_cache, j, 0, 0, i) = z;
+            }
+
+            tens_at(*y, j, 0, 0, i) = dl->act(z);
         }
     }
 }
 
-void dense_backprop(layer l, tens dy, tens *dx, float rate)
+void dense_backprop(layer l, tens dy, tens *dx)
 {
     dense_layer *dl = (dense_layer *)l.data;
 
@@ -81,17 +117,27 @@ void dense_backprop(layer l, tens dy, tens *dx, float rate)
     assert(dy.dims[D] == 1);
     assert(dy.dims[B] == dl->x_b);
 
-    *dx = tens_alloc(dl->x_r, 1, 1, dl->x_b);
+    assert(dx->dims[R] == dl->x_r);
+    assert(dx->dims[C] == 1);
+    assert(dx->dims[D] == 1);
+    assert(dx->dims[B] == dl->x_b);
 
-    int perm[4] = { C, R, D, B };
-    tens_trans(dl->w_T, dl->w, perm);
+    if (dl->act != NULL) {
+        tens_ensure(&dl->dz);
+        tens_set_layout(&dl->dz, dy.layout);
+        tens_func(dl->dz, dl->z_cache, dl->dact);
+        tens_had(dl->dz, dl->dz, dy);
 
-    tens_reshape(dl->dy_reshaped, dy);
+        dy = dl->dz;
+    }
 
-    tens_dot(dl->dx_reshaped, dl->w_T, dl->dy_reshaped);
-    tens_reshape(*dx, dl->dx_reshaped);
+    tens x_mat = tens_reshape(dl->x_cache, dl->x_b, dl->x_r, 1, 1);
+    tens dy_mat = tens_reshape(dy, dl->x_b, dl->y_r, 1, 1);
+    tens dx_mat = tens_reshape(*dx, dl->x_b, dl->x_r, 1, 1);
 
-    tens_dot(dl->dw, dl->dy_reshaped, dl->x_reshaped_T);
+    tens_dot(dx_mat, dy_mat, dl->w);
+    tens_dot_T1(dl->dw, dy_mat, x_mat);
+    tens_scale(dl->dw, dl->dw, 1.0f / dl->x_b);
 
     #pragma omp parallel for schedule(static)
     for (int i = 0; i < dl->y_r; ++i) {
@@ -101,16 +147,8 @@ void dense_backprop(layer l, tens dy, tens *dx, float rate)
             sum += tens_at(dy, i, 0, 0, j);
         }
 
-        tens_at(dl->db, i, 0, 0, 0) = sum;
+        tens_at(dl->db, i, 0, 0, 0) = sum / dl->x_b;
     }
-
-    tens_scale(dl->dw, dl->dw, rate / dl->x_b);
-    tens_func(dl->dw, dl->dw, clip);
-    tens_sub(dl->w, dl->w, dl->dw);
-
-    tens_scale(dl->db, dl->db, rate / dl->x_b);
-    tens_func(dl->db, dl->db, clip);
-    tens_sub(dl->b, dl->b, dl->db);
 }
 
 void dense_destroy(layer l)
@@ -120,14 +158,9 @@ void dense_destroy(layer l)
     tens_destroy(dl->w);
     tens_destroy(dl->b);
 
-    tens_destroy(dl->x_reshaped);
-    tens_destroy(dl->dot);
-
-    tens_destroy(dl->x_reshaped_T);
-    tens_destroy(dl->w_T);
-
-    tens_destroy(dl->dy_reshaped);
-    tens_destroy(dl->dx_reshaped);
+    tens_destroy(dl->x_cache);
+    tens_destroy(dl->z_cache);
+    tens_destroy(dl->dz);
 
     tens_destroy(dl->dw);
     tens_destroy(dl->db);
@@ -135,6 +168,34 @@ void dense_destroy(layer l)
     free(dl);
 }
 
+int dense_fuse(layer l, func act, func dact)
+{
+    dense_layer *dl = (dense_layer *)l.data;
+
+    if (dl->act != NULL) return -1;
+
+    dl->act = act;
+    dl->dact = dact;
+
+    return 0;
+}
+
+int dense_params(layer l, tens **params, tens **grads, int *decay)
+{
+    dense_layer *dl = (dense_layer *)l.data;
+
+    params[0] = &dl->w;
+    params[1] = &dl->b;
+
+    grads[0] = &dl->dw;
+    grads[1] = &dl->db;
+
+    decay[0] = 1;
+    decay[1] = 0;
+
+    return 2;
+}
+
 void dense_init(layer l)
 {
     dense_layer *dl = (dense_layer *)l.data;
@@ -4,6 +4,8 @@
 #include "nn.h"
 #include "utils.h"
 
+#define DROPOUT_CHUNK 4096
+
 layer dropout_layer_alloc(int x_r, int x_c,
                           int x_d, int x_b, float rate)
 {
@@ -14,18 +16,37 @@ layer dropout_layer_alloc(int x_r, int x_c,
     dl->x_d = x_d;
     dl->x_b = x_b;
 
+    assert(rate >= 0.0f && rate < 1.0f);
+
     dl->rate = rate;
 
-    dl->mask = tens_alloc(x_r, x_c, x_d, x_b);
+    dl->mask = NULL;
 
     layer l;
 
+    l.type = DROPOUT;
     l.data = dl;
+    l.layouts = 0;
+
+    l.x_dims[R] = dl->x_r;
+    l.x_dims[C] = dl->x_c;
+    l.x_dims[D] = dl->x_d;
+    l.x_dims[B] = dl->x_b;
+
+    l.y_dims[R] = dl->x_r;
+    l.y_dims[C] = dl->x_c;
+    l.y_dims[D] = dl->x_d;
+    l.y_dims[B] = dl->x_b;
 
     l.forward = dropout_forward;
     l.backprop = dropout_backprop;
     l.destroy = dropout_destroy;
 
+    l.params = NULL;
+    l.state = NULL;
+    l.invalidate = NULL;
+    l.fuse = NULL;
+
     l.init = NULL;
     l.print = NULL;
     l.save = NULL;
@@ -34,34 +55,63 @@ layer dropout_layer_alloc(int x_r, int x_c,
     return l;
 }
 
+/* Kept elements are scaled by 1 / (1 - rate) so inference needs no rescaling. */
+static void dropout_apply(const uint32_t *mask, float *dest, const float *src,
+                          int size, float scale)
+{
+    for (int i = 0; i < size; i += 32) {
+        uint32_t word = mask[i / 32];
+        int bits = size - i < 32 ? size - i : 32;
+
+        #pragma omp simd
+        for (int j = 0; j < bits; ++j) {
+            dest[i + j] = word >> j & 1 ? src[i + j] * scale : 0.0f;
+        }
+    }
+}
+
 void dropout_forward(layer l, tens x, tens *y)
 {
     dropout_layer *dl = (dropout_layer *)l.data;
 
-
     assert(x.dims[R] == dl->x_r);
     assert(x.dims[C] == dl->x_c);
     assert(x.dims[D] == dl->x_d);
     assert(x.dims[B] == dl->x_b);
 
-    *y = tens_alloc(dl->x_r, dl->x_c, dl->x_d, dl->x_b);
-
-    #pragma omp parallel for collapse(2) schedule(static)
-    for (int i = 0; i < dl->x_b; ++i) {
-        for (int j = 0; j < dl->x_d; ++j) {
-            for (int k = 0; k < dl->x_r; ++k) {
-                for (int l = 0; l < dl->x_c; ++l) {
-                    tens_at(dl->mask, k, l, j, i) =
-                        rand_float(0.0f, 1.0f) > dl->rate ? 1.0f : 0.0f;
-                }
-            }
-        }
+    assert(y->dims[R] == dl->x_r);
+    assert(y->dims[C] == dl->x_c);
+    assert(y->dims[D] == dl->x_d);
+    assert(y->dims[B] == dl->x_b);
+
+    if (l.mode == INFERENCE) {
+        *y = x;
+        return;
+    }
+
+    assert(tens_is_contiguous(x) && tens_is_contiguous(*y));
+    assert(x.layout == y->layout);
+
+    int elements = dl->x_b * dl->x_d * dl->x_r * dl->x_c;
+
+    if (dl->mask == NULL) {
+        dl->mask = malloc((elements + 31) / 32 * sizeof(uint32_t));
     }
 
-    tens_had(*y, x, dl->mask);
+    uint64_t stream = rand_stream();
+    float scale = 1.0f / (1.0f - dl->rate);
+
+    /* Mask bits follow memory order and are drawn a chunk at a time, then applied while hot. */
+    #pragma omp parallel for schedule(static)
+    for (int i = 0; i < elements; i += DROPOUT_CHUNK) {
+        int size = elements - i < DROPOUT_CHUNK ? elements - i : DROPOUT_CHUNK;
+
+        rand_bits_fill(dl->mask + i / 32, size, stream, i, 1.0f - dl->rate);
+        dropout_apply(dl->mask + i / 32, y->vals + i, x.vals + i, size, scale);
+    }
 }
 
-void dropout_backprop(layer l, tens dy, tens *dx, float rate)
+void dropout_backprop(layer l, tens dy, tens *dx)
 {
     dropout_layer *dl = (dropout_layer *)l.data;
 
@@ -70,16 +120,31 @@ void dropout_backprop(layer l, tens dy, tens *dx, float rate)
     assert(dy.dims[D] == dl->x_d);
     assert(dy.dims[B] == dl->x_b);
 
-    *dx = tens_alloc(dl->x_r, dl->x_c, dl->x_d, dl->x_b);
+    assert(dx->dims[R] == dl->x_r);
+    assert(dx->dims[C] == dl->x_c);
+    assert(dx->dims[D] == dl->x_d);
+    assert(dx->dims[B] == dl->x_b);
+
+    assert(tens_is_contiguous(dy) && tens_is_contiguous(*dx));
+    assert(dy.layout == dx->layout);
+    assert(dl->mask != NULL);
 
-    tens_had(*dx, dy, dl->mask);
+    int elements = dl->x_b * dl->x_d * dl->x_r * dl->x_c;
+    float scale = 1.0f / (1.0f - dl->rate);
+
+    #pragma omp parallel for schedule(static)
+    for (int i = 0; i < elements; i += DROPOUT_CHUNK) {
+        int size = elements - i < DROPOUT_CHUNK ? elements - i : DROPOUT_CHUNK;
+
+        dropout_apply(dl->mask + i / 32, dx->vals + i, dy.vals + i, size, scale);
+    }
 }
 
 void dropout_destroy(layer l)
 {
     dropout_layer *dl = (dropout_layer *)l.data;
 
-    tens_destroy(dl->mask);
+    free(dl->mask);
 
     free(dl);
 }
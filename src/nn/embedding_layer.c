@@ -4,105 +4,254 @@
 #include <omp.h>
 #include "nn.h"
 
-layer embedding_layer_alloc(int x_size, int batch_size, int e_size, int v_size)
+/* The sinusoid table only depends on the shape, so it is never trained or saved. */
+static void embedding_positions(embedding_layer *el)
+{
+    for (int i = 0; i < el->x_r; ++i) {
+        for (int j = 0; j < el->e_R; ++j) {
+            float angle = i / powf(10000.0f, (float)(j / 2 * 2) / el->e_R);
+
+            tens_at(el->p, i, j, 0, 0) = j % 2 == 0 ? sinf(angle) : cosf(angle);
+        }
+    }
+}
+
+/*
+ * x holds x_r token ids per sequence, stored as floats, and y the e_R wide
+ * embedding of every token plus the sinusoid of its position.
+ */
+layer embedding_layer_alloc(int x_r, int x_b, int e_R, int v_R)
 {
     embedding_layer *el = malloc(sizeof(embedding_layer));
 
-    el->x_size = x_size;
-    el->batch_size = batch_size;
-    el->e_size = esize;
-    el->v_size = v_size;
+    el->x_r = x_r;
+    el->x_b = x_b;
+    el->e_R = e_R;
+    el->v_R = v_R;
+
+    el->e = tens_alloc(v_R, e_R, 1, 1);
+    el->p = tens_alloc(x_r, e_R, 1, 1);
+
+    embedding_positions(el);
+
+    el->x_cache = tens_lazy(x_r, 1, 1, x_b);
+    el->de = tens_alloc(v_R, e_R, 1, 1);
 
-    el->e = mat_alloc(v_size, e_size);
-    el->p = mat_alloc(x_size, e_size);
+    el->offsets = NULL;
+    el->count = 0;
 
     layer l;
 
     l.type = EMBEDDING;
     l.data = el;
+    l.layouts = 1 << NCHW;
+
+    l.x_dims[R] = x_r;
+    l.x_dims[C] = 1;
+    l.x_dims[D] = 1;
+    l.x_dims[B] = x_b;
+
+    l.y_dims[R] = x_r;
+    l.y_dims[C] = e_R;
+    l.y_dims[D] = 1;
+    l.y_dims[B] = x_b;
+
     l.forward = embedding_forward;
     l.backprop = embedding_backprop;
     l.destroy = embedding_destroy;
+
+    l.params = embedding_params;
+    l.state = NULL;
+    l.invalidate = NULL;
+    l.fuse = NULL;
+
     l.init = embedding_init;
+    l.print = embedding_print;
     l.save = embedding_save;
     l.load = embedding_load;
 
     return l;
 }
 
-void embedding_forward(layer l, void *x, void **y)
+static int embedding_spans(embedding_layer *el)
+{
+    return el->offsets != NULL ? el->count : el->x_b;
+}
+
+static void embedding_span(embedding_layer *el, int i, int *start, int *len)
+{
+    if (el->offsets != NULL) {
+        *start = el->offsets[i];
+        *len = el->offsets[i + 1] - el->offsets[i];
+    }
+    else {
+        *start = i * el->x_r;
+        *len = el->x_r;
+    }
+}
+
+void embedding_forward(layer l, tens x, tens *y)
 {
     embedding_layer *el = (embedding_layer *)l.data;
 
-    mat *mat_x = (mat *)x;
+    assert(x.dims[R] == el->x_r);
+    assert(x.dims[C] == 1);
+    assert(x.dims[D] == 1);
+    assert(x.dims[B] == el->x_b);
 
-    assert(mat_x->rows == el->x_size);
-    assert(mat_x->cols == el->batch_size);
+    assert(y->dims[R] == el->x_r);
+    assert(y->dims[C] == el->e_R);
+    assert(y->dims[D] == 1);
+    assert(y->dims[B] == el->x_b);
 
-    tens3D *tens3D_y = malloc(sizeof(tens3D));
-    *tens3D_y = tens3D_alloc(el->x_size, el->e_size, el->batch_size);
+    assert(tens_is_contiguous(x) && tens_is_contiguous(*y));
 
-    for (int i = 0; i < el->x_size; ++i) {
-        for (int j = 0; j < el->e_size; ++j) {
-            for (int k = 0; k < el->batch_size; ++k) {
-                int index = mat_at(*mat_x, i, k);
+    if (l.mode == TRAINING) {
+        tens_ensure(&el->x_cache);
+        tens_copy(el->x_cache, x);
+    }
+
+    int spans = embedding_spans(el);
+
+    if (el->offsets != NULL) {
+        tens_fill(*y, 0.0f);
+    }
 
-                tens3D_at(*tens3D_y, i, j, k) = mat_at(el->e, index, j) + mat_at(el->p, i, j);
+    #pragma omp parallel for schedule(dynamic)
+    for (int i = 0; i < spans; ++i) {
+        int start, len;
+        embedding_span(el, i, &start, &len);
+
+        for (int r = 0; r < len; ++r) {
+            int token = (int)x.vals[start + r];
+            const float *e_t = el->e.vals + token * el->e_R;
+            const float *p_r = el->p.vals + r * el->e_R;
+            float *y_t = y->vals + (start + r) * el->e_R;
+
+            assert(token >= 0 && token < el->v_R);
+
+            #pragma omp simd
+            for (int j = 0; j < el->e_R; ++j) {
+                y_t[j] = e_t[j] + p_r[j];
             }
         }
     }
+}
+
+/*
+ * Rows of de are scattered into by every occurrence of their token, so each
+ * thread owns a slice of the columns instead of a range of tokens. Token ids
+ * get no gradient and dx is zero.
+ */
+void embedding_backprop(layer l, tens dy, tens *dx)
+{
+    embedding_layer *el = (embedding_layer *)l.data;
+
+    assert(dy.dims[R] == el->x_r);
+    assert(dy.dims[C] == el->e_R);
+    assert(dy.dims[D] == 1);
+    assert(dy.dims[B] == el->x_b);
 
-    *y = tens3D_y;
+    assert(tens_is_contiguous(dy));
+
+    tens_fill(el->de, 0.0f);
+
+    int spans = embedding_spans(el);
+
+    #pragma omp parallel
+    {
+        int threads = omp_get_num_threads();
+        int id = omp_get_thread_num();
+        int j0 = el->e_R * id / threads;
+        int j1 = el->e_R * (id + 1) / threads;
+
+        for (int i = 0; i < spans; ++i) {
+            int start, len;
+            embedding_span(el, i, &start, &len);
+
+            for (int t = start; t < start + len; ++t) {
+                float *de_t = el->de.vals + (int)el->x_cache.vals[t] * el->e_R;
+                const float *dy_t = dy.vals + t * el->e_R;
+
+                #pragma omp simd
+                for (int j = j0; j < j1; ++j) {
+                    de_t[j] += dy_t[j];
+                }
+            }
+        }
+    }
+
+    tens_scale(el->de, el->de, 1.0f / el->x_b);
+    tens_fill(*dx, 0.0f);
+}
+
+/*
+ * Packed batches hold count sequences back to back in the x_r * x_b token
+ * slots, sequence i being tokens offsets[i] up to offsets[i + 1]. Positions
+ * restart at every sequence and the slots past offsets[count] embed to zero.
+ */
+void embedding_pack(layer l, const int *offsets, int count)
+{
+    embedding_layer *el = (embedding_layer *)l.data;
+
+    free(el->offsets);
+
+    el->offsets = pack_offsets(offsets, count, el->x_r, el->x_r * el->x_b);
+    el->count = count;
 }
 
 void embedding_destroy(layer l)
 {
     embedding_layer *el = (embedding_layer *)l.data;
 
-    free(el->e.vals);
-    free(el->p.vals);
+    tens_destroy(el->e);
+    tens_destroy(el->p);
+
+    tens_destroy(el->x_cache);
+    tens_destroy(el->de);
 
+    free(el->offsets);
     free(el);
 }
 
+int embedding_params(layer l, tens **params, tens **grads, int *decay)
+{
+    embedding_layer *el = (embedding_layer *)l.data;
+
+    params[0] = &el->e;
+    grads[0] = &el->de;
+
+    decay[0] = 1;
+
+    return 1;
+}
+
 void embedding_init(layer l)
 {
     embedding_layer *el = (embedding_layer *)l.data;
 
-    float range = 1.0f / sqrtf(el->y_size);
+    float range = 1.0f / sqrtf(el->e_R);
 
-    for (int i = 0; i < el->v_size; ++i) {
-        for (int j = 0; j < el->y_size; ++j) {
-            mat_at(el->e, i, j) = rand_float(-range, range);
-        }
-    }
+    tens_rand(el->e, -range, range);
+}
 
-    for (int i = 0; i < el->x_size; ++i) {
-        for (int j = 0; j < el->y_size; ++j) {
-            float denom = pow(10 * 1000.0f, (float)(j / 2) / el->y_size);
+void embedding_print(layer l)
+{
+    embedding_layer *el = (embedding_layer *)l.data;
 
-            if (j % 2 == 0) {
-                mat_at(el->p, i, j) = sinf(i / denom);
-            }
-            else {
-                mat_at(el->p, i, j) = cosf(i / denom);
-            }
-        }
-    }
+    tens_print(el->e);
 }
 
 void embedding_save(layer l, FILE *f)
 {
     embedding_layer *el = (embedding_layer *)l.data;
 
-    mat_save(el->e, f);
-    mat_save(el->p, f);
+    tens_save(el->e, f);
 }
 
 void embedding_load(layer l, FILE *f)
 {
     embedding_layer *el = (embedding_layer *)l.data;
 
-    mat_load(el->e, f);
-    mat_load(el->p, f);
+    tens_load(el->e, f);
 }
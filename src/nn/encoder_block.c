@@ -2,85 +2,363 @@
 #include <assert.h>
 #include "nn.h"
 
-block encoder_block_alloc(int sub_layers, int seq_len, int d_model,
-                          int d_k, int d_ff, int batch_size)
+/*
+ * Post-norm transformer encoder: n = norm(x + attention(x)) and
+ * y = norm(n + mlp(n)), where the MLP is applied to every token with a
+ * fused ReLU between its two dense layers.
+ */
+layer encoder_block_alloc(int seq_len, int d_model,
+                          int d_k, int d_ff, int x_b)
 {
     assert(d_model % d_k == 0);
 
     encoder_block *eb = malloc(sizeof(encoder_block));
 
-    eb->sub_layers = sub_layers;
     eb->seq_len = seq_len;
     eb->d_model = d_model;
     eb->d_k = d_k;
-    eb->h_size = d_model / d_k;
     eb->d_ff = d_ff;
-    eb->batch_size = batch_size;
-
-    eb->a_skip = tens4D_alloc(seq_len, d_model, batch_size, sub_layers);
-    eb->ff_skip = tens4D_alloc(seq_len, d_model, batch_size, sub_layers);
-
-    eb->attention_layers = malloc(sub_layers * sizeof(layer));
-    eb->attention_layernorm_layers = malloc(sub_layers * sizeof(layer));
-    eb->mlp_hidden_layers = malloc(sub_layers * sizeof(layer));
-    eb->relu_layers = malloc(sub_layer * sizeof(layer));
-    eb->mlp_output_layers = malloc(sub_layers * sizeof(layer));
-    eb->mlp_layernorm_layers = malloc(sub_layers * sizeof(layer));
-
-    for (int i = 0; i < sub_layers; ++i) {
-        eb->attention_layers[i] = attention_layer_alloc(d_model, seq_len,
-                                                        d_k, batch_size);
-        eb->attention_layernorm_layers[i] = layernorm_layer_3D_alloc(d_model, seq_len, batch_size);
-        eb->mlp_hidden_layers[i] = dense_layer_alloc(d_model, d_ff, seq_len);
-        eb->relu_layers[i] = relu_layer_alloc_3D(d_ff, seq_len, batch_size);
-        eb->mlp_output_layers[i] = dense_layer_alloc(d_ff, d_model, seq_len);
-        eb->mlp_layernorm_layers[i] = layernorm_layer_2D_alloc(d_model, seq_len)
+    eb->x_b = x_b;
+
+    int tokens = seq_len * x_b;
+
+    eb->attention = attention_layer_alloc(seq_len, d_model, d_k, x_b);
+    eb->attention_norm = layernorm_layer_alloc(seq_len, d_model, 1, x_b);
+    eb->mlp_hidden = dense_layer_alloc(d_model, d_ff, tokens);
+    eb->mlp_output = dense_layer_alloc(d_ff, d_model, tokens);
+    eb->mlp_norm = layernorm_layer_alloc(seq_len, d_model, 1, x_b);
+
+    eb->mlp_hidden.fuse(eb->mlp_hidden, relu, drelu);
+
+    /* The activations are only passed between sublayers, which cache what they need. */
+    eb->a = tens_lazy(seq_len, d_model, 1, x_b);
+    eb->n = tens_lazy(seq_len, d_model, 1, x_b);
+    eb->h = tens_lazy(seq_len, d_ff, 1, x_b);
+    eb->f = tens_lazy(seq_len, d_model, 1, x_b);
+
+    eb->stepping = 0;
+    eb->a_step = tens_lazy(1, d_model, 1, x_b);
+    eb->n_step = tens_lazy(1, d_model, 1, x_b);
+    eb->h_step = tens_lazy(1, d_ff, 1, x_b);
+    eb->f_step = tens_lazy(1, d_model, 1, x_b);
+
+    layer l;
+
+    l.type = ENCODER;
+    l.data = eb;
+    l.layouts = 1 << NCHW;
+
+    l.x_dims[R] = seq_len;
+    l.x_dims[C] = d_model;
+    l.x_dims[D] = 1;
+    l.x_dims[B] = x_b;
+
+    l.y_dims[R] = seq_len;
+    l.y_dims[C] = d_model;
+    l.y_dims[D] = 1;
+    l.y_dims[B] = x_b;
+
+    l.forward = encoder_forward;
+    l.backprop = encoder_backprop;
+    l.destroy = encoder_destroy;
+
+    l.params = encoder_params;
+    l.state = NULL;
+    l.invalidate = NULL;
+    l.fuse = NULL;
+
+    l.init = encoder_init;
+    l.print = encoder_print;
+    l.save = encoder_save;
+    l.load = encoder_load;
+
+    return l;
+}
+
+static layer encoder_sub(layer sub, int mode)
+{
+    sub.mode = mode;
+    sub.layout = NCHW;
+
+    return sub;
+}
+
+/* Token-major activations seen by a dense layer: one column per token. */
+static tens encoder_tokens(tens t)
+{
+    return tens_reshape(t, t.dims[C], 1, 1, t.dims[R] * t.dims[B]);
+}
+
+void encoder_forward(layer l, tens x, tens *y)
+{
+    encoder_block *eb = (encoder_block *)l.data;
+
+    assert(x.dims[R] == eb->seq_len);
+    assert(x.dims[C] == eb->d_model);
+    assert(x.dims[D] == 1);
+    assert(x.dims[B] == eb->x_b);
+
+    assert(y->dims[R] == eb->seq_len);
+    assert(y->dims[C] == eb->d_model);
+    assert(y->dims[D] == 1);
+    assert(y->dims[B] == eb->x_b);
+
+    layer attention = encoder_sub(eb->attention, l.mode);
+    layer attention_norm = encoder_sub(eb->attention_norm, l.mode);
+    layer mlp_hidden = encoder_sub(eb->mlp_hidden, l.mode);
+    layer mlp_output = encoder_sub(eb->mlp_output, l.mode);
+    layer mlp_norm = encoder_sub(eb->mlp_norm, l.mode);
+
+    tens_ensure(&eb->a);
+    tens_ensure(&eb->n);
+    tens_ensure(&eb->h);
+    tens_ensure(&eb->f);
+
+    tens n_tokens = encoder_tokens(eb->n);
+    tens h_tokens = encoder_tokens(eb->h);
+    tens f_tokens = encoder_tokens(eb->f);
+
+    attention.forward(attention, x, &eb->a);
+    tens_add(eb->a, eb->a, x);
+    attention_norm.forward(attention_norm, eb->a, &eb->n);
+
+    mlp_hidden.forward(mlp_hidden, n_tokens, &h_tokens);
+    mlp_output.forward(mlp_output, h_tokens, &f_tokens);
+    tens_add(eb->f, eb->f, eb->n);
+    mlp_norm.forward(mlp_norm, eb->f, y);
+}
+
+void encoder_backprop(layer l, tens dy, tens *dx)
+{
+    encoder_block *eb = (encoder_block *)l.data;
+
+    assert(dy.dims[R] == eb->seq_len);
+    assert(dy.dims[C] == eb->d_model);
+    assert(dy.dims[D] == 1);
+    assert(dy.dims[B] == eb->x_b);
+
+    assert(dx->dims[R] == eb->seq_len);
+    assert(dx->dims[C] == eb->d_model);
+    assert(dx->dims[D] == 1);
+    assert(dx->dims[B] == eb->x_b);
+
+    layer attention = encoder_sub(eb->attention, l.mode);
+    layer attention_norm = encoder_sub(eb->attention_norm, l.mode);
+    layer mlp_hidden = encoder_sub(eb->mlp_hidden, l.mode);
+    layer mlp_output = encoder_sub(eb->mlp_output, l.mode);
+    layer mlp_norm = encoder_sub(eb->mlp_norm, l.mode);
+
+    tens n_tokens = encoder_tokens(eb->n);
+    tens h_tokens = encoder_tokens(eb->h);
+    tens f_tokens = encoder_tokens(eb->f);
+
+    /* The forward buffers are reused for the matching gradients. */
+    mlp_norm.backprop(mlp_norm, dy, &eb->f);
+    mlp_output.backprop(mlp_output, f_tokens, &h_tokens);
+    mlp_hidden.backprop(mlp_hidden, h_tokens, &n_tokens);
+    tens_add(eb->n, eb->n, eb->f);
+
+    attention_norm.backprop(attention_norm, eb->n, &eb->a);
+    attention.backprop(attention, eb->a, dx);
+    tens_add(*dx, *dx, eb->a);
+
+    /* Dense layers average over tokens, the rest of the block over sequences. */
+    dense_layer *hidden = (dense_layer *)eb->mlp_hidden.data;
+    dense_layer *output = (dense_layer *)eb->mlp_output.data;
+
+    tens_scale(hidden->dw, hidden->dw, eb->seq_len);
+    tens_scale(hidden->db, hidden->db, eb->seq_len);
+    tens_scale(output->dw, output->dw, eb->seq_len);
+    tens_scale(output->db, output->db, eb->seq_len);
+}
+
+/* Points the parameters of a one token copy of sub at those of sub. */
+static void encoder_share(layer step, layer sub, int first)
+{
+    tens *params[LAYER_MAX_PARAMS];
+    tens *grads[LAYER_MAX_PARAMS];
+    tens *step_params[LAYER_MAX_PARAMS];
+    tens *step_grads[LAYER_MAX_PARAMS];
+    int decay[LAYER_MAX_PARAMS];
+
+    int count = sub.params(sub, params, grads, decay);
+
+    step.params(step, step_params, step_grads, decay);
+
+    for (int i = 0; i < count; ++i) {
+        if (first) {
+            tens_destroy(*step_params[i]);
+        }
+
+        *step_params[i] = *params[i];
+        step_params[i]->owner = 0;
     }
+}
+
+/*
+ * Runs the block on one new token per sequence, attending over the tokens
+ * seen since the last encoder_reset through the attention K/V cache. The
+ * norms and the MLP work per token, so they run as one token copies that
+ * share the block's parameters.
+ */
+void encoder_decode(layer l, tens x, tens *y)
+{
+    encoder_block *eb = (encoder_block *)l.data;
 
-    block b;
+    assert(x.dims[R] == 1);
+    assert(x.dims[C] == eb->d_model);
+    assert(x.dims[D] == 1);
+    assert(x.dims[B] == eb->x_b);
 
-    b.data = eb;
+    assert(y->dims[R] == 1);
+    assert(y->dims[C] == eb->d_model);
+    assert(y->dims[D] == 1);
+    assert(y->dims[B] == eb->x_b);
+
+    layer subs[4] = { eb->attention_norm, eb->mlp_hidden, eb->mlp_output, eb->mlp_norm };
+
+    if (!eb->stepping) {
+        eb->steps[0] = layernorm_layer_alloc(1, eb->d_model, 1, eb->x_b);
+        eb->steps[1] = dense_layer_alloc(eb->d_model, eb->d_ff, eb->x_b);
+        eb->steps[2] = dense_layer_alloc(eb->d_ff, eb->d_model, eb->x_b);
+        eb->steps[3] = layernorm_layer_alloc(1, eb->d_model, 1, eb->x_b);
+
+        eb->steps[1].fuse(eb->steps[1], relu, drelu);
+    }
+
+    for (int i = 0; i < 4; ++i) {
+        encoder_share(eb->steps[i], subs[i], !eb->stepping);
+        eb->steps[i] = encoder_sub(eb->steps[i], INFERENCE);
+    }
 
-    b.forward = encoder_forward;
-    b.backprop = encoder_backprop;
-    b.destroy = encoder_destroy;
+    eb->stepping = 1;
 
-    b.init = encoder_init;
-    b.print = encoder_print;
-    b.save = encoder_save;
-    b.load = encoder_load;
+    tens_ensure(&eb->a_step);
+    tens_ensure(&eb->n_step);
+    tens_ensure(&eb->h_step);
+    tens_ensure(&eb->f_step);
 
-    return b;
+    tens n_tokens = encoder_tokens(eb->n_step);
+    tens h_tokens = encoder_tokens(eb->h_step);
+    tens f_tokens = encoder_tokens(eb->f_step);
+
+    attention_decode(eb->attention, x, &eb->a_step);
+    tens_add(eb->a_step, eb->a_step, x);
+    eb->steps[0].forward(eb->steps[0], eb->a_step, &eb->n_step);
+
+    eb->steps[1].forward(eb->steps[1], n_tokens, &h_tokens);
+    eb->steps[2].forward(eb->steps[2], h_tokens, &f_tokens);
+    tens_add(eb->f_step, eb->f_step, eb->n_step);
+    eb->steps[3].forward(eb->steps[3], eb->f_step, y);
 }
 
-void encoder_forward(block b, tens x, tens *y)
+void encoder_reset(layer l)
 {
-    encoder_block *eb = (encoder_block *)b.data;
+    encoder_block *eb = (encoder_block *)l.data;
 
-    assert(x.type == TENS3D);
-    assert(x.t3.rows == eb->seq_len);
-    assert(x.t3.cols == eb->d_model);
-    assert(x.t3.depth == eb->batch_size);
+    attention_reset(eb->attention);
+}
 
-    y->type = TENS3D;
-    y->t3.rows = eb->seq_len;
-    y->t3.cols = eb->d_model;
-    y->t3.depth == eb->batch_size;
+/* Padded tokens still pass through the MLP; keep their dy zero in training. */
+void encoder_mask(layer l, int causal, const int *lengths)
+{
+    encoder_block *eb = (encoder_block *)l.data;
 
-    tens x_current = x;
-    tens y_current;
+    attention_mask(eb->attention, causal, lengths);
+}
 
-    for (int i = 0; i < eb->sub_layers; ++i) {
-        tens3D_copy(eb->a_skip.tens3Ds[i], x_current.t3);
+/* Only attention sees sequence boundaries; the rest of the block is per token. */
+void encoder_pack(layer l, const int *offsets, int count)
+{
+    encoder_block *eb = (encoder_block *)l.data;
 
-        eb->attention_layers[i].forward(eb->attention_layers[i], x_current, &y_current);
+    attention_pack(eb->attention, offsets, count);
+}
 
-        tens3D_add(y_current.t3, y_current.t3, eb->a_skip.tens3Ds[i]);
+void encoder_destroy(layer l)
+{
+    encoder_block *eb = (encoder_block *)l.data;
 
-        x_current = y_current;
+    eb->attention.destroy(eb->attention);
+    eb->attention_norm.destroy(eb->attention_norm);
+    eb->mlp_hidden.destroy(eb->mlp_hidden);
+    eb->mlp_output.destroy(eb->mlp_output);
+    eb->mlp_norm.destroy(eb->mlp_norm);
 
-        eb->attention_layernorm_layers[i].forward(eb->attention_layernorm_layers[i], x_current, &y_current);
+    tens_destroy(eb->a);
+    tens_destroy(eb->n);
+    tens_destroy(eb->h);
+    tens_destroy(eb->f);
 
-        x_current = y_current;
+    if (eb->stepping) {
+        for (int i = 0; i < 4; ++i) {
+            eb->steps[i].destroy(eb->steps[i]);
+        }
     }
+
+    tens_destroy(eb->a_step);
+    tens_destroy(eb->n_step);
+    tens_destroy(eb->h_step);
+    tens_destroy(eb->f_step);
+
+    free(eb);
+}
+
+int encoder_params(layer l, tens **params, tens **grads, int *decay)
+{
+    encoder_block *eb = (encoder_block *)l.data;
+
+    layer subs[5] = { eb->attention, eb->attention_norm, eb->mlp_hidden,
+                      eb->mlp_output, eb->mlp_norm };
+    int count = 0;
+
+    for (int i = 0; i < 5; ++i) {
+        count += subs[i].params(subs[i], params + count, grads + count, decay + count);
+    }
+
+    return count;
+}
+
+void encoder_init(layer l)
+{
+    encoder_block *eb = (encoder_block *)l.data;
+
+    eb->attention.init(eb->attention);
+    eb->attention_norm.init(eb->attention_norm);
+    eb->mlp_hidden.init(eb->mlp_hidden);
+    eb->mlp_output.init(eb->mlp_output);
+    eb->mlp_norm.init(eb->mlp_norm);
+}
+
+void encoder_print(layer l)
+{
+    encoder_block *eb = (encoder_block *)l.data;
+
+    eb->attention.print(eb->attention);
+    eb->attention_norm.print(eb->attention_norm);
+    eb->mlp_hidden.print(eb->mlp_hidden);
+    eb->mlp_output.print(eb->mlp_output);
+    eb->mlp_norm.print(eb->mlp_norm);
+}
+
+void encoder_save(layer l, FILE *f)
+{
+    encoder_block *eb = (encoder_block *)l.data;
+
+    eb->attention.save(eb->attention, f);
+    eb->attention_norm.save(eb->attention_norm, f);
+    eb->mlp_hidden.save(eb->mlp_hidden, f);
+    eb->mlp_output.save(eb->mlp_output, f);
+    eb->mlp_norm.save(eb->mlp_norm, f);
+}
+
+void encoder_load(layer l, FILE *f)
+{
+    encoder_block *eb = (encoder_block *)l.data;
+
+    eb->attention.load(eb->attention, f);
+    eb->attention_norm.load(eb->attention_norm, f);
+    eb->mlp_hidden.load(eb->mlp_hidden, f);
+    eb->mlp_output.load(eb->mlp_output, f);
+    eb->mlp_norm.load(eb->mlp_norm, f);
 }
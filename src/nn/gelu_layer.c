@@ -12,16 +12,33 @@ layer gelu_layer_alloc(int x_r, int x_c,
     gl->x_d = x_d;
     gl->x_b = x_b;
 
-    gl->x_cache = tens_alloc(x_r, x_c, x_d, x_b);
+    gl->x_cache = tens_lazy(x_r, x_c, x_d, x_b);
 
     layer l;
 
+    l.type = GELU;
     l.data = gl;
+    l.layouts = 0;
+
+    l.x_dims[R] = gl->x_r;
+    l.x_dims[C] = gl->x_c;
+    l.x_dims[D] = gl->x_d;
+    l.x_dims[B] = gl->x_b;
+
+    l.y_dims[R] = gl->x_r;
+    l.y_dims[C] = gl->x_c;
+    l.y_dims[D] = gl->x_d;
+    l.y_dims[B] = gl->x_b;
 
     l.forward = gelu_forward;
     l.backprop = gelu_backprop;
     l.destroy = gelu_destroy;
 
+    l.params = NULL;
+    l.state = NULL;
+    l.invalidate = NULL;
+    l.fuse = NULL;
+
     l.init = NULL;
     l.print = NULL;
     l.save = NULL;
@@ -39,14 +56,21 @@ void gelu_forward(layer l, tens x, tens *y)
     assert(x.dims[D] == gl->x_d);
     assert(x.dims[B] == gl->x_b);
 
-    *y = tens_alloc(gl->x_r, gl->x_c, gl->x_d, gl->x_b);
+    assert(y->dims[R] == gl->x_r);
+    assert(y->dims[C] == gl->x_c);
+    assert(y->dims[D] == gl->x_d);
+    assert(y->dims[B] == gl->x_b);
 
-    tens_copy(gl->x_cache, x);
+    if (l.mode == TRAINING) {
+        tens_ensure(&gl->x_cache);
+        tens_set_layout(&gl->x_cache, x.layout);
+        tens_copy(gl->x_cache, x);
+    }
 
     tens_func(*y, x, gelu);
 }
 
-void gelu_backprop(layer l, tens dy, tens *dx, float rate)
+void gelu_backprop(layer l, tens dy, tens *dx)
 {
     gelu_layer *gl = (gelu_layer *)l.data;
 
@@ -55,7 +79,10 @@ void gelu_backprop(layer l, tens dy, tens *dx, float rate)
     assert(dy.dims[D] == gl->x_d);
     assert(dy.dims[B] == gl->x_b);
 
-    *dx = tens_alloc(gl->x_r, gl->x_c, gl->x_d, gl->x_b);
+    assert(dx->dims[R] == gl->x_r);
+    assert(dx->dims[C] == gl->x_c);
+    assert(dx->dims[D] == gl->x_d);
+    assert(dx->dims[B] == gl->x_b);
 
     tens_func(*dx, gl->x_cache, dgelu);
     tens_had(*dx, *dx, dy);
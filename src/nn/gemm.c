@@ -0,0 +1,221 @@
+#include <stdlib.h>
+#include <string.h>
+#include <omp.h>
+#include "nn.h"
+
+#if defined(__AVX512F__) || defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+#if defined(__AVX512F__)
+#define MR 6
+#define NR 32
+#elif defined(__AVX2__)
+#define MR 6
+#define NR 16
+#else
+#define MR 4
+#define NR 8
+#endif
+
+#define MC (MR * 16)
+#define KC 256
+#define NC (NR * 16)
+
+static _Thread_local float *a_pack;
+static _Thread_local float *b_pack;
+
+static void pack_a(float *dest, const float *a, int lda, int trans,
+                   int i0, int p0, int mc, int kc)
+{
+    for (int i = 0; i < mc; i += MR) {
+        int mr = mc - i < MR ? mc - i : MR;
+
+        for (int p = 0; p < kc; ++p) {
+            for (int r = 0; r < MR; ++r) {
+                float val = 0.0f;
+
+                if (r < mr) {
+                    int row = i0 + i + r;
+                    int col = p0 + p;
+                    val = trans ? a[col * lda + row] : a[row * lda + col];
+                }
+
+                dest[p * MR + r] = val;
+            }
+        }
+
+        dest += kc * MR;
+    }
+}
+
+static void pack_b(float *dest, const float *b, int ldb, int trans,
+                   int p0, int j0, int kc, int nc)
+{
+    for (int j = 0; j < nc; j += NR) {
+        int nr = nc - j < NR ? nc - j : NR;
+
+        for (int p = 0; p < kc; ++p) {
+            int row = p0 + p;
+
+            if (!trans && nr == NR) {
+                memcpy(dest + p * NR, b + row * ldb + j0 + j, NR * sizeof(float));
+                continue;
+            }
+
+            for (int c = 0; c < NR; ++c) {
+                float val = 0.0f;
+
+                if (c < nr) {
+                    int col = j0 + j + c;
+                    val = trans ? b[col * ldb + row] : b[row * ldb + col];
+                }
+
+                dest[p * NR + c] = val;
+            }
+        }
+
+        dest += kc * NR;
+    }
+}
+
+static void kernel(int kc, const float *a, const float *b, float *tile)
+{
+#if defined(__AVX512F__)
+    __m512 acc[MR][2];
+
+    for (int r = 0; r < MR; ++r) {
+        acc[r][0] = _mm512_setzero_ps();
+        acc[r][1] = _mm512_setzero_ps();
+    }
+
+    for (int p = 0; p < kc; ++p) {
+        __m512 b0 = _mm512_load_ps(b + p * NR);
+        __m512 b1 = _mm512_load_ps(b + p * NR + 16);
+
+        for (int r = 0; r < MR; ++r) {
+            __m512 a_val = _mm512_set1_ps(a[p * MR + r]);
+            acc[r][0] = _mm512_fmadd_ps(a_val, b0, acc[r][0]);
+            acc[r][1] = _mm512_fmadd_ps(a_val, b1, acc[r][1]);
+        }
+    }
+
+    for (int r = 0; r < MR; ++r) {
+        _mm512_store_ps(tile + r * NR, acc[r][0]);
+        _mm512_store_ps(tile + r * NR + 16, acc[r][1]);
+    }
+#elif defined(__AVX2__)
+    __m256 acc[MR][2];
+
+    for (int r = 0; r < MR; ++r) {
+        acc[r][0] = _mm256_setzero_ps();
+        acc[r][1] = _mm256_setzero_ps();
+    }
+
+    for (int p = 0; p < kc; ++p) {
+        __m256 b0 = _mm256_load_ps(b + p * NR);
+        __m256 b1 = _mm256_load_ps(b + p * NR + 8);
+
+        for (int r = 0; r < MR; ++r) {
+            __m256 a_val = _mm256_broadcast_ss(a + p * MR + r);
+            acc[r][0] = _mm256_fmadd_ps(a_val, b0, acc[r][0]);
+            acc[r][1] = _mm256_fmadd_ps(a_val, b1, acc[r][1]);
+        }
+    }
+
+    for (int r = 0; r < MR; ++r) {
+        _mm256_store_ps(tile + r * NR, acc[r][0]);
+        _mm256_store_ps(tile + r * NR + 8, acc[r][1]);
+    }
+#else
+    for (int i = 0; i < MR * NR; ++i) {
+        tile[i] = 0.0f;
+    }
+
+    for (int p = 0; p < kc; ++p) {
+        for (int r = 0; r < MR; ++r) {
+            float a_val = a[p * MR + r];
+
+            for (int c = 0; c < NR; ++c) {
+                tile[r * NR + c] += a_val * b[p * NR + c];
+            }
+        }
+    }
+#endif
+}
+
+static void gemm_block(int trans_a, int trans_b, int m, int n, int k, float alpha,
+                       const float *a, int lda, const float *b, int ldb,
+                       float beta, float *c, int ldc, int i0, int j0)
+{
+    if (a_pack == NULL) {
+        a_pack = aligned_alloc(64, MC * KC * sizeof(float));
+        b_pack = aligned_alloc(64, KC * NC * sizeof(float));
+    }
+
+    _Alignas(64) float tile[MR * NR];
+
+    int mc = m - i0 < MC ? m - i0 : MC;
+    int nc = n - j0 < NC ? n - j0 : NC;
+
+    for (int p0 = 0; p0 < k; p0 += KC) {
+        int kc = k - p0 < KC ? k - p0 : KC;
+        float scale = p0 == 0 ? beta : 1.0f;
+
+        pack_a(a_pack, a, lda, trans_a, i0, p0, mc, kc);
+        pack_b(b_pack, b, ldb, trans_b, p0, j0, kc, nc);
+
+        for (int j = 0; j < nc; j += NR) {
+            int nr = nc - j < NR ? nc - j : NR;
+
+            for (int i = 0; i < mc; i += MR) {
+                int mr = mc - i < MR ? mc - i : MR;
+
+                kernel(kc, a_pack + i * kc, b_pack + j * kc, tile);
+
+                for (int r = 0; r < mr; ++r) {
+                    float *c_row = c + (i0 + i + r) * ldc + j0 + j;
+
+                    if (scale == 0.0f) {
+                        for (int s = 0; s < nr; ++s) {
+                            c_row[s] = alpha * tile[r * NR + s];
+                        }
+                    }
+                    else {
+                        for (int s = 0; s < nr; ++s) {
+                            c_row[s] = alpha * tile[r * NR + s] + scale * c_row[s];
+                        }
+                    }
+                }
+            }
+        }
+    }
+}
+
+void gemm(int trans_a, int trans_b, int m, int n, int k, float alpha,
+          const float *a, int lda, const float *b, int ldb,
+          float beta, float *c, int ldc)
+{
+    if (m <= 0 || n <= 0) return;
+
+    if (k <= 0) {
+        for (int i = 0; i < m; ++i) {
+            for (int j = 0; j < n; ++j) {
+                c[i * ldc + j] = beta == 0.0f ? 0.0f : beta * c[i * ldc + j];
+            }
+        }
+
+        return;
+    }
+
+    int m_blocks = (m + MC - 1) / MC;
+    int n_blocks = (n + NC - 1) / NC;
+
+    #pragma omp parallel for collapse(2) schedule(static) if(!omp_in_parallel() && m_blocks * n_blocks > 1)
+    for (int i = 0; i < m_blocks; ++i) {
+        for (int j = 0; j < n_blocks; ++j) {
+            gemm_block(trans_a, trans_b, m, n, k, alpha, a, lda, b, ldb,
+                       beta, c, ldc, i * MC, j * NC);
+        }
+    }
+}
@@ -1,30 +1,54 @@
 #include <stdlib.h>
 #include <assert.h>
 #include <math.h>
+#include <omp.h>
 #include "nn.h"
 
-layer layernorm_2D_alloc(int x_size, int batch_size)
+#define LAYERNORM_EPS 1e-5f
+
+layer layernorm_layer_alloc(int x_r, int x_c,
+                            int x_d, int x_b)
 {
     layernorm_layer *ll = malloc(sizeof(layernorm_layer));
 
-    ll->x_rows = x_size;
-    ll->x_cols = batch_size;
-    ll->x_depth = 1;
-    ll->x_batches = 1;
+    ll->x_r = x_r;
+    ll->x_c = x_c;
+    ll->x_d = x_d;
+    ll->x_b = x_b;
+
+    ll->gamma = tens_alloc(x_c, 1, 1, 1);
+    ll->beta = tens_alloc(x_c, 1, 1, 1);
 
-    ll->gamma = tens2D_alloc(x_size, 1);
-    ll->beta = tens2D_alloc(x_size, 1);
-    ll->var_cache = tens2D_alloc(batch_size, 1);
+    ll->z_cache = tens_lazy(x_r, x_c, x_d, x_b);
+    ll->rstd_cache = tens_lazy(x_r, 1, x_d, x_b);
 
-    ll->z_cache = tens2D_alloc(x_size, batch_size);
+    ll->dgamma = tens_alloc(x_c, 1, 1, 1);
+    ll->dbeta = tens_alloc(x_c, 1, 1, 1);
 
     layer l;
 
+    l.type = LAYERNORM;
     l.data = ll;
+    l.layouts = 1 << NCHW;
+
+    l.x_dims[R] = ll->x_r;
+    l.x_dims[C] = ll->x_c;
+    l.x_dims[D] = ll->x_d;
+    l.x_dims[B] = ll->x_b;
 
-    l.forward = layernorm_2D_forward;
-    l.backprop = layernorm_2D_backprop;
-    l.destroy = layernorm_2D_destroy;
+    l.y_dims[R] = ll->x_r;
+    l.y_dims[C] = ll->x_c;
+    l.y_dims[D] = ll->x_d;
+    l.y_dims[B] = ll->x_b;
+
+    l.forward = layernorm_forward;
+    l.backprop = layernorm_backprop;
+    l.destroy = layernorm_destroy;
+
+    l.params = layernorm_params;
+    l.state = NULL;
+    l.invalidate = NULL;
+    l.fuse = NULL;
 
     l.init = layernorm_init;
     l.print = layernorm_print;
@@ -34,335 +58,193 @@ layer layernorm_2D_alloc(int x_size, int batch_size)
     return l;
 }
 
-layer layernorm_layer_3D_alloc(int x_rows, int x_cols, int batch_size)
+/* Every row is normalized over its x_c columns, e.g. one token's features. */
+void layernorm_forward(layer l, tens x, tens *y)
 {
-    layernorm_layer *ll = malloc(sizeof(layernorm_layer));
-
-    ll->x_rows = x_rows;
-    ll->x_cols = x_cols;
-    ll->x_depth = batch_size;
-
-    ll->gamma = tens2D_alloc(x_rows, 1);
-    ll->beta = tens2D_alloc(x_rows, 1);
-    ll->var_cache = tens2D_alloc(batch_size, x_cols);
-
-    ll->z_cache.type = TENS3D;
-    ll->z_cache.t3 = tens3D_alloc(x_rows, x_cols, batch_size);
-
-    layer l;
-
-    l.data = ll;
+    layernorm_layer *ll = (layernorm_layer *)l.data;
 
-    l.forward = layernorm_3D_forward;
-    l.backprop = layernorm_3D_backprop;
-    l.destroy = layernorm_3D_destroy;
+    assert(x.dims[R] == ll->x_r);
+    assert(x.dims[C] == ll->x_c);
+    assert(x.dims[D] == ll->x_d);
+    assert(x.dims[B] == ll->x_b);
 
-    l.init = layernorm_init;
-    l.print = layernorm_print;
-    l.save = layernorm_save;
-    l.load = layernorm_load;
-}
+    assert(y->dims[R] == ll->x_r);
+    assert(y->dims[C] == ll->x_c);
+    assert(y->dims[D] == ll->x_d);
+    assert(y->dims[B] == ll->x_b);
 
-void layernorm_2D_forward(layer l, tens x, tens *y)
-{
-    layernorm_layer *ll = (layernorm_layer *)l.data;
+    assert(tens_is_contiguous(x) && tens_is_contiguous(*y));
 
-    assert(ll->x_type == MAT);
+    int train = l.mode == TRAINING;
 
-    assert(x.type == MAT);
-    assert(x.m.rows == ll->x_rows);
-    assert(x.m.cols == ll->batch_size);
+    if (train) {
+        tens_ensure(&ll->z_cache);
+        tens_ensure(&ll->rstd_cache);
+    }
 
-    y->type = MAT;
-    y->m = tens2D_alloc(ll->x_rows, ll->batch_size);
+    int rows = ll->x_r * ll->x_d * ll->x_b;
+    int cols = ll->x_c;
 
     #pragma omp parallel for schedule(static)
-    for (int i = 0; i < ll->batch_size; ++i) {
+    for (int i = 0; i < rows; ++i) {
+        const float *x_i = x.vals + i * cols;
+        float *y_i = y->vals + i * cols;
         float mean = 0.0f;
+        float var = 0.0f;
 
-        for (int j = 0; j < ll->x_rows; ++j) {
-            float x_val = mat_at(x.m, j, i);
-            mean += x_val;
+        #pragma omp simd reduction(+:mean)
+        for (int j = 0; j < cols; ++j) {
+            mean += x_i[j];
         }
 
-        mean /= ll->x_rows;
+        mean /= cols;
 
-        float var = 0.0f;
-
-        for (int j = 0; j < ll->x_rows; ++j) {
-            float x_val = mat_at(x.m, j, i);
-            float diff = x_val - mean;
-            var += diff * diff;
+        #pragma omp simd reduction(+:var)
+        for (int j = 0; j < cols; ++j) {
+            var += (x_i[j] - mean) * (x_i[j] - mean);
         }
 
-        var /= ll->x_rows;
+        float rstd = 1.0f / sqrtf(var / cols + LAYERNORM_EPS);
 
-        mat_at(ll->var_cache, i, 0) = var;
+        if (train) {
+            float *z_i = ll->z_cache.vals + i * cols;
 
-        float eps = 1e-5;
-        float stddev = sqrtf(var + eps);
+            #pragma omp simd
+            for (int j = 0; j < cols; ++j) {
+                z_i[j] = (x_i[j] - mean) * rstd;
+            }
 
-        for (int j = 0; j < ll->x_rows; ++j) {
-            float x_val = mat_at(x.m, j, i);
-            mat_at(ll->z_cache.m, j, i) = (x_val - mean) / stddev;
+            ll->rstd_cache.vals[i] = rstd;
         }
-    }
 
-    #pragma omp parallel for collapse(2) schedule(static)
-    for (int i = 0; i < ll->x_rows; ++i) {
-        for (int j = 0; j < ll->batch_size; ++j) {
-            float z_val = mat_at(ll->z_cache.m, i, j);
-            float gamma = mat_at(ll->gamma, i, 0);
-            float beta = mat_at(ll->beta, i, 0);
-            mat_at(y->m, i, j) = gamma * z_val + beta;
+        #pragma omp simd
+        for (int j = 0; j < cols; ++j) {
+            y_i[j] = ll->gamma.vals[j] * (x_i[j] - mean) * rstd + ll->beta.vals[j];
         }
     }
 }
 
-void layernorm_2D_backprop(layer l, tens dy, tens *dx)
+void layernorm_backprop(layer l, tens dy, tens *dx)
 {
     layernorm_layer *ll = (layernorm_layer *)l.data;
 
-    assert(ll->x_type == MAT);
-
-    assert(dy.type == MAT);
-    assert(dy.m.rows == ll->x_rows);
-    assert(dy.m.cols == ll->batch_size);
-
-    dx->type = MAT;
-    dx->m = tens2D_alloc(ll->x_rows, ll->batch_size);
+    assert(dy.dims[R] == ll->x_r);
+    assert(dy.dims[C] == ll->x_c);
+    assert(dy.dims[D] == ll->x_d);
+    assert(dy.dims[B] == ll->x_b);
 
-    mat sum_dy = tens2D_alloc(ll->batch_size, 1);
-    mat sum_dy_z = tens2D_alloc(ll->batch_size, 1);
+    assert(dx->dims[R] == ll->x_r);
+    assert(dx->dims[C] == ll->x_c);
+    assert(dx->dims[D] == ll->x_d);
+    assert(dx->dims[B] == ll->x_b);
 
-    mat dgamma = tens2D_alloc(ll->x_rows, 1);
-    mat_fill(dgamma, 0.0f);
+    assert(tens_is_contiguous(dy) && tens_is_contiguous(*dx));
 
-    mat dbeta = tens2D_alloc(ll->x_rows, 1);
-    mat_fill(dbeta, 0.0f);
+    int rows = ll->x_r * ll->x_d * ll->x_b;
+    int cols = ll->x_c;
 
     #pragma omp parallel for schedule(static)
-    for (int i = 0; i < ll->batch_size; ++i) {
-        for (int j = 0; j < ll->x_size; ++j) {
-            float dy_val = mat_at(dy.m, j, i);
-            float z_val = mat_at(ll->z_cache.m, i, j);
+    for (int j = 0; j < cols; ++j) {
+        float dgamma = 0.0f;
+        float dbeta = 0.0f;
 
-            mat_at(sum_dy, i, 0) += dy_val;
-            mat_at(sum_dy_z, i, 0) += dy_val * z_val;
+        for (int i = 0; i < rows; ++i) {
+            dgamma += dy.vals[i * cols + j] * ll->z_cache.vals[i * cols + j];
+            dbeta += dy.vals[i * cols + j];
         }
-    }
-
-    for (int i = 0; i < ll->batch_size; ++i) {
-        for (int j = 0; j < ll->x_size; ++j) {
-            float dy_val = mat_at(dy.m, j, i);
-            float z_val = mat_at(ll->z_cache.m, j, i);
-            float sum_dy_val = mat_at(sum_dy, i, 0);
-            float sum_dy_z_val = mat_at(sum_dy_z, i, 0);
 
-            float gamma = mat_at(ll->gamma, j, 0);
-            float var = mat_at(ll->var_cache, i, 0);
-            float eps = 1e-5;
-            float stddev = sqrtf(var + eps);
-
-            mat_at(dx.m, j, i) =
-                (dy_val - sum_dy_val / ll->x_rows - z_val * sum_dy_z_val / ll->x_rows) * gamma / stddev;
-        }
+        ll->dgamma.vals[j] = dgamma / ll->x_b;
+        ll->dbeta.vals[j] = dbeta / ll->x_b;
     }
 
     #pragma omp parallel for schedule(static)
-    for (int i = 0; i < ll->x_rows; ++i) {
-        for (int j = 0; j < ll->batch_size; ++j) {
-            float dy_val = mat_at(dy.m, i, j);
-            float z_val = mat_at(ll->z_cache.m, i, j);
-
-            mat_at(dgamma, i, 0) += dy_val * z_val;
-            mat_at(dbeta, i, 0) += dy_val;
+    for (int i = 0; i < rows; ++i) {
+        const float *dy_i = dy.vals + i * cols;
+        const float *z_i = ll->z_cache.vals + i * cols;
+        float *dx_i = dx->vals + i * cols;
+        float sum = 0.0f;
+        float sum_z = 0.0f;
+
+        #pragma omp simd reduction(+:sum, sum_z)
+        for (int j = 0; j < cols; ++j) {
+            float dz = dy_i[j] * ll->gamma.vals[j];
+
+            sum += dz;
+            sum_z += dz * z_i[j];
         }
-    }
-}
-
-void layernorm_2D_destroy(layer l)
-{
-    layernorm_layer *ll = (layernorm_layer *)l.data;
-
-    assert(ll->x_type == MAT);
-
-    free(ll->gamma.vals);
-    free(ll->beta.bals);
-    free(ll->var_cache.vals);
-    free(ll->z_cache.m.vals);
 
-    free(ll);
-}
-
-void layernorm_3D_forward(layer l, tens x, tens *y)
-{
-    layernorm_layer *ll = (layernorm_layer *)l.data;
-
-    assert(ll->x_type == TENS3D);
+        sum /= cols;
+        sum_z /= cols;
 
-    assert(x.type == TENS3D);
-    assert(x.t3.rows == ll->x_rows);
-    assert(x.t3.cols == ll->x_cols);
-    assert(x.t3.depth == ll->batch_size);
-
-    y->type = TENS3D;
-    y->t3 = tens3D_alloc(ll->x_rows, ll->x_cols, ll->batch_size);
-
-    #pragma omp parallel for schedule(static)
-    for (int i = 0; i < ll->batch_size; ++i) {
-        for (int j = 0; j < ll->x_cols; ++j) {
-            float mean = 0.0f;
-
-            for (int k = 0; k < ll->x_rows; ++k) {
-                float x_val = tens3D_at(x.t3, k, j, i);
-                mean += x_val;
-            }
+        float rstd = ll->rstd_cache.vals[i];
 
-            mean /= ll->x_rows;
-
-            float var = 0.0f;
-
-            for (int k = 0; k < ll->x_rows; ++k) {
-                float x_val = tens3D_at(x.t3, k, j, i);
-                float diff = x_val - mean;
-                var += diff * diff;
-            }
-
-            var /= ll->x_rows;
-
-            mat_at(ll->var_cache, j, i) = var;
-
-            float eps = 1e-5;
-            float stddev = sqrtf(var + eps);
-
-            for (int k = 0; k < ll->x_rows; ++k) {
-                float x_val = tens3D_at(x.t3, k, j, i);
-                tens3D_at(ll->z_cache.t3, k, j, i) = (x_val - mean) / stddev;
-            }
-        }
-    }
-
-    #pragma omp parallel for collapse(3) schedule(static)
-    for (int i = 0; i < ll->x_rows; ++i) {
-        for (int j = 0; j < ll->x_cols; ++j) {
-            for (int k = 0; k < ll->batch_size; ++k) {
-                float z_val = mat_at(l->z_cache.t3, i, j, k);
-                float gamma = mat_at(ll->gamma, i, 0);
-                float beta = mat_at(ll->beta, i, 0);
-
-                mat_at(y->t3, i, j, k) = gamma * z_val + beta;
-            }
+        #pragma omp simd
+        for (int j = 0; j < cols; ++j) {
+            dx_i[j] = rstd * (dy_i[j] * ll->gamma.vals[j] - sum - z_i[j] * sum_z);
         }
     }
 }
 
-void layernorm_3D_backprop(layer l, tens dy, tens *dx, float rate)
+void layernorm_destroy(layer l)
 {
     layernorm_layer *ll = (layernorm_layer *)l.data;
 
-    assert(ll->x_type == TENS3D);
-
-    assert(dy.type == TENS3D);
-    assert(dy.t3.rows == ll->x_rows);
-    assert(dy.t3.cols == ll->x_cols);
-    assert(dy.t3.depth == ll->batch_size);
-
-    dx->type = TENS3D;
-    dx->t3 = tens3D_alloc(ll->x_rows, ll->x_cols, ll->batch_size);
+    tens_destroy(ll->gamma);
+    tens_destroy(ll->beta);
 
-    mat dgamma = tens2D_alloc(ll->x_rows, 1);
-    mat dbeta = tens2D_alloc(ll->x_rows, 1);
-
-    #pragma omp parallel for schedule(static)
-    for (int i = 0; i < ll->batch_size; ++i) {
-        for (int j = 0; j < ll->x_cols; ++j) {
-            for (int k = 0; k < ll->x_rows; ++k) {
-                float dy_val = tens3D_at(dy.t3, k, j, i);
-                float z_val = tens3D_at(ll->z_cache.t3, k, j, i);
-
-                mat_at(sum_dy, i, 0) += dy_val;
-                mat_at(sum_dy_z, i, 0) += dy_val * z_val;
-            }
-        }
-    }
+    tens_destroy(ll->z_cache);
+    tens_destroy(ll->rstd_cache);
 
-    #pragma omp parallel for collapse(3) schedule(static)
-    for (int i = 0; i < ll->batch_size; ++i) {
-        for (int j = 0; j < ll->x_cols; ++j) {
-            for (int k = 0; k < ll->x_rows; ++k) {
-                float dy_val = mat_at(dy.t3, k, j, i)
-                float z_val = mat_at(ll->z_cache.t3, k, j, i);
-                float sum_dy_val = mat_at(sum_dy, i, 0);
-                float sum_dy_z_val = mat_at(sum_dy_z, i, 0);
-
-                float gamma = mat_at(ll->gamma, k, 0);
-                float var = mat_at(ll->var_cache, j, i);
-                float eps = 1e-5;
-                float stddev = sqrtf(var + eps);
-
-                mat_at(dx.t3, k j, i) =
-                    (dy_val - sum_dy_val / ll->x_rows - z_val * sum_dy_z_val / ll->x_rows) * gamma / stddev;
-            }
-        }
-    }
+    tens_destroy(ll->dgamma);
+    tens_destroy(ll->dbeta);
 
-    #pragma omp parallel for schedule(static)
-    for (int i = 0; i < ll->x_rows; ++i) {
-        for (int j = 0; j < ll->x_cols; ++j) {
-            for (int k = 0; k < ll->batch_size; ++k) {
-                float dy_val = tens3D_at(dy.t3, i, j, k);
-                float z_val = tens3D_at(ll->z_cache.t3, i, j, k);
-
-                mat_at(dgamma, i, 0) += dy_val * z_val;
-                mat_at(dbeta, i, 0) += dy_val;
-            }
-        }
-    }
+    free(ll);
 }
 
-void layernorm_3D_destroy(layer l)
+int layernorm_params(layer l, tens **params, tens **grads, int *decay)
 {
     layernorm_layer *ll = (layernorm_layer *)l.data;
 
-    assert(ll->x_type == TENS3D);
+    params[0] = &ll->gamma;
+    params[1] = &ll->beta;
 
-    free(ll->gamma.vals);
-    free(ll->beta.vals);
-    free(ll->var_cache.vals);
-    tens3D_destroy(ll->z_cache.t3);
+    grads[0] = &ll->dgamma;
+    grads[1] = &ll->dbeta;
 
-    free(ll);
+    decay[0] = 0;
+    decay[1] = 0;
+
+    return 2;
 }
 
 void layernorm_init(layer l)
 {
     layernorm_layer *ll = (layernorm_layer *)l.data;
 
-    mat_fill(ll->gamma, 1.0f);
-    mat_fill(ll->beta, 0.0f);
+    tens_fill(ll->gamma, 1.0f);
+    tens_fill(ll->beta, 0.0f);
 }
 
 void layernorm_print(layer l)
 {
     layernorm_layer *ll = (layernorm_layer *)l.data;
 
-    mat_print(ll->gamma);
-    mat_print(ll->bata);
+    tens_print(ll->gamma);
+    tens_print(ll->beta);
 }
 
 void layernorm_save(layer l, FILE *f)
 {
     layernorm_layer *ll = (layernorm_layer *)l.data;
 
-    mat_save(ll->gamma, f);
-    mat_save(ll->bata, f);
+    tens_save(ll->gamma, f);
+    tens_save(ll->beta, f);
 }
 
 void layernorm_load(layer l, FILE *f)
 {
     layernorm_layer *ll = (layernorm_layer *)l.data;
 
-    mat_load(ll->gamma, f);
-    mat_load(ll->bata, f);
+    tens_load(ll->gamma, f);
+    tens_load(ll->beta, f);
 }
@@ -0,0 +1,448 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+#include <pthread.h>
+#include "nn.h"
+#include "utils.h"
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+struct loader {
+    int x_r;
+    int x_c;
+    int x_d;
+    int x_b;
+    int classes;
+    int rank;
+    int workers;
+    int record_size;
+    int records;
+    int batches;
+    int count;
+    unsigned char **data;
+    size_t *sizes;
+    int *file_records;
+    int *perm;
+    uint64_t seed;
+    long epoch;
+    int pad;
+    int flip;
+    float *scale;
+    float *shift;
+    int started;
+    long next;
+    int want;
+    int held;
+    int stop;
+    tens x[2];
+    tens t[2];
+    int *labels[2];
+    int ready[2];
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+};
+
+static unsigned char *loader_map(const char *path, size_t *size)
+{
+#ifndef _WIN32
+    int fd = open(path, O_RDONLY);
+
+    if (fd == -1) return NULL;
+
+    struct stat st;
+
+    if (fstat(fd, &st) == -1 || st.st_size == 0) {
+        close(fd);
+        return NULL;
+    }
+
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+    close(fd);
+
+    if (map == MAP_FAILED) return NULL;
+
+    madvise(map, st.st_size, MADV_WILLNEED);
+
+    *size = st.st_size;
+
+    return map;
+#else
+    FILE *f = fopen(path, "rb");
+
+    if (f == NULL) return NULL;
+
+    fseek(f, 0, SEEK_END);
+    *size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+
+    unsigned char *data = malloc(*size);
+
+    if (fread(data, 1, *size, f) != *size) {
+        free(data);
+        data = NULL;
+    }
+
+    fclose(f);
+
+    return data;
+#endif
+}
+
+static void loader_unmap(unsigned char *data, size_t size)
+{
+#ifndef _WIN32
+    munmap(data, size);
+#else
+    (void)size;
+    free(data);
+#endif
+}
+
+static const unsigned char *loader_record(loader *ld, int index)
+{
+    for (int i = 0; i < ld->count; ++i) {
+        if (index < ld->file_records[i]) {
+            return ld->data[i] + (size_t)index * ld->record_size;
+        }
+
+        index -= ld->file_records[i];
+    }
+
+    return NULL;
+}
+
+/*
+ * Writes one image shifted by (dr, dc) and optionally mirrored, with
+ * pixels outside the source reading as 0 and every value mapped to
+ * byte * scale + shift of its channel.
+ */
+static void loader_decode(loader *ld, float *x, const unsigned char *pixels,
+                          int dr, int dc, int flip)
+{
+    int rows = ld->x_r;
+    int cols = ld->x_c;
+
+    for (int i = 0; i < ld->x_d; ++i) {
+        float scale = ld->scale[i];
+        float shift = ld->shift[i];
+
+        for (int j = 0; j < rows; ++j) {
+            float *x_j = x + (i * rows + j) * cols;
+            int r = j + dr;
+
+            if (r < 0 || r >= rows) {
+                for (int k = 0; k < cols; ++k) {
+                    x_j[k] = shift;
+                }
+
+                continue;
+            }
+
+            const unsigned char *p_j = pixels + (i * rows + r) * cols;
+            int begin = flip ? dc : -dc;
+            int end = flip ? cols + dc : cols - dc;
+
+            begin = begin > 0 ? begin : 0;
+            end = end < cols ? end : cols;
+
+            for (int k = 0; k < begin; ++k) {
+                x_j[k] = shift;
+            }
+
+            if (flip) {
+                const unsigned char *p_end = p_j + cols - 1 + dc;
+
+                #pragma omp simd
+                for (int k = begin; k < end; ++k) {
+                    x_j[k] = p_end[-k] * scale + shift;
+                }
+            }
+            else {
+                #pragma omp simd
+                for (int k = begin; k < end; ++k) {
+                    x_j[k] = p_j[k + dc] * scale + shift;
+                }
+            }
+
+            for (int k = end; k < cols; ++k) {
+                x_j[k] = shift;
+            }
+        }
+    }
+}
+
+/*
+ * Batch k takes this worker's share of global batch k of the current
+ * epoch, in file order or in the permutation of that epoch.
+ */
+static void loader_fill(loader *ld, int slot, long k)
+{
+    tens x = ld->x[slot];
+    tens t = ld->t[slot];
+    int pixels = ld->x_r * ld->x_c * ld->x_d;
+    int first = ((int)(k % ld->batches) * ld->workers + ld->rank) * ld->x_b;
+    long epoch = k / ld->batches;
+
+    if (ld->perm != NULL && epoch != ld->epoch) {
+        rand_permutation(ld->perm, ld->records, rand_counter(ld->seed, epoch));
+        ld->epoch = epoch;
+    }
+
+    memset(t.vals, 0, ld->classes * ld->x_b * sizeof(float));
+
+    for (int i = 0; i < ld->x_b; ++i) {
+        int index = ld->perm != NULL ? ld->perm[first + i] : first + i;
+        const unsigned char *record = loader_record(ld, index);
+        uint64_t bits = rand_counter(ld->seed ^ 0x6a09e667f3bcc909ull, k * ld->x_b + i);
+        int range = 2 * ld->pad + 1;
+        int dr = (int)(bits & 0xffff) % range - ld->pad;
+        int dc = (int)(bits >> 16 & 0xffff) % range - ld->pad;
+        int flip = ld->flip && (bits >> 32 & 1);
+
+        loader_decode(ld, x.vals + i * pixels, record + 1, dr, dc, flip);
+
+        ld->labels[slot][i] = record[0] < ld->classes ? record[0] : -1;
+
+        if (record[0] < ld->classes) {
+            tens_at(t, record[0], 0, 0, i) = 1.0f;
+        }
+    }
+}
+
+static void *loader_run(void *arg)
+{
+    loader *ld = (loader *)arg;
+    int slot = 0;
+
+    pthread_mutex_lock(&ld->mutex);
+
+    for (;;) {
+        while (!ld->stop && ld->ready[slot]) {
+            pthread_cond_wait(&ld->cond, &ld->mutex);
+        }
+
+        if (ld->stop) break;
+
+        long k = ld->next++;
+
+        pthread_mutex_unlock(&ld->mutex);
+        loader_fill(ld, slot, k);
+        pthread_mutex_lock(&ld->mutex);
+
+        ld->ready[slot] = 1;
+        pthread_cond_broadcast(&ld->cond);
+
+        slot ^= 1;
+    }
+
+    pthread_mutex_unlock(&ld->mutex);
+
+    return NULL;
+}
+
+/*
+ * The files are treated as one dataset; with several workers each takes
+ * its x_b records of every global batch of x_b * workers. Returns NULL if
+ * a file cannot be read or holds no whole batch.
+ */
+loader *loader_alloc(char **files, int count, int x_r, int x_c, int x_d,
+                     int x_b, int classes, int rank, int workers)
+{
+    loader *ld = malloc(sizeof(loader));
+
+    ld->x_r = x_r;
+    ld->x_c = x_c;
+    ld->x_d = x_d;
+    ld->x_b = x_b;
+    ld->classes = classes;
+    ld->rank = rank;
+    ld->workers = workers;
+    ld->record_size = 1 + x_r * x_c * x_d;
+    ld->batches = 0;
+    ld->started = 0;
+    ld->count = count;
+
+    ld->data = malloc(count * sizeof(unsigned char *));
+    ld->sizes = malloc(count * sizeof(size_t));
+    ld->file_records = malloc(count * sizeof(int));
+    ld->perm = NULL;
+    ld->seed = 0;
+    ld->pad = 0;
+    ld->flip = 0;
+
+    ld->scale = malloc(x_d * sizeof(float));
+    ld->shift = malloc(x_d * sizeof(float));
+
+    for (int i = 0; i < x_d; ++i) {
+        ld->scale[i] = 1.0f / 255.0f;
+        ld->shift[i] = 0.0f;
+    }
+    ld->records = 0;
+
+    for (int i = 0; i < count; ++i) {
+        ld->data[i] = loader_map(files[i], &ld->sizes[i]);
+
+        if (ld->data[i] == NULL) {
+            ld->count = i;
+            loader_destroy(ld);
+            return NULL;
+        }
+
+        ld->file_records[i] = ld->sizes[i] / ld->record_size;
+        ld->records += ld->file_records[i];
+    }
+
+    ld->batches = ld->records / (x_b * workers);
+
+    if (ld->batches == 0) {
+        loader_destroy(ld);
+        return NULL;
+    }
+
+    for (int i = 0; i < 2; ++i) {
+        ld->x[i] = tens_alloc(x_r, x_c, x_d, x_b);
+        ld->t[i] = tens_alloc(classes, 1, 1, x_b);
+        ld->labels[i] = malloc(x_b * sizeof(int));
+        ld->ready[i] = 0;
+    }
+
+    ld->epoch = -1;
+    ld->next = 0;
+    ld->want = 0;
+    ld->held = -1;
+    ld->stop = 0;
+
+    pthread_mutex_init(&ld->mutex, NULL);
+    pthread_cond_init(&ld->cond, NULL);
+
+    return ld;
+}
+
+/*
+ * Visits the records in a fresh permutation every epoch, derived from
+ * seed and the epoch alone; workers given the same seed split the same
+ * permutation. Call it before the first loader_next.
+ */
+void loader_shuffle(loader *ld, uint64_t seed)
+{
+    assert(!ld->started);
+
+    if (ld->perm == NULL) {
+        ld->perm = malloc(ld->records * sizeof(int));
+    }
+
+    ld->seed = seed;
+    ld->epoch = -1;
+}
+
+/*
+ * Crops every training image at a random offset of up to pad pixels from
+ * a zero padded copy and mirrors half of them, drawn from the seed.
+ */
+void loader_augment(loader *ld, int pad, int flip)
+{
+    assert(!ld->started);
+    assert(pad >= 0 && pad < ld->x_r && pad < ld->x_c);
+
+    ld->pad = pad;
+    ld->flip = flip;
+}
+
+/* Maps pixels to (pixel / 255 - mean) / stddev per channel. */
+void loader_normalize(loader *ld, const float *mean, const float *stddev)
+{
+    assert(!ld->started);
+
+    for (int i = 0; i < ld->x_d; ++i) {
+        ld->scale[i] = 1.0f / (255.0f * stddev[i]);
+        ld->shift[i] = -mean[i] / stddev[i];
+    }
+}
+
+int loader_batches(loader *ld)
+{
+    return ld->batches;
+}
+
+/*
+ * Hands out the next batch; x and t are views that stay valid until the
+ * following call, while the thread decodes into the other buffer.
+ */
+void loader_next(loader *ld, tens *x, tens *t)
+{
+    if (!ld->started) {
+        pthread_create(&ld->thread, NULL, loader_run, ld);
+        ld->started = 1;
+    }
+
+    pthread_mutex_lock(&ld->mutex);
+
+    if (ld->held != -1) {
+        ld->ready[ld->held] = 0;
+        pthread_cond_broadcast(&ld->cond);
+    }
+
+    while (!ld->ready[ld->want]) {
+        pthread_cond_wait(&ld->cond, &ld->mutex);
+    }
+
+    ld->held = ld->want;
+    ld->want ^= 1;
+
+    pthread_mutex_unlock(&ld->mutex);
+
+    *x = ld->x[ld->held];
+    *t = ld->t[ld->held];
+
+    x->owner = 0;
+    t->owner = 0;
+}
+
+/* Class indices of the batch last returned by loader_next, -1 if out of range. */
+const int *loader_labels(loader *ld)
+{
+    return ld->labels[ld->held];
+}
+
+void loader_destroy(loader *ld)
+{
+    if (ld->started) {
+        pthread_mutex_lock(&ld->mutex);
+        ld->stop = 1;
+        pthread_cond_broadcast(&ld->cond);
+        pthread_mutex_unlock(&ld->mutex);
+
+        pthread_join(ld->thread, NULL);
+    }
+
+    if (ld->batches > 0) {
+        pthread_mutex_destroy(&ld->mutex);
+        pthread_cond_destroy(&ld->cond);
+
+        for (int i = 0; i < 2; ++i) {
+            tens_destroy(ld->x[i]);
+            tens_destroy(ld->t[i]);
+            free(ld->labels[i]);
+        }
+    }
+
+    for (int i = 0; i < ld->count; ++i) {
+        loader_unmap(ld->data[i], ld->sizes[i]);
+    }
+
+    free(ld->data);
+    free(ld->sizes);
+    free(ld->file_records);
+    free(ld->perm);
+    free(ld->scale);
+    free(ld->shift);
+    free(ld);
+}
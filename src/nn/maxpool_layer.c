@@ -23,16 +23,33 @@ layer maxpool_layer_alloc(int x_r, int x_c, int x_d,
     ml->y_r = x_r / pooling_r;
     ml->y_c = x_c / pooling_c;
 
-    ml->mask = tens_alloc(x_r, x_c, x_d, x_b);
+    ml->mask = tens_lazy(x_r, x_c, x_d, x_b);
 
     layer l;
 
+    l.type = MAXPOOL;
     l.data = ml;
+    l.layouts = 1 << NCHW | 1 << NHWC;
+
+    l.x_dims[R] = ml->x_r;
+    l.x_dims[C] = ml->x_c;
+    l.x_dims[D] = ml->x_d;
+    l.x_dims[B] = ml->x_b;
+
+    l.y_dims[R] = ml->y_r;
+    l.y_dims[C] = ml->y_c;
+    l.y_dims[D] = ml->x_d;
+    l.y_dims[B] = ml->x_b;
 
     l.forward = maxpool_forward;
     l.backprop = maxpool_backprop;
     l.destroy = maxpool_destroy;
 
+    l.params = NULL;
+    l.state = NULL;
+    l.invalidate = NULL;
+    l.fuse = NULL;
+
     l.init = NULL;
     l.print = NULL;
     l.save = NULL;
@@ -41,6 +58,80 @@ layer maxpool_layer_alloc(int x_r, int x_c, int x_d,
     return l;
 }
 
+/* Channels-last pooling takes the max of whole channel vectors at once. */
+static void maxpool_nhwc_forward(maxpool_layer *ml, tens x, tens y, int train)
+{
+    #pragma omp parallel for collapse(3) schedule(static)
+    for (int i = 0; i < ml->x_b; ++i) {
+        for (int k = 0; k < ml->y_r; ++k) {
+            for (int l = 0; l < ml->y_c; ++l) {
+                float *y_p = &tens_at_nhwc(y, k, l, 0, i);
+
+                for (int j = 0; j < ml->x_d; ++j) {
+                    y_p[j] = -FLT_MAX;
+                }
+
+                for (int m = 0; m < ml->pooling_r; ++m) {
+                    for (int n = 0; n < ml->pooling_c; ++n) {
+                        int r = k * ml->pooling_r + m;
+                        int c = l * ml->pooling_c + n;
+                        const float *x_p = &tens_at_nhwc(x, r, c, 0, i);
+
+                        #pragma omp simd
+                        for (int j = 0; j < ml->x_d; ++j) {
+                            y_p[j] = x_p[j] > y_p[j] ? x_p[j] : y_p[j];
+                        }
+                    }
+                }
+
+                if (!train) continue;
+
+                for (int j = 0; j < ml->x_d; ++j) {
+                    int found = 0;
+
+                    for (int m = 0; m < ml->pooling_r && !found; ++m) {
+                        for (int n = 0; n < ml->pooling_c && !found; ++n) {
+                            int r = k * ml->pooling_r + m;
+                            int c = l * ml->pooling_c + n;
+
+                            if (tens_at_nhwc(x, r, c, j, i) == y_p[j]) {
+                                tens_at_nhwc(ml->mask, r, c, j, i) = 1.0f;
+                                found = 1;
+                            }
+                        }
+                    }
+                }
+            }
+        }
+    }
+}
+
+static void maxpool_nhwc_backprop(maxpool_layer *ml, tens dy, tens dx)
+{
+    #pragma omp parallel for collapse(3) schedule(static)
+    for (int i = 0; i < ml->x_b; ++i) {
+        for (int k = 0; k < ml->y_r; ++k) {
+            for (int l = 0; l < ml->y_c; ++l) {
+                const float *dy_p = &tens_at_nhwc(dy, k, l, 0, i);
+
+                for (int m = 0; m < ml->pooling_r; ++m) {
+                    for (int n = 0; n < ml->pooling_c; ++n) {
+                        int r = k * ml->pooling_r + m;
+                        int c = l * ml->pooling_c + n;
+                        const float *mask_p = &tens_at_nhwc(ml->mask, r, c, 0, i);
+                        float *dx_p = &tens_at_nhwc(dx, r, c, 0, i);
+
+                        #pragma omp simd
+                        for (int j = 0; j < ml->x_d; ++j) {
+                            dx_p[j] = mask_p[j] == 1.0f ? dy_p[j] : 0.0f;
+                        }
+                    }
+                }
+            }
+        }
+    }
+}
+
 void maxpool_forward(layer l, tens x, tens *y)
 {
     maxpool_layer *ml = (maxpool_layer *)l.data;
@@ -50,9 +141,22 @@ void maxpool_forward(layer l, tens x, tens *y)
     assert(x.dims[D] == ml->x_d);
     assert(x.dims[B] == ml->x_b);
 
-    *y = tens_alloc(ml->y_r, ml->y_c, ml->x_d, ml->x_b);
+    assert(y->dims[R] == ml->y_r);
+    assert(y->dims[C] == ml->y_c);
+    assert(y->dims[D] == ml->x_d);
+    assert(y->dims[B] == ml->x_b);
 
-    tens_fill(ml->mask, 0.0f);
+    int train = l.mode == TRAINING;
+
+    if (train) {
+        tens_ensure(&ml->mask);
+        tens_fill(ml->mask, 0.0f);
+    }
+
+    if (l.layout == NHWC) {
+        maxpool_nhwc_forward(ml, x, *y, train);
+        return;
+    }
 
     #pragma omp parallel for collapse(2) schedule(static)
     for (int i = 0; i < ml->x_b; ++i) {
@@ -79,6 +183,8 @@ void maxpool_forward(layer l, tens x, tens *y)
 
                     tens_at(*y, k, l, j, i) = max;
 
+                    if (!train) continue;
+
                     int mask_r = k * ml->pooling_r + max_r;
                     int mask_c = l * ml->pooling_c + max_c;
 
@@ -89,7 +195,7 @@ void maxpool_forward(layer l, tens x, tens *y)
     }
 }
 
-void maxpool_backprop(layer l, tens dy, tens *dx, float rate)
+void maxpool_backprop(layer l, tens dy, tens *dx)
 {
     maxpool_layer *ml = (maxpool_layer *)l.data;
 
@@ -98,7 +204,17 @@ void maxpool_backprop(layer l, tens dy, tens *dx, float rate)
     assert(dy.dims[D] == ml->x_d);
     assert(dy.dims[B] == ml->x_b);
 
-    *dx = tens_alloc(ml->x_r, ml->x_c, ml->x_d, ml->x_b);
+    assert(dx->dims[R] == ml->x_r);
+    assert(dx->dims[C] == ml->x_c);
+    assert(dx->dims[D] == ml->x_d);
+    assert(dx->dims[B] == ml->x_b);
+
+    tens_fill(*dx, 0.0f);
+
+    if (l.layout == NHWC) {
+        maxpool_nhwc_backprop(ml, dy, *dx);
+        return;
+    }
 
     #pragma omp parallel for collapse(2) schedule(static)
     for (int i = 0; i < ml->x_b; ++i) {
@@ -1,62 +1,509 @@
 #include <stdlib.h>
+#include <stdint.h>
 #include <assert.h>
 #include <math.h>
 #include <string.h>
 #include "nn.h"
 
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+/* Every parameter tensor starts on a 64 byte boundary of the flat buffer. */
+#define NN_ALIGN 16
+
+#define NN_MAGIC "NNCKPT"
+#define NN_VERSION 2
+
+/*
+ * Checkpoint layout, native endianness:
+ *   nn_header
+ *   nn_layer_entry for every layer with parameters or state
+ *   nn_tensor_entry for every such tensor, offsets relative to the payload
+ *   zero padding up to payload_offset, a multiple of 64
+ *   payload, the flat parameter buffer followed by the flat state buffer
+ */
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t num_layers;
+    uint32_t num_tensors;
+    uint32_t checksum;
+    uint64_t payload_offset;
+    uint64_t payload_size;
+} nn_header;
+
+typedef struct {
+    int32_t type;
+    int32_t params;
+    int32_t state;
+} nn_layer_entry;
+
+typedef struct {
+    int32_t dims[4];
+    uint64_t offset;
+} nn_tensor_entry;
+
 nn nn_alloc(int max_layers)
 {
     nn n;
 
+    n.mode = TRAINING;
     n.max_layers = max_layers;
     n.num_layers = 0;
 
     n.layers = malloc(max_layers * sizeof(layer));
+    n.params = tens_lazy(0, 1, 1, 1);
+    n.grads = tens_lazy(0, 1, 1, 1);
+    n.state = tens_lazy(0, 1, 1, 1);
+
+    n.num_params = 0;
+    n.param_list = NULL;
+    n.grad_list = NULL;
+    n.decay = NULL;
+
+    n.y_size = 0;
+    n.dx_size = 0;
+
+    for (int i = 0; i < 2; ++i) {
+        n.y_buffers[i] = NULL;
+        n.dx_buffers[i] = NULL;
+    }
+
+    n.t_buffer = NULL;
+    n.map = NULL;
+    n.map_size = 0;
 
     return n;
 }
 
+static int dims_size(int dims[4])
+{
+    return dims[R] * dims[C] * dims[D] * dims[B];
+}
+
+static int align_size(int size)
+{
+    return (size + NN_ALIGN - 1) / NN_ALIGN * NN_ALIGN;
+}
+
+static tens buffer_tens(float *vals, int dims[4], int layout)
+{
+    tens t = tens_view(vals, dims[R], dims[C], dims[D], dims[B]);
+
+    tens_set_layout(&t, layout);
+
+    return t;
+}
+
+/* The buffer of the pair that does not hold vals. */
+static float *other_buffer(float *buffers[2], float *vals)
+{
+    return vals == buffers[0] ? buffers[1] : buffers[0];
+}
+
+/* The hooks fill arrays of LAYER_MAX_PARAMS entries on the caller's stack. */
+static int layer_params(layer l, tens **params, tens **grads, int *decay)
+{
+    int unused[LAYER_MAX_PARAMS];
+    int count = l.params(l, params, grads, decay != NULL ? decay : unused);
+
+    assert(count <= LAYER_MAX_PARAMS);
+
+    return count;
+}
+
+static int layer_state(layer l, tens **state)
+{
+    int count = l.state(l, state);
+
+    assert(count <= LAYER_MAX_PARAMS);
+
+    return count;
+}
+
+/*
+ * Points every layer tensor into the flat buffers and lists them per tensor
+ * for the optimizer, which needs to know which of them take weight decay.
+ */
+static void nn_bind_params(nn *n)
+{
+    int offset = 0;
+    int state_offset = 0;
+    int num_params = 0;
+
+    for (int i = 0; i < n->num_layers; ++i) {
+        if (n->layers[i].params != NULL) {
+            tens *params[LAYER_MAX_PARAMS];
+            tens *grads[LAYER_MAX_PARAMS];
+
+            num_params += layer_params(n->layers[i], params, grads, NULL);
+        }
+    }
+
+    n->num_params = num_params;
+    n->param_list = realloc(n->param_list, num_params * sizeof(tens));
+    n->grad_list = realloc(n->grad_list, num_params * sizeof(tens));
+    n->decay = realloc(n->decay, num_params * sizeof(int));
+
+    num_params = 0;
+
+    for (int i = 0; i < n->num_layers; ++i) {
+        if (n->layers[i].params != NULL) {
+            tens *params[LAYER_MAX_PARAMS];
+            tens *grads[LAYER_MAX_PARAMS];
+
+            int count = layer_params(n->layers[i], params, grads, n->decay + num_params);
+
+            for (int j = 0; j < count; ++j) {
+                params[j]->vals = n->params.vals + offset;
+                params[j]->owner = 0;
+                grads[j]->vals = n->grads.vals != NULL ? n->grads.vals + offset : NULL;
+                grads[j]->owner = 0;
+
+                n->param_list[num_params + j] = *params[j];
+                n->grad_list[num_params + j] = *grads[j];
+
+                offset += align_size(dims_size(params[j]->dims));
+            }
+
+            num_params += count;
+        }
+
+        if (n->layers[i].state != NULL) {
+            tens *state[LAYER_MAX_PARAMS];
+
+            int count = layer_state(n->layers[i], state);
+
+            for (int j = 0; j < count; ++j) {
+                state[j]->vals = n->state.vals + state_offset;
+                state[j]->owner = 0;
+
+                state_offset += align_size(dims_size(state[j]->dims));
+            }
+        }
+    }
+}
+
+/* Copies the tensors to the end of a flat buffer, without rebinding them. */
+static void flat_append(tens *flat, tens **t, int count)
+{
+    int size = flat->dims[R];
+
+    for (int i = 0; i < count; ++i) {
+        size += align_size(dims_size(t[i]->dims));
+    }
+
+    float *vals = aligned_alloc(64, size * sizeof(float));
+
+    memset(vals, 0, size * sizeof(float));
+
+    if (flat->vals != NULL) {
+        memcpy(vals, flat->vals, flat->dims[R] * sizeof(float));
+    }
+
+    int offset = flat->dims[R];
+
+    for (int i = 0; i < count; ++i) {
+        int elements = dims_size(t[i]->dims);
+
+        memcpy(vals + offset, t[i]->vals, elements * sizeof(float));
+
+        offset += align_size(elements);
+    }
+
+    free(flat->vals);
+
+    flat->dims[R] = size;
+    flat->vals = vals;
+
+    tens_set_layout(flat, NCHW);
+}
+
+static void nn_add_params(nn *n, layer l)
+{
+    tens *params[LAYER_MAX_PARAMS];
+    tens *grads[LAYER_MAX_PARAMS];
+    tens *state[LAYER_MAX_PARAMS];
+
+    if (l.params != NULL) {
+        int count = layer_params(l, params, grads, NULL);
+
+        flat_append(&n->params, params, count);
+
+        for (int i = 0; i < count; ++i) {
+            tens_destroy(*params[i]);
+            tens_destroy(*grads[i]);
+        }
+
+        free(n->grads.vals);
+
+        n->grads.dims[R] = n->params.dims[R];
+        n->grads.vals = NULL;
+
+        tens_set_layout(&n->grads, NCHW);
+    }
+
+    if (l.state != NULL) {
+        int count = layer_state(l, state);
+
+        flat_append(&n->state, state, count);
+
+        for (int i = 0; i < count; ++i) {
+            tens_destroy(*state[i]);
+        }
+    }
+
+    nn_bind_params(n);
+}
+
+static void nn_free_flat(nn *n)
+{
+#ifndef _WIN32
+    if (n->map != NULL) {
+        munmap(n->map, n->map_size);
+
+        n->map = NULL;
+        n->params.vals = NULL;
+        n->state.vals = NULL;
+    }
+#endif
+    free(n->params.vals);
+    free(n->grads.vals);
+    free(n->state.vals);
+}
+
+/* Rebuilds the flat buffers from the current layers, e.g. after removing one. */
+static void nn_repack(nn *n)
+{
+    tens *params[LAYER_MAX_PARAMS];
+    tens *grads[LAYER_MAX_PARAMS];
+    tens *state[LAYER_MAX_PARAMS];
+
+    nn old = *n;
+
+    n->params = tens_lazy(0, 1, 1, 1);
+    n->grads = tens_lazy(0, 1, 1, 1);
+    n->state = tens_lazy(0, 1, 1, 1);
+
+    for (int i = 0; i < n->num_layers; ++i) {
+        if (n->layers[i].params != NULL) {
+            int count = layer_params(n->layers[i], params, grads, NULL);
+            flat_append(&n->params, params, count);
+        }
+
+        if (n->layers[i].state != NULL) {
+            int count = layer_state(n->layers[i], state);
+            flat_append(&n->state, state, count);
+        }
+    }
+
+    nn_free_flat(&old);
+
+    n->map = NULL;
+    n->map_size = 0;
+    n->grads.dims[R] = n->params.dims[R];
+
+    tens_set_layout(&n->grads, NCHW);
+    nn_bind_params(n);
+}
+
+/* Gradients and backprop buffers only exist once the network is trained. */
+static void nn_alloc_training(nn *n)
+{
+    if (n->grads.vals == NULL && n->grads.dims[R] > 0) {
+        n->grads.vals = aligned_alloc(64, n->grads.dims[R] * sizeof(float));
+        memset(n->grads.vals, 0, n->grads.dims[R] * sizeof(float));
+
+        nn_bind_params(n);
+    }
+
+    for (int i = 0; i < 2; ++i) {
+        if (n->dx_buffers[i] == NULL) {
+            n->dx_buffers[i] = malloc(n->dx_size * sizeof(float));
+        }
+    }
+}
+
 void nn_add_layer(nn *n, layer l)
 {
     assert(n->num_layers != n->max_layers);
+    assert(n->map == NULL);
+    assert(n->t_buffer == NULL);
 
+    l.mode = n->mode;
+    l.layout = NCHW;
     n->layers[n->num_layers++] = l;
+
+    if (l.params != NULL || l.state != NULL) {
+        nn_add_params(n, l);
+    }
+
+    int y_size = dims_size(l.y_dims);
+    int dx_size = dims_size(l.x_dims);
+
+    if (y_size > n->y_size) {
+        n->y_size = y_size;
+
+        for (int i = 0; i < 2; ++i) {
+            n->y_buffers[i] = realloc(n->y_buffers[i], y_size * sizeof(float));
+        }
+    }
+
+    if (dx_size > n->dx_size) {
+        n->dx_size = dx_size;
+
+        for (int i = 0; i < 2; ++i) {
+            free(n->dx_buffers[i]);
+            n->dx_buffers[i] = NULL;
+        }
+    }
+
+    if (n->mode == TRAINING) {
+        nn_alloc_training(n);
+    }
 }
 
+/* Switching to INFERENCE keeps whatever training already allocated. */
+void nn_set_mode(nn *n, int mode)
+{
+    n->mode = mode;
+
+    for (int i = 0; i < n->num_layers; ++i) {
+        n->layers[i].mode = mode;
+    }
+
+    if (mode == TRAINING) {
+        nn_alloc_training(n);
+    }
+}
+
+/*
+ * Layers may return a view of their input instead of writing y, so the
+ * next output always goes to whichever buffer the current input is not in.
+ */
 void nn_forward(nn n, tens x, tens *y)
 {
     tens x_current = x;
-    tens y_current;
+    tens y_current = x;
 
     for (int i = 0; i < n.num_layers; ++i) {
-        n.layers[i].forward(n.layers[i], x_current, &y_current);
+        layer l = n.layers[i];
 
-        if (i > 0) {
-            tens_destroy(x_current);
+        if (x_current.layout != l.layout) {
+            float *vals = x_current.vals == n.t_buffer ?
+                          other_buffer(n.y_buffers, x_current.vals) : n.t_buffer;
+            tens t = buffer_tens(vals, l.x_dims, l.layout);
+
+            tens_copy(t, x_current);
+            x_current = t;
         }
 
+        y_current = buffer_tens(other_buffer(n.y_buffers, x_current.vals), l.y_dims, l.layout);
+
+        l.forward(l, x_current, &y_current);
+
         x_current = y_current;
     }
 
+    if (y_current.layout != NCHW) {
+        tens t = buffer_tens(other_buffer(n.y_buffers, y_current.vals), y_current.dims, NCHW);
+        tens_copy(t, y_current);
+        y_current = t;
+    }
+
     *y = y_current;
 }
 
-void nn_backprop(nn n, tens dy, tens *dx, float rate)
+void nn_backprop(nn n, tens dy, tens *dx, optimizer *o)
 {
+    assert(n.mode == TRAINING);
+
     tens dy_current = dy;
-    tens dx_current;
+    tens dx_current = dy;
 
     for (int i = n.num_layers - 1; i >= 0; --i) {
-        n.layers[i].backprop(n.layers[i], dy_current, &dx_current, rate);
+        layer l = n.layers[i];
+
+        if (dy_current.layout != l.layout) {
+            float *vals = dy_current.vals == n.t_buffer ?
+                          other_buffer(n.dx_buffers, dy_current.vals) : n.t_buffer;
+            tens t = buffer_tens(vals, l.y_dims, l.layout);
 
-        if (i < n.num_layers - 1) {
-            tens_destroy(dy_current);
+            tens_copy(t, dy_current);
+            dy_current = t;
         }
 
+        dx_current = buffer_tens(other_buffer(n.dx_buffers, dy_current.vals), l.x_dims, l.layout);
+
+        l.backprop(l, dy_current, &dx_current);
+
         dy_current = dx_current;
     }
 
+    if (dx_current.layout != NCHW) {
+        tens t = buffer_tens(other_buffer(n.dx_buffers, dx_current.vals), dx_current.dims, NCHW);
+        tens_copy(t, dx_current);
+        dx_current = t;
+    }
+
     *dx = dx_current;
+
+    if (o != NULL) {
+        nn_update(n, *o);
+    }
+}
+
+/*
+ * Runs every layer that supports it in the given layout, converting only
+ * where neighbouring layers disagree. Call it once the network is complete;
+ * inputs and outputs of the network stay NCHW.
+ */
+void nn_set_layout(nn *n, int layout)
+{
+    int current = NCHW;
+    int size = n->y_size > n->dx_size ? n->y_size : n->dx_size;
+
+    for (int i = 0; i < n->num_layers; ++i) {
+        layer *l = &n->layers[i];
+
+        if (l->layouts == 0) {
+            l->layout = current;
+        }
+        else if (l->layouts & 1 << layout) {
+            l->layout = layout;
+        }
+        else {
+            l->layout = NCHW;
+        }
+
+        current = l->layout;
+    }
+
+    free(n->t_buffer);
+    n->t_buffer = layout != NCHW ? malloc(size * sizeof(float)) : NULL;
+}
+
+void nn_update(nn n, optimizer o)
+{
+    assert(n.mode == TRAINING);
+
+    o.step(o, n.param_list, n.grad_list, n.decay, n.num_params);
+
+    nn_params_changed(n);
+}
+
+/* Call after writing n.params directly, so layers rebuild what they derive from it. */
+void nn_params_changed(nn n)
+{
+    for (int i = 0; i < n.num_layers; ++i) {
+        if (n.layers[i].invalidate != NULL) {
+            n.layers[i].invalidate(n.layers[i]);
+        }
+    }
 }
 
 void nn_destroy(nn n)
@@ -64,32 +511,375 @@ void nn_destroy(nn n)
     for (int i = 0; i < n.num_layers; ++i) {
         n.layers[i].destroy(n.layers[i]);
     }
+
+    for (int i = 0; i < 2; ++i) {
+        free(n.y_buffers[i]);
+        free(n.dx_buffers[i]);
+    }
+
+    free(n.t_buffer);
+    free(n.layers);
+    free(n.param_list);
+    free(n.grad_list);
+    free(n.decay);
+    nn_free_flat(&n);
+}
+
+/*
+ * Merges every conv directly followed by a batchnorm into the conv, which
+ * only holds while the batchnorm uses its running statistics. An activation
+ * already fused into the batchnorm moves to the conv.
+ */
+void nn_fold(nn *n)
+{
+    assert(n->mode == INFERENCE);
+
+    int folded = 0;
+
+    for (int i = 0; i + 1 < n->num_layers; ++i) {
+        layer conv = n->layers[i];
+        layer bn = n->layers[i + 1];
+
+        if (conv.type != CONV || bn.type != BATCHNORM) continue;
+
+        tens scale = tens_alloc(bn.x_dims[D], 1, 1, 1);
+        tens shift = tens_alloc(bn.x_dims[D], 1, 1, 1);
+
+        batchnorm_affine(bn, scale, shift);
+        conv_scale(conv, scale, shift);
+
+        batchnorm_layer *bl = (batchnorm_layer *)bn.data;
+
+        if (bl->act != NULL) {
+            conv.fuse(conv, bl->act, bl->dact);
+        }
+
+        tens_destroy(scale);
+        tens_destroy(shift);
+
+        bn.destroy(bn);
+
+        memmove(n->layers + i + 1, n->layers + i + 2,
+                (n->num_layers - i - 2) * sizeof(layer));
+
+        --n->num_layers;
+        folded = 1;
+    }
+
+    if (folded) {
+        nn_repack(n);
+    }
+}
+
+static int nn_activation(layer l, func *act, func *dact)
+{
+    switch (l.type) {
+        case SIG:
+            *act = sig;
+            *dact = dsig;
+            return 0;
+        case TANH:
+            *act = tanhf;
+            *dact = dtanh;
+            return 0;
+        case RELU:
+            *act = relu;
+            *dact = drelu;
+            return 0;
+        case GELU:
+            *act = gelu;
+            *dact = dgelu;
+            return 0;
+        default:
+            return -1;
+    }
+}
+
+/*
+ * Moves every activation layer into the output loop of the layer in front
+ * of it. In INFERENCE batchnorms are folded first, so conv, batchnorm and
+ * relu end up as a single conv.
+ */
+void nn_fuse(nn *n)
+{
+    if (n->mode == INFERENCE) {
+        nn_fold(n);
+    }
+
+    for (int i = 0; i + 1 < n->num_layers; ++i) {
+        layer l = n->layers[i];
+        layer next = n->layers[i + 1];
+
+        func act;
+        func dact;
+
+        if (l.fuse == NULL || nn_activation(next, &act, &dact) == -1) continue;
+        if (l.fuse(l, act, dact) == -1) continue;
+
+        next.destroy(next);
+
+        memmove(n->layers + i + 1, n->layers + i + 2,
+                (n->num_layers - i - 2) * sizeof(layer));
+
+        --n->num_layers;
+    }
 }
 
 void nn_init(nn n)
 {
     for (int i = 0; i < n.num_layers; ++i) {
-        n.layers[i].init(n.layers[i]);
+        if (n.layers[i].init != NULL) {
+            n.layers[i].init(n.layers[i]);
+        }
     }
 }
 
 void nn_print(nn n)
 {
     for (int i = 0; i < n.num_layers; ++i) {
-        n.layers[i].print(n.layers[i]);
+        if (n.layers[i].print != NULL) {
+            n.layers[i].print(n.layers[i]);
+        }
     }
 }
 
-void nn_save(nn n, FILE *f)
+#define NN_CHECKSUM_BASIS 2166136261u
+
+static uint32_t nn_checksum(uint32_t hash, const float *vals, uint64_t size)
 {
-    for (int i = 0; i < n.num_layers; ++i) {
-        n.layers[i].save(n.layers[i], f);
+    const uint32_t *words = (const uint32_t *)vals;
+
+    for (uint64_t i = 0; i < size / sizeof(uint32_t); ++i) {
+        hash = (hash ^ words[i]) * 16777619u;
     }
+
+    return hash;
 }
 
-void nn_load(nn n, FILE *f)
+static void nn_layout_tensors(nn_header *h, nn_tensor_entry *tensors,
+                              tens **t, int count, uint64_t *offset)
 {
+    for (int i = 0; i < count; ++i) {
+        if (tensors != NULL) {
+            memcpy(tensors[h->num_tensors].dims, t[i]->dims, 4 * sizeof(int));
+            tensors[h->num_tensors].offset = *offset;
+        }
+
+        *offset += align_size(dims_size(t[i]->dims)) * sizeof(float);
+        ++h->num_tensors;
+    }
+}
+
+static void nn_layout(nn n, nn_header *h, nn_layer_entry *layers, nn_tensor_entry *tensors)
+{
+    tens *params[LAYER_MAX_PARAMS];
+    tens *grads[LAYER_MAX_PARAMS];
+    tens *state[LAYER_MAX_PARAMS];
+
+    uint64_t offset = 0;
+    uint64_t state_offset = n.params.dims[R] * sizeof(float);
+
+    memset(h, 0, sizeof(nn_header));
+    memcpy(h->magic, NN_MAGIC, sizeof(NN_MAGIC));
+    h->version = NN_VERSION;
+
     for (int i = 0; i < n.num_layers; ++i) {
-        n.layers[i].load(n.layers[i], f);
+        layer l = n.layers[i];
+
+        if (l.params == NULL && l.state == NULL) continue;
+
+        int param_count = l.params != NULL ? layer_params(l, params, grads, NULL) : 0;
+        int state_count = l.state != NULL ? layer_state(l, state) : 0;
+
+        if (layers != NULL) {
+            layers[h->num_layers].type = l.type;
+            layers[h->num_layers].params = param_count;
+            layers[h->num_layers].state = state_count;
+        }
+
+        nn_layout_tensors(h, tensors, params, param_count, &offset);
+        nn_layout_tensors(h, tensors, state, state_count, &state_offset);
+
+        ++h->num_layers;
     }
+
+    uint64_t tables = h->num_layers * sizeof(nn_layer_entry) +
+                      h->num_tensors * sizeof(nn_tensor_entry);
+
+    h->payload_offset = (sizeof(nn_header) + tables + 63) / 64 * 64;
+    h->payload_size = (n.params.dims[R] + n.state.dims[R]) * sizeof(float);
+}
+
+static int nn_check_header(nn n, const nn_header *h)
+{
+    nn_header expected;
+    nn_layout(n, &expected, NULL, NULL);
+
+    if (memcmp(h->magic, expected.magic, sizeof(h->magic)) != 0 ||
+        h->version != expected.version ||
+        h->num_layers != expected.num_layers ||
+        h->num_tensors != expected.num_tensors ||
+        h->payload_offset != expected.payload_offset ||
+        h->payload_size != expected.payload_size) {
+        return -1;
+    }
+
+    return 0;
+}
+
+/* The tables have to describe exactly the layer types and shapes of n. */
+static int nn_check_tables(nn n, const nn_header *h, const void *tables)
+{
+    nn_header expected;
+
+    nn_layer_entry *layers = malloc(h->num_layers * sizeof(nn_layer_entry) + 1);
+    nn_tensor_entry *tensors = malloc(h->num_tensors * sizeof(nn_tensor_entry) + 1);
+
+    nn_layout(n, &expected, layers, tensors);
+
+    const char *t = tables;
+
+    int result = memcmp(t, layers, h->num_layers * sizeof(nn_layer_entry)) != 0 ||
+                 memcmp(t + h->num_layers * sizeof(nn_layer_entry), tensors,
+                        h->num_tensors * sizeof(nn_tensor_entry)) != 0 ? -1 : 0;
+
+    free(layers);
+    free(tensors);
+
+    return result;
+}
+
+void nn_save(nn n, FILE *f)
+{
+    nn_header h;
+    nn_layout(n, &h, NULL, NULL);
+
+    nn_layer_entry *layers = malloc(h.num_layers * sizeof(nn_layer_entry) + 1);
+    nn_tensor_entry *tensors = malloc(h.num_tensors * sizeof(nn_tensor_entry) + 1);
+
+    nn_layout(n, &h, layers, tensors);
+
+    uint64_t params_size = n.params.dims[R] * sizeof(float);
+    uint64_t state_size = n.state.dims[R] * sizeof(float);
+
+    h.checksum = nn_checksum(NN_CHECKSUM_BASIS, n.params.vals, params_size);
+    h.checksum = nn_checksum(h.checksum, n.state.vals, state_size);
+
+    fwrite(&h, sizeof(nn_header), 1, f);
+    fwrite(layers, sizeof(nn_layer_entry), h.num_layers, f);
+    fwrite(tensors, sizeof(nn_tensor_entry), h.num_tensors, f);
+
+    char zeros[64] = { 0 };
+    long padding = h.payload_offset - ftell(f);
+    fwrite(zeros, 1, padding, f);
+
+    fwrite(n.params.vals, 1, params_size, f);
+    fwrite(n.state.vals, 1, state_size, f);
+
+    free(layers);
+    free(tensors);
+}
+
+/* Returns -1 and leaves the weights untouched if the file does not fit the network. */
+int nn_load(nn n, FILE *f)
+{
+    nn_header h;
+
+    if (fread(&h, sizeof(nn_header), 1, f) != 1 ||
+        nn_check_header(n, &h) == -1) {
+        return -1;
+    }
+
+    size_t size = h.payload_offset - sizeof(nn_header);
+    char *tables = malloc(size);
+
+    if (fread(tables, 1, size, f) != size ||
+        nn_check_tables(n, &h, tables) == -1) {
+        free(tables);
+        return -1;
+    }
+
+    free(tables);
+
+    float *staging = malloc(h.payload_size);
+
+    if (fread(staging, 1, h.payload_size, f) != h.payload_size ||
+        nn_checksum(NN_CHECKSUM_BASIS, staging, h.payload_size) != h.checksum) {
+        free(staging);
+        return -1;
+    }
+
+    memcpy(n.params.vals, staging, n.params.dims[R] * sizeof(float));
+    if (n.state.vals != NULL) {
+        memcpy(n.state.vals, staging + n.params.dims[R], n.state.dims[R] * sizeof(float));
+    }
+
+    free(staging);
+
+    nn_params_changed(n);
+
+    return 0;
+}
+
+/*
+ * Points the parameters straight into a private mapping of the file. Pages
+ * are shared between processes until written, and a later nn_add_layer is
+ * not allowed.
+ */
+int nn_load_mmap(nn *n, const char *path)
+{
+#ifdef _WIN32
+    FILE *f = fopen(path, "rb");
+    if (f == NULL) return -1;
+
+    int result = nn_load(*n, f);
+    fclose(f);
+
+    return result;
+#else
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) return -1;
+
+    struct stat st;
+
+    if (fstat(fd, &st) == -1 || (uint64_t)st.st_size < sizeof(nn_header)) {
+        close(fd);
+        return -1;
+    }
+
+    size_t map_size = st.st_size;
+    void *map = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    if (map == MAP_FAILED) return -1;
+
+    const nn_header *h = map;
+
+    if (nn_check_header(*n, h) == -1 ||
+        h->payload_offset + h->payload_size > map_size ||
+        nn_check_tables(*n, h, h + 1) == -1 ||
+        nn_checksum(NN_CHECKSUM_BASIS, (float *)((char *)map + h->payload_offset),
+                    h->payload_size) != h->checksum) {
+        munmap(map, map_size);
+        return -1;
+    }
+
+    if (n->map != NULL) {
+        munmap(n->map, n->map_size);
+    }
+    else {
+        free(n->params.vals);
+        free(n->state.vals);
+    }
+
+    n->map = map;
+    n->map_size = map_size;
+    n->params.vals = (float *)((char *)map + h->payload_offset);
+    n->state.vals = n->params.vals + n->params.dims[R];
+
+    nn_bind_params(n);
+    nn_params_changed(*n);
+
+    return 0;
+#endif
 }
@@ -0,0 +1,215 @@
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <omp.h>
+#include "nn.h"
+
+#ifndef _WIN32
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#endif
+
+#ifdef __linux__
+#include <signal.h>
+#include <sys/prctl.h>
+#endif
+
+/* Slots and chunks start on 64 byte boundaries so workers never share a line. */
+#define PARALLEL_ALIGN 16
+#define PARALLEL_HEADER 256
+
+/*
+ * Forking is only safe while OpenMP has not started a thread team, so
+ * the process runs single threaded until parallel_fork splits the threads
+ * between the workers. Call it before anything else touches OpenMP.
+ */
+parallel parallel_alloc(int workers)
+{
+    parallel p;
+
+    p.rank = 0;
+    p.workers = workers;
+    p.threads = omp_get_max_threads();
+    p.size = 0;
+    p.slots = NULL;
+    p.map = NULL;
+    p.map_size = 0;
+
+    if (workers > 1) {
+        omp_set_num_threads(1);
+    }
+
+    return p;
+}
+
+#ifndef _WIN32
+static void barrier(parallel p)
+{
+    pthread_barrier_wait((pthread_barrier_t *)p.map);
+}
+#endif
+
+/*
+ * Maps one slot of size floats per worker and forks the other workers,
+ * which all return from here with their own rank; everything allocated
+ * before is copied into them.
+ */
+void parallel_fork(parallel *p, int size)
+{
+#ifndef _WIN32
+    if (p->workers > 1) {
+        p->size = (size + PARALLEL_ALIGN - 1) / PARALLEL_ALIGN * PARALLEL_ALIGN;
+        p->map_size = PARALLEL_HEADER + (size_t)p->workers * p->size * sizeof(float);
+        p->map = mmap(NULL, p->map_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+
+        assert(p->map != MAP_FAILED);
+        assert(sizeof(pthread_barrier_t) <= PARALLEL_HEADER);
+
+        p->slots = (float *)((char *)p->map + PARALLEL_HEADER);
+
+        pthread_barrierattr_t attr;
+
+        pthread_barrierattr_init(&attr);
+        pthread_barrierattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+        pthread_barrier_init((pthread_barrier_t *)p->map, &attr, p->workers);
+        pthread_barrierattr_destroy(&attr);
+
+        for (int i = 1; i < p->workers; ++i) {
+            pid_t pid = fork();
+
+            assert(pid != -1);
+
+            if (pid == 0) {
+#ifdef __linux__
+                prctl(PR_SET_PDEATHSIG, SIGKILL);
+#endif
+                p->rank = i;
+                break;
+            }
+        }
+    }
+#else
+    p->workers = 1;
+#endif
+
+    int threads = p->threads / p->workers;
+
+    omp_set_num_threads(threads > 0 ? threads : 1);
+}
+
+/* Chunk c of a count float tensor split between the workers. */
+static void chunk_range(parallel p, int count, int c, int *begin, int *end)
+{
+    int chunk = (count + p.workers - 1) / p.workers;
+
+    chunk = (chunk + PARALLEL_ALIGN - 1) / PARALLEL_ALIGN * PARALLEL_ALIGN;
+
+    *begin = c * chunk < count ? c * chunk : count;
+    *end = *begin + chunk < count ? *begin + chunk : count;
+}
+
+/*
+ * Replaces t with its mean over the workers. Every worker only ever reads
+ * the slot of the one before it: N - 1 reduce-scatter steps leave worker r
+ * with the full sum of chunk r + 1, and N - 1 all-gather steps pass the
+ * finished chunks around the ring, so all workers end up bit identical.
+ */
+void parallel_allreduce(parallel p, tens t)
+{
+    if (p.workers == 1) return;
+
+#ifndef _WIN32
+    int count = t.dims[R] * t.dims[C] * t.dims[D] * t.dims[B];
+
+    assert(tens_is_contiguous(t));
+    assert(count <= p.size);
+
+    int w = p.workers;
+    float *own = p.slots + (size_t)p.rank * p.size;
+    const float *prev = p.slots + (size_t)((p.rank + w - 1) % w) * p.size;
+
+    memcpy(own, t.vals, count * sizeof(float));
+    barrier(p);
+
+    for (int s = 0; s < w - 1; ++s) {
+        int begin, end;
+
+        chunk_range(p, count, (p.rank - s - 1 + 2 * w) % w, &begin, &end);
+
+        #pragma omp parallel for simd schedule(static)
+        for (int i = begin; i < end; ++i) {
+            own[i] += prev[i];
+        }
+
+        barrier(p);
+    }
+
+    for (int s = 0; s < w - 1; ++s) {
+        int begin, end;
+
+        chunk_range(p, count, (p.rank - s + w) % w, &begin, &end);
+        memcpy(own + begin, prev + begin, (end - begin) * sizeof(float));
+
+        barrier(p);
+    }
+
+    float scale = 1.0f / w;
+
+    #pragma omp parallel for simd schedule(static)
+    for (int i = 0; i < count; ++i) {
+        t.vals[i] = own[i] * scale;
+    }
+#endif
+}
+
+/* Overwrites t in every worker with the one of worker 0. */
+void parallel_broadcast(parallel p, tens t)
+{
+    if (p.workers == 1) return;
+
+#ifndef _WIN32
+    int count = t.dims[R] * t.dims[C] * t.dims[D] * t.dims[B];
+
+    assert(tens_is_contiguous(t));
+    assert(count <= p.size);
+
+    if (p.rank == 0) {
+        memcpy(p.slots, t.vals, count * sizeof(float));
+    }
+
+    barrier(p);
+
+    if (p.rank != 0) {
+        memcpy(t.vals, p.slots, count * sizeof(float));
+    }
+
+    barrier(p);
+#endif
+}
+
+/* Ends every worker but 0, which returns once all the others have exited. */
+void parallel_join(parallel p)
+{
+#ifndef _WIN32
+    if (p.rank != 0) {
+        exit(EXIT_SUCCESS);
+    }
+
+    for (int i = 1; i < p.workers; ++i) {
+        wait(NULL);
+    }
+#endif
+}
+
+void parallel_destroy(parallel p)
+{
+#ifndef _WIN32
+    if (p.map != NULL) {
+        pthread_barrier_destroy((pthread_barrier_t *)p.map);
+        munmap(p.map, p.map_size);
+    }
+#endif
+}
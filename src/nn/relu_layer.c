@@ -12,16 +12,33 @@ layer relu_layer_alloc(int x_r, int x_c,
     rl->x_d = x_d;
     rl->x_b = x_b;
 
-    rl->x_cache = tens_alloc(x_r, x_c, x_d, x_b);
+    rl->x_cache = tens_lazy(x_r, x_c, x_d, x_b);
 
     layer l;
 
+    l.type = RELU;
     l.data = rl;
+    l.layouts = 0;
+
+    l.x_dims[R] = rl->x_r;
+    l.x_dims[C] = rl->x_c;
+    l.x_dims[D] = rl->x_d;
+    l.x_dims[B] = rl->x_b;
+
+    l.y_dims[R] = rl->x_r;
+    l.y_dims[C] = rl->x_c;
+    l.y_dims[D] = rl->x_d;
+    l.y_dims[B] = rl->x_b;
 
     l.forward = relu_forward;
     l.backprop = relu_backprop;
     l.destroy = relu_destroy;
 
+    l.params = NULL;
+    l.state = NULL;
+    l.invalidate = NULL;
+    l.fuse = NULL;
+
     l.init = NULL;
     l.print = NULL;
     l.save = NULL;
@@ -39,14 +56,21 @@ void relu_forward(layer l, tens x, tens *y)
     assert(x.dims[D] == rl->x_d);
     assert(x.dims[B] == rl->x_b);
 
-    *y = tens_alloc(rl->x_r, rl->x_c, rl->x_d, rl->x_b);
+    assert(y->dims[R] == rl->x_r);
+    assert(y->dims[C] == rl->x_c);
+    assert(y->dims[D] == rl->x_d);
+    assert(y->dims[B] == rl->x_b);
 
-    tens_copy(rl->x_cache, x);
+    if (l.mode == TRAINING) {
+        tens_ensure(&rl->x_cache);
+        tens_set_layout(&rl->x_cache, x.layout);
+        tens_copy(rl->x_cache, x);
+    }
 
     tens_func(*y, x, relu);
 }
 
-void relu_backprop(layer l, tens dy, tens *dx, float rate)
+void relu_backprop(layer l, tens dy, tens *dx)
 {
     relu_layer *rl = (relu_layer *)l.data;
 
@@ -55,7 +79,10 @@ void relu_backprop(layer l, tens dy, tens *dx, float rate)
     assert(dy.dims[D] == rl->x_d);
     assert(dy.dims[B] == rl->x_b);
 
-    *dx = tens_alloc(rl->x_r, rl->x_c, rl->x_d, rl->x_b);
+    assert(dx->dims[R] == rl->x_r);
+    assert(dx->dims[C] == rl->x_c);
+    assert(dx->dims[D] == rl->x_d);
+    assert(dx->dims[B] == rl->x_b);
 
     tens_func(*dx, rl->x_cache, drelu);
     tens_had(*dx, *dx, dy);
@@ -26,12 +26,29 @@ layer reshape_layer_alloc(int x_r, int x_c, int x_d,
 
     layer l;
 
+    l.type = RESHAPE;
     l.data = rl;
+    l.layouts = 1 << NCHW;
+
+    l.x_dims[R] = rl->x_r;
+    l.x_dims[C] = rl->x_c;
+    l.x_dims[D] = rl->x_d;
+    l.x_dims[B] = rl->x_b;
+
+    l.y_dims[R] = rl->y_r;
+    l.y_dims[C] = rl->y_c;
+    l.y_dims[D] = rl->y_d;
+    l.y_dims[B] = rl->y_b;
 
     l.forward = reshape_forward;
     l.backprop = reshape_backprop;
     l.destroy = reshape_destroy;
 
+    l.params = NULL;
+    l.state = NULL;
+    l.invalidate = NULL;
+    l.fuse = NULL;
+
     l.init = NULL;
     l.print = NULL;
     l.save = NULL;
@@ -49,12 +66,15 @@ void reshape_forward(layer l, tens x, tens *y)
     assert(x.dims[D] == rl->x_d);
     assert(x.dims[B] == rl->x_b);
 
-    *y = tens_alloc(rl->y_r, rl->y_c, rl->y_d, rl->y_b);
+    assert(y->dims[R] == rl->y_r);
+    assert(y->dims[C] == rl->y_c);
+    assert(y->dims[D] == rl->y_d);
+    assert(y->dims[B] == rl->y_b);
 
-    tens_reshape(*y, x);
+    *y = tens_reshape(x, rl->y_r, rl->y_c, rl->y_d, rl->y_b);
 }
 
-void reshape_backprop(layer l, tens dy, tens *dx, float rate)
+void reshape_backprop(layer l, tens dy, tens *dx)
 {
     reshape_layer *rl = (reshape_layer *)l.data;
 
@@ -63,9 +83,12 @@ void reshape_backprop(layer l, tens dy, tens *dx, float rate)
     assert(dy.dims[D] == rl->y_d);
     assert(dy.dims[B] == rl->y_b);
 
-    *dx = tens_alloc(rl->x_r, rl->x_c, rl->x_d, rl->x_b);
+    assert(dx->dims[R] == rl->x_r);
+    assert(dx->dims[C] == rl->x_c);
+    assert(dx->dims[D] == rl->x_d);
+    assert(dx->dims[B] == rl->x_b);
 
-    tens_reshape(*dx, dy);
+    *dx = tens_reshape(dy, rl->x_r, rl->x_c, rl->x_d, rl->x_b);
 }
 
 void reshape_destroy(layer l)
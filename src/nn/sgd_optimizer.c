@@ -0,0 +1,82 @@
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <math.h>
+#include <omp.h>
+#include "nn.h"
+
+optimizer sgd_optimizer_alloc(float rate, float momentum)
+{
+    sgd_optimizer *so = malloc(sizeof(sgd_optimizer));
+
+    so->rate = rate;
+    so->momentum = momentum;
+
+    so->size = 0;
+    so->v = NULL;
+
+    optimizer o;
+
+    o.data = so;
+
+    o.step = sgd_step;
+    o.destroy = sgd_destroy;
+
+    return o;
+}
+
+void sgd_step(optimizer o, tens *params, tens *grads, const int *decay, int count)
+{
+    sgd_optimizer *so = (sgd_optimizer *)o.data;
+
+    int size = 0;
+
+    for (int i = 0; i < count; ++i) {
+        size += params[i].dims[R] * params[i].dims[C] * params[i].dims[D] * params[i].dims[B];
+    }
+
+    if (so->momentum != 0.0f && so->v == NULL) {
+        so->size = size;
+        so->v = calloc(size, sizeof(float));
+    }
+
+    assert(so->v == NULL || so->size == size);
+
+    #pragma omp parallel
+    {
+        int offset = 0;
+
+        for (int i = 0; i < count; ++i) {
+            float *w = params[i].vals;
+            float *dw = grads[i].vals;
+            int elements = params[i].dims[R] * params[i].dims[C] * params[i].dims[D] * params[i].dims[B];
+
+            if (so->v == NULL) {
+                #pragma omp for simd schedule(static) nowait
+                for (int j = 0; j < elements; ++j) {
+                    w[j] -= fminf(fmaxf(so->rate * dw[j], -1.0f), 1.0f);
+                }
+            }
+            else {
+                float *v = so->v + offset;
+
+                #pragma omp for simd schedule(static) nowait
+                for (int j = 0; j < elements; ++j) {
+                    v[j] = so->momentum * v[j] + dw[j];
+                    w[j] -= fminf(fmaxf(so->rate * v[j], -1.0f), 1.0f);
+                }
+            }
+
+            offset += elements;
+        }
+    }
+}
+
+void sgd_destroy(optimizer o)
+{
+    sgd_optimizer *so = (sgd_optimizer *)o.data;
+
+    free(so->v);
+
+    free(so);
+}
@@ -12,16 +12,33 @@ layer sig_layer_alloc(int x_r, int x_c,
     sl->x_d = x_d;
     sl->x_b = x_b;
 
-    sl->x_cache = tens_alloc(x_r, x_c, x_d, x_b);
+    sl->x_cache = tens_lazy(x_r, x_c, x_d, x_b);
 
     layer l;
 
+    l.type = SIG;
     l.data = sl;
+    l.layouts = 0;
+
+    l.x_dims[R] = sl->x_r;
+    l.x_dims[C] = sl->x_c;
+    l.x_dims[D] = sl->x_d;
+    l.x_dims[B] = sl->x_b;
+
+    l.y_dims[R] = sl->x_r;
+    l.y_dims[C] = sl->x_c;
+    l.y_dims[D] = sl->x_d;
+    l.y_dims[B] = sl->x_b;
 
     l.forward = sig_forward;
     l.backprop = sig_backprop;
     l.destroy = sig_destroy;
 
+    l.params = NULL;
+    l.state = NULL;
+    l.invalidate = NULL;
+    l.fuse = NULL;
+
     l.init = NULL;
     l.print = NULL;
     l.save = NULL;
@@ -39,14 +56,21 @@ void sig_forward(layer l, tens x, tens *y)
     assert(x.dims[D] == sl->x_d);
     assert(x.dims[B] == sl->x_b);
 
-    *y = tens_alloc(sl->x_r, sl->x_c, sl->x_d, sl->x_b);
+    assert(y->dims[R] == sl->x_r);
+    assert(y->dims[C] == sl->x_c);
+    assert(y->dims[D] == sl->x_d);
+    assert(y->dims[B] == sl->x_b);
 
-    tens_copy(sl->x_cache, x);
+    if (l.mode == TRAINING) {
+        tens_ensure(&sl->x_cache);
+        tens_set_layout(&sl->x_cache, x.layout);
+        tens_copy(sl->x_cache, x);
+    }
 
     tens_func(*y, x, sig);
 }
 
-void sig_backprop(layer l, tens dy, tens *dx, float rate)
+void sig_backprop(layer l, tens dy, tens *dx)
 {
     sig_layer *sl = (sig_layer *)l.data;
 
@@ -55,7 +79,10 @@ void sig_backprop(layer l, tens dy, tens *dx, float rate)
     assert(dy.dims[D] == sl->x_d);
     assert(dy.dims[B] == sl->x_b);
 
-    *dx = tens_alloc(sl->x_r, sl->x_c, sl->x_d, sl->x_b);
+    assert(dx->dims[R] == sl->x_r);
+    assert(dx->dims[C] == sl->x_c);
+    assert(dx->dims[D] == sl->x_d);
+    assert(dx->dims[B] == sl->x_b);
 
     tens_func(*dx, sl->x_cache, dsig);
     tens_had(*dx, *dx, dy);
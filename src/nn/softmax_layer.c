@@ -12,16 +12,33 @@ layer softmax_layer_alloc(int x_r, int x_c,
     sl->x_d = x_d;
     sl->x_b = x_b;
 
-    sl->y_cache = tens_alloc(x_r, x_c, x_d, x_b);
+    sl->y_cache = tens_lazy(x_r, x_c, x_d, x_b);
 
     layer l;
 
+    l.type = SOFTMAX;
     l.data = sl;
+    l.layouts = 1 << NCHW;
+
+    l.x_dims[R] = sl->x_r;
+    l.x_dims[C] = sl->x_c;
+    l.x_dims[D] = sl->x_d;
+    l.x_dims[B] = sl->x_b;
+
+    l.y_dims[R] = sl->x_r;
+    l.y_dims[C] = sl->x_c;
+    l.y_dims[D] = sl->x_d;
+    l.y_dims[B] = sl->x_b;
 
     l.forward = softmax_forward;
     l.backprop = softmax_backprop;
     l.destroy = softmax_destroy;
 
+    l.params = NULL;
+    l.state = NULL;
+    l.invalidate = NULL;
+    l.fuse = NULL;
+
     l.init = NULL;
     l.print = NULL;
     l.save = NULL;
@@ -39,14 +56,20 @@ void softmax_forward(layer l, tens x, tens *y)
     assert(x.dims[D] == sl->x_d);
     assert(x.dims[B] == sl->x_b);
 
-    *y = tens_alloc(sl->x_r, sl->x_c, sl->x_d, sl->x_b);
+    assert(y->dims[R] == sl->x_r);
+    assert(y->dims[C] == sl->x_c);
+    assert(y->dims[D] == sl->x_d);
+    assert(y->dims[B] == sl->x_b);
 
     tens_softmax(*y, x);
 
-    tens_copy(sl->y_cache, *y);
+    if (l.mode == TRAINING) {
+        tens_ensure(&sl->y_cache);
+        tens_copy(sl->y_cache, *y);
+    }
 }
 
-void softmax_backprop(layer l, tens dy, tens *dx, float rate)
+void softmax_backprop(layer l, tens dy, tens *dx)
 {
     softmax_layer *sl = (softmax_layer *)l.data;
 
@@ -55,35 +78,29 @@ void softmax_backprop(layer l, tens dy, tens *dx, float rate)
     assert(dy.dims[D] == sl->x_d);
     assert(dy.dims[B] == sl->x_b);
 
-    *dx = tens_alloc(sl->x_r, sl->x_c, sl->x_d, sl->x_b);
+    assert(dx->dims[R] == sl->x_r);
+    assert(dx->dims[C] == sl->x_c);
+    assert(dx->dims[D] == sl->x_d);
+    assert(dx->dims[B] == sl->x_b);
 
+    /* dx = y * (dy - dy . y) per column, the Jacobian product without the Jacobian. */
     #pragma omp parallel for collapse(2) schedule(static)
     for (int i = 0; i < sl->x_b; ++i) {
         for (int j = 0; j < sl->x_d; ++j) {
             for (int k = 0; k < sl->x_c; ++k) {
-                for (int l = 0; l < sl->x_r; ++l) {
-                    float sum = 0.0f;
-
-                    float i_val = tens_at(sl->y_cache, l, k, j, i);
+                float dot = 0.0f;
 
-                    for (int m = 0; m < sl->x_r; ++m) {
-                        float j_val = tens_at(sl->y_cache, m, k, j, i);
-
-                        if (l == m) {
-                            sum += i_val * (1.0f - j_val);
-                        }
-                        else {
-                            sum += -i_val * j_val;
-                        }
-                    }
+                for (int l = 0; l < sl->x_r; ++l) {
+                    dot += tens_at_strided(dy, l, k, j, i) * tens_at(sl->y_cache, l, k, j, i);
+                }
 
-                    tens_at(*dx, k, l, j, i) = sum;
+                for (int l = 0; l < sl->x_r; ++l) {
+                    tens_at_strided(*dx, l, k, j, i) =
+                        tens_at(sl->y_cache, l, k, j, i) * (tens_at_strided(dy, l, k, j, i) - dot);
                 }
             }
         }
     }
-
-    tens_had(*dx, *dx, dy);
 }
 
 void softmax_destroy(layer l)
@@ -13,16 +13,33 @@ layer tanh_layer_alloc(int x_r, int x_c,
     tl->x_d = x_d;
     tl->x_b = x_b;
 
-    tl->x_cache = tens_alloc(x_r, x_c, x_d, x_b);
+    tl->x_cache = tens_lazy(x_r, x_c, x_d, x_b);
 
     layer l;
 
+    l.type = TANH;
     l.data = tl;
+    l.layouts = 0;
+
+    l.x_dims[R] = tl->x_r;
+    l.x_dims[C] = tl->x_c;
+    l.x_dims[D] = tl->x_d;
+    l.x_dims[B] = tl->x_b;
+
+    l.y_dims[R] = tl->x_r;
+    l.y_dims[C] = tl->x_c;
+    l.y_dims[D] = tl->x_d;
+    l.y_dims[B] = tl->x_b;
 
     l.forward = tanh_forward;
     l.backprop = tanh_backprop;
     l.destroy = tanh_destroy;
 
+    l.params = NULL;
+    l.state = NULL;
+    l.invalidate = NULL;
+    l.fuse = NULL;
+
     l.init = NULL;
     l.print = NULL;
     l.save = NULL;
@@ -40,14 +57,21 @@ void tanh_forward(layer l, tens x, tens *y)
     assert(x.dims[D] == tl->x_d);
     assert(x.dims[B] == tl->x_b);
 
-    *y = tens_alloc(tl->x_r, tl->x_c, tl->x_d, tl->x_b);
+    assert(y->dims[R] == tl->x_r);
+    assert(y->dims[C] == tl->x_c);
+    assert(y->dims[D] == tl->x_d);
+    assert(y->dims[B] == tl->x_b);
 
-    tens_copy(tl->x_cache, x);
+    if (l.mode == TRAINING) {
+        tens_ensure(&tl->x_cache);
+        tens_set_layout(&tl->x_cache, x.layout);
+        tens_copy(tl->x_cache, x);
+    }
 
     tens_func(*y, x, tanhf);
 }
 
-void tanh_backprop(layer l, tens dy, tens *dx, float rate)
+void tanh_backprop(layer l, tens dy, tens *dx)
 {
     tanh_layer *tl = (tanh_layer *)l.data;
 
@@ -56,7 +80,10 @@ void tanh_backprop(layer l, tens dy, tens *dx, float rate)
     assert(dy.dims[D] == tl->x_d);
     assert(dy.dims[B] == tl->x_b);
 
-    *dx = tens_alloc(tl->x_r, tl->x_c, tl->x_d, tl->x_b);
+    assert(dx->dims[R] == tl->x_r);
+    assert(dx->dims[C] == tl->x_c);
+    assert(dx->dims[D] == tl->x_d);
+    assert(dx->dims[B] == tl->x_b);
 
     tens_func(*dx, tl->x_cache, dtanh);
     tens_had(*dx, *dx, dy);
@@ -6,7 +6,44 @@
 #include "nn.h"
 #include "utils.h"
 
+static long allocs = 0;
+
+static void tens_strides(tens *t)
+{
+    if (t->layout == NHWC) {
+        t->strides[D] = 1;
+        t->strides[C] = t->dims[D];
+        t->strides[R] = t->dims[C] * t->dims[D];
+    }
+    else {
+        t->strides[C] = 1;
+        t->strides[R] = t->dims[C];
+        t->strides[D] = t->dims[R] * t->dims[C];
+    }
+
+    t->strides[B] = t->dims[R] * t->dims[C] * t->dims[D];
+}
+
 tens tens_alloc(int r, int c, int d, int b)
+{
+    tens t = tens_view(NULL, r, c, d, b);
+
+    #pragma omp atomic
+    ++allocs;
+
+    t.vals = malloc(r * c * d * b * sizeof(float));
+    t.owner = 1;
+
+    return t;
+}
+
+tens tens_lazy(int r, int c, int d, int b)
+{
+    return tens_view(NULL, r, c, d, b);
+}
+
+/* A contiguous NCHW view of memory owned by someone else. */
+tens tens_view(float *vals, int r, int c, int d, int b)
 {
     tens t;
 
@@ -15,27 +52,117 @@ tens tens_alloc(int r, int c, int d, int b)
     t.dims[D] = d;
     t.dims[B] = b;
 
-    t.vals = malloc(r * c * d * b * sizeof(float));
+    t.vals = vals;
+    t.layout = NCHW;
+    t.owner = 0;
+
+    tens_strides(&t);
 
     return t;
 }
 
-void tens_reshape(tens dest, tens t)
+void tens_ensure(tens *t)
+{
+    if (t->vals == NULL) {
+        int layout = t->layout;
+
+        *t = tens_alloc(t->dims[R], t->dims[C], t->dims[D], t->dims[B]);
+
+        tens_set_layout(t, layout);
+    }
+}
+
+/* Reinterprets contiguous memory in another layout, also after dims changed. */
+void tens_set_layout(tens *t, int layout)
+{
+    t->layout = layout;
+
+    tens_strides(t);
+}
+
+/*
+ * Counts tensors only: every tens_alloc, including those tens_ensure makes.
+ * Raw malloc and calloc, e.g. dropout masks or optimizer moments, are not
+ * seen.
+ */
+long tens_allocations(void)
+{
+    return allocs;
+}
+
+int tens_is_contiguous(tens t)
+{
+    tens c = t;
+
+    tens_strides(&c);
+
+    return memcmp(c.strides, t.strides, sizeof(t.strides)) == 0;
+}
+
+static int tens_same_strides(tens t1, tens t2)
+{
+    return memcmp(t1.strides, t2.strides, sizeof(t1.strides)) == 0;
+}
+
+/*
+ * Returns t itself as a view when it is already contiguous, otherwise a
+ * packed NCHW copy; tens_destroy the result either way.
+ */
+tens tens_contiguous(tens t)
+{
+    if (tens_is_contiguous(t)) {
+        t.owner = 0;
+        return t;
+    }
+
+    tens dest = tens_alloc(t.dims[R], t.dims[C], t.dims[D], t.dims[B]);
+
+    tens_copy(dest, t);
+
+    return dest;
+}
+
+tens tens_reshape(tens t, int r, int c, int d, int b)
+{
+    assert(tens_is_contiguous(t) && t.layout == NCHW);
+    assert(r * c * d * b == t.dims[R] * t.dims[C] * t.dims[D] * t.dims[B]);
+
+    return tens_view(t.vals, r, c, d, b);
+}
+
+/* Dimension i of the view is dimension perm[i] of t, nothing is moved. */
+tens tens_permute(tens t, int perm[4])
 {
-    int elements = t.dims[B] * t.dims[D] * t.dims[R] * t.dims[C];
-    assert(dest.dims[B] * dest.dims[D] * dest.dims[R] * dest.dims[C] == elements);
+    tens p = t;
+
+    for (int i = 0; i < 4; ++i) {
+        p.dims[i] = t.dims[perm[i]];
+        p.strides[i] = t.strides[perm[i]];
+    }
 
-    memcpy(dest.vals, t.vals, elements * sizeof(float));
+    p.owner = 0;
+
+    return p;
 }
 
 void tens_rand(tens t, float min, float max)
 {
-    #pragma omp parallel for collapse(2) schedule(static)
+    uint64_t stream = rand_stream();
+
+    /* Counters follow the NCHW element index, so values do not depend on layout. */
+    #pragma omp parallel for collapse(3) schedule(static)
     for (int i = 0; i < t.dims[B]; ++i) {
         for (int j = 0; j < t.dims[D]; ++j) {
             for (int k = 0; k < t.dims[R]; ++k) {
+                uint64_t counter = (((uint64_t)i * t.dims[D] + j) * t.dims[R] + k) * t.dims[C];
+
+                if (t.strides[C] == 1) {
+                    rand_uniform_fill(&tens_at_strided(t, k, 0, j, i), t.dims[C], stream, counter, min, max);
+                    continue;
+                }
+
                 for (int l = 0; l < t.dims[C]; ++l) {
-                    tens_at(t, k, l, j, i) = rand_float(min, max);
+                    rand_uniform_fill(&tens_at_strided(t, k, l, j, i), 1, stream, counter + l, min, max);
                 }
             }
         }
@@ -44,12 +171,21 @@ void tens_rand(tens t, float min, float max)
 
 void tens_normal(tens t, float mean, float stddev)
 {
-    #pragma omp parallel for collapse(2) schedule(static)
+    uint64_t stream = rand_stream();
+
+    #pragma omp parallel for collapse(3) schedule(static)
     for (int i = 0; i < t.dims[B]; ++i) {
         for (int j = 0; j < t.dims[D]; ++j) {
             for (int k = 0; k < t.dims[R]; ++k) {
+                uint64_t counter = (((uint64_t)i * t.dims[D] + j) * t.dims[R] + k) * t.dims[C];
+
+                if (t.strides[C] == 1) {
+                    rand_normal_fill(&tens_at_strided(t, k, 0, j, i), t.dims[C], stream, counter, mean, stddev);
+                    continue;
+                }
+
                 for (int l = 0; l < t.dims[C]; ++l) {
-                    tens_at(t, k, l, j, i) = rand_normal(mean, stddev);
+                    rand_normal_fill(&tens_at_strided(t, k, l, j, i), 1, stream, counter + l, mean, stddev);
                 }
             }
         }
@@ -58,18 +194,52 @@ void tens_normal(tens t, float mean, float stddev)
 
 void tens_fill(tens t, float val)
 {
+    if (tens_is_contiguous(t)) {
+        int elements = t.dims[B] * t.dims[D] * t.dims[R] * t.dims[C];
+
+        #pragma omp parallel for simd schedule(static)
+        for (int i = 0; i < elements; ++i) {
+            t.vals[i] = val;
+        }
+
+        return;
+    }
+
     #pragma omp parallel for collapse(2) schedule(static)
     for (int i = 0; i < t.dims[B]; ++i) {
         for (int j = 0; j < t.dims[D]; ++j) {
             for (int k = 0; k < t.dims[R]; ++k) {
                 for (int l = 0; l < t.dims[C]; ++l) {
-                    tens_at(t, k, l, j, i) = val;
+                    tens_at_strided(t, k, l, j, i) = val;
+                }
+            }
+        }
+    }
+}
+
+#define TRANSPOSE_TILE 32
+
+static void transpose(float *dest, const float *t, int rows, int cols)
+{
+    #pragma omp parallel for collapse(2) schedule(static) if(!omp_in_parallel())
+    for (int i = 0; i < rows; i += TRANSPOSE_TILE) {
+        for (int j = 0; j < cols; j += TRANSPOSE_TILE) {
+            int i_end = i + TRANSPOSE_TILE < rows ? i + TRANSPOSE_TILE : rows;
+            int j_end = j + TRANSPOSE_TILE < cols ? j + TRANSPOSE_TILE : cols;
+
+            for (int k = i; k < i_end; ++k) {
+                for (int l = j; l < j_end; ++l) {
+                    dest[l * rows + k] = t[k * cols + l];
                 }
             }
         }
     }
 }
 
+/*
+ * Copies t into dest element by element, whatever the strides; packed
+ * tensors in the same layout are a memcpy and NCHW <-> NHWC a transpose.
+ */
 void tens_copy(tens dest, tens t)
 {
 	assert(dest.dims[R] == t.dims[R]);
@@ -77,12 +247,38 @@ void tens_copy(tens dest, tens t)
     assert(dest.dims[D] == t.dims[D]);
     assert(dest.dims[B] == t.dims[B]);
 
+    int contiguous = tens_is_contiguous(dest) && tens_is_contiguous(t);
+
+    if (contiguous && dest.layout == t.layout) {
+        memcpy(dest.vals, t.vals, t.dims[B] * t.strides[B] * sizeof(float));
+        return;
+    }
+
+    if (contiguous) {
+        int p_size = t.dims[R] * t.dims[C];
+        int d_size = t.dims[D];
+
+        for (int i = 0; i < t.dims[B]; ++i) {
+            float *dest_i = dest.vals + i * p_size * d_size;
+            const float *t_i = t.vals + i * p_size * d_size;
+
+            if (t.layout == NCHW) {
+                transpose(dest_i, t_i, d_size, p_size);
+            }
+            else {
+                transpose(dest_i, t_i, p_size, d_size);
+            }
+        }
+
+        return;
+    }
+
     #pragma omp parallel for collapse(2) schedule(static)
 	for (int i = 0; i < dest.dims[B]; ++i) {
 		for (int j = 0; j < dest.dims[D]; ++j) {
             for (int k = 0; k < dest.dims[R]; ++k) {
                 for (int l = 0; l < dest.dims[C]; ++l) {
-                    tens_at(dest, k, l, j, i) = tens_at(t, k, l, j, i);
+                    tens_at_strided(dest, k, l, j, i) = tens_at_strided(t, k, l, j, i);
                 }
             }
 		}
@@ -100,12 +296,23 @@ void tens_add(tens dest, tens t1, tens t2)
     assert(dest.dims[D] == t1.dims[D]);
     assert(dest.dims[B] == t1.dims[B]);
 
+    if (tens_is_contiguous(dest) && tens_same_strides(dest, t1) && tens_same_strides(dest, t2)) {
+        int elements = dest.dims[B] * dest.dims[D] * dest.dims[R] * dest.dims[C];
+
+        #pragma omp parallel for simd schedule(static)
+        for (int i = 0; i < elements; ++i) {
+            dest.vals[i] = t1.vals[i] + t2.vals[i];
+        }
+
+        return;
+    }
+
     #pragma omp parallel for collapse(2) schedule(static)
 	for (int i = 0; i < dest.dims[B]; ++i) {
 		for (int j = 0; j < dest.dims[D]; ++j) {
             for (int k = 0; k < dest.dims[R]; ++k) {
                 for (int l = 0; l < dest.dims[C]; ++l) {
-                    tens_at(dest, k, l, j, i) = tens_at(t1, k, l, j, i) + tens_at(t2, k, l, j, i);
+                    tens_at_strided(dest, k, l, j, i) = tens_at_strided(t1, k, l, j, i) + tens_at_strided(t2, k, l, j, i);
                 }
             }
 		}
@@ -123,18 +330,59 @@ void tens_sub(tens dest, tens t1, tens t2)
     assert(dest.dims[D] == t1.dims[D]);
     assert(dest.dims[B] == t1.dims[B]);
 
+    if (tens_is_contiguous(dest) && tens_same_strides(dest, t1) && tens_same_strides(dest, t2)) {
+        int elements = dest.dims[B] * dest.dims[D] * dest.dims[R] * dest.dims[C];
+
+        #pragma omp parallel for simd schedule(static)
+        for (int i = 0; i < elements; ++i) {
+            dest.vals[i] = t1.vals[i] - t2.vals[i];
+        }
+
+        return;
+    }
+
     #pragma omp parallel for collapse(2) schedule(static)
 	for (int i = 0; i < dest.dims[B]; ++i) {
 		for (int j = 0; j < dest.dims[D]; ++j) {
             for (int k = 0; k < dest.dims[R]; ++k) {
                 for (int l = 0; l < dest.dims[C]; ++l) {
-                    tens_at(dest, k, l, j, i) = tens_at(t1, k, l, j, i) - tens_at(t2, k, l, j, i);
+                    tens_at_strided(dest, k, l, j, i) = tens_at_strided(t1, k, l, j, i) - tens_at_strided(t2, k, l, j, i);
                 }
             }
 		}
 	}
 }
 
+/* Every D x B slice is a matrix product; a transposed operand is just a view. */
+static void tens_gemm(tens dest, tens t1, tens t2)
+{
+    assert(dest.strides[C] == 1);
+    assert(t1.strides[C] == 1 || t1.strides[R] == 1);
+    assert(t2.strides[C] == 1 || t2.strides[R] == 1);
+
+    int m = dest.dims[R];
+    int n = dest.dims[C];
+    int k = t1.dims[C];
+
+    int trans1 = t1.strides[C] != 1;
+    int trans2 = t2.strides[C] != 1;
+    int ld1 = trans1 ? t1.strides[C] : t1.strides[R];
+    int ld2 = trans2 ? t2.strides[C] : t2.strides[R];
+
+    int slices = dest.dims[B] * dest.dims[D];
+
+    #pragma omp parallel for schedule(static) if(slices >= omp_get_max_threads() && slices > 1)
+    for (int i = 0; i < slices; ++i) {
+        int b = i / dest.dims[D];
+        int d = i % dest.dims[D];
+
+        gemm(trans1, trans2, m, n, k, 1.0f,
+             &tens_at_strided(t1, 0, 0, d, b), ld1,
+             &tens_at_strided(t2, 0, 0, d, b), ld2,
+             0.0f, &tens_at_strided(dest, 0, 0, d, b), dest.strides[R]);
+    }
+}
+
 void tens_dot(tens dest, tens t1, tens t2)
 {
 	assert(t1.dims[C] == t2.dims[R]);
@@ -145,22 +393,37 @@ void tens_dot(tens dest, tens t1, tens t2)
     assert(dest.dims[D] == t1.dims[D]);
     assert(dest.dims[B] == t1.dims[B]);
 
-    #pragma omp parallel for collapse(2) schedule(static)
-    for (int i = 0; i < dest.dims[B]; ++i) {
-        for (int j = 0; j < dest.dims[D]; ++j) {
-            for (int k = 0; k < dest.dims[R]; ++k) {
-                for (int l = 0; l < dest.dims[C]; ++l) {
-                    float sum = 0.0f;
+    tens_gemm(dest, t1, t2);
+}
 
-                    for (int m = 0; m < t1.dims[C]; ++m) {
-                        sum += tens_at(t1, k, m, j, i) * tens_at(t2, m, l, j, i);
-                    }
+void tens_dot_T1(tens dest, tens t1, tens t2)
+{
+	assert(t1.dims[R] == t2.dims[R]);
+    assert(t1.dims[D] == t2.dims[D]);
+    assert(t1.dims[B] == t2.dims[B]);
+	assert(dest.dims[R] == t1.dims[C]);
+	assert(dest.dims[C] == t2.dims[C]);
+    assert(dest.dims[D] == t1.dims[D]);
+    assert(dest.dims[B] == t1.dims[B]);
 
-                    tens_at(dest, k, l, j, i) = sum;
-                }
-            }
-        }
-    }
+    int perm[4] = { C, R, D, B };
+
+    tens_gemm(dest, tens_permute(t1, perm), t2);
+}
+
+void tens_dot_T2(tens dest, tens t1, tens t2)
+{
+	assert(t1.dims[C] == t2.dims[C]);
+    assert(t1.dims[D] == t2.dims[D]);
+    assert(t1.dims[B] == t2.dims[B]);
+	assert(dest.dims[R] == t1.dims[R]);
+	assert(dest.dims[C] == t2.dims[R]);
+    assert(dest.dims[D] == t1.dims[D]);
+    assert(dest.dims[B] == t1.dims[B]);
+
+    int perm[4] = { C, R, D, B };
+
+    tens_gemm(dest, t1, tens_permute(t2, perm));
 }
 
 void tens_had(tens dest, tens t1, tens t2)
@@ -174,12 +437,23 @@ void tens_had(tens dest, tens t1, tens t2)
     assert(dest.dims[D] == t1.dims[D]);
     assert(dest.dims[B] == t1.dims[B]);
 
+    if (tens_is_contiguous(dest) && tens_same_strides(dest, t1) && tens_same_strides(dest, t2)) {
+        int elements = dest.dims[B] * dest.dims[D] * dest.dims[R] * dest.dims[C];
+
+        #pragma omp parallel for simd schedule(static)
+        for (int i = 0; i < elements; ++i) {
+            dest.vals[i] = t1.vals[i] * t2.vals[i];
+        }
+
+        return;
+    }
+
     #pragma omp parallel for collapse(2) schedule(static)
 	for (int i = 0; i < dest.dims[B]; ++i) {
 		for (int j = 0; j < dest.dims[D]; ++j) {
             for (int k = 0; k < dest.dims[R]; ++k) {
                 for (int l = 0; l < dest.dims[C]; ++l) {
-                    tens_at(dest, k, l, j, i) = tens_at(t1, k, l, j, i) * tens_at(t2, k, l, j, i);
+                    tens_at_strided(dest, k, l, j, i) = tens_at_strided(t1, k, l, j, i) * tens_at_strided(t2, k, l, j, i);
                 }
             }
 		}
@@ -193,23 +467,7 @@ void tens_trans(tens dest, tens t, int perm[4])
     assert(dest.dims[D] == t.dims[perm[2]]);
     assert(dest.dims[B] == t.dims[perm[3]]);
 
-    #pragma omp parallel for collapse(2) schedule(static)
-	for (int i = 0; i < dest.dims[B]; ++i) {
-		for (int j = 0; j < dest.dims[D]; ++j) {
-            for (int k = 0; k < dest.dims[R]; ++k) {
-                for (int l = 0; l < dest.dims[C]; ++l) {
-                    int dest_index[4] = { k, l, j, i };
-                    int t_index[4];
-
-                    for (int m = 0; m < 4; ++m) {
-                        t_index[perm[m]] = dest_index[m];
-                    }
-
-                    tens_at(dest, k, l, j, i) = tens_at(t, t_index[0], t_index[1], t_index[2], t_index[3]);
-                }
-            }
-		}
-	}
+    tens_copy(dest, tens_permute(t, perm));
 }
 
 void tens_180(tens dest, tens t, int flip[4])
@@ -233,7 +491,7 @@ void tens_180(tens dest, tens t, int flip[4])
                         }
                     }
 
-                    tens_at(dest, k, l, j, i) = tens_at(t, t_index[0], t_index[1], t_index[2], t_index[3]);
+                    tens_at_strided(dest, k, l, j, i) = tens_at_strided(t, t_index[0], t_index[1], t_index[2], t_index[3]);
                 }
             }
 		}
@@ -247,12 +505,23 @@ void tens_scale(tens dest, tens t, float a)
     assert(dest.dims[D] == t.dims[D]);
     assert(dest.dims[B] == t.dims[B]);
 
+    if (tens_is_contiguous(dest) && tens_same_strides(dest, t)) {
+        int elements = dest.dims[B] * dest.dims[D] * dest.dims[R] * dest.dims[C];
+
+        #pragma omp parallel for simd schedule(static)
+        for (int i = 0; i < elements; ++i) {
+            dest.vals[i] = a * t.vals[i];
+        }
+
+        return;
+    }
+
     #pragma omp parallel for collapse(2) schedule(static)
 	for (int i = 0; i < dest.dims[B]; ++i) {
 		for (int j = 0; j < dest.dims[D]; ++j) {
             for (int k = 0; k < dest.dims[R]; ++k) {
                 for (int l = 0; l < dest.dims[C]; ++l) {
-                    tens_at(dest, k, l, j, i) = a * tens_at(t, k, l, j, i);
+                    tens_at_strided(dest, k, l, j, i) = a * tens_at_strided(t, k, l, j, i);
                 }
             }
 		}
@@ -266,12 +535,23 @@ void tens_func(tens dest, tens t, func f)
     assert(dest.dims[D] == t.dims[D]);
     assert(dest.dims[B] == t.dims[B]);
 
+    if (tens_is_contiguous(dest) && tens_same_strides(dest, t)) {
+        int elements = dest.dims[B] * dest.dims[D] * dest.dims[R] * dest.dims[C];
+
+        #pragma omp parallel for schedule(static)
+        for (int i = 0; i < elements; ++i) {
+            dest.vals[i] = f(t.vals[i]);
+        }
+
+        return;
+    }
+
     #pragma omp parallel for collapse(2) schedule(static)
 	for (int i = 0; i < dest.dims[B]; ++i) {
 		for (int j = 0; j < dest.dims[D]; ++j) {
             for (int k = 0; k < dest.dims[R]; ++k) {
                 for (int l = 0; l < dest.dims[C]; ++l) {
-                    tens_at(dest, k, l, j, i) = f(tens_at(t, k, l, j, i));
+                    tens_at_strided(dest, k, l, j, i) = f(tens_at_strided(t, k, l, j, i));
                 }
             }
 		}
@@ -290,11 +570,11 @@ void tens_pad(tens dest, tens t, int padding[4])
         for (int j = 0; j < dest.dims[D]; ++j) {
             for (int k = 0; k < dest.dims[R]; ++k) {
                 for (int l = 0; l < dest.dims[C]; ++l) {
-                    tens_at(dest, k, l, j, i) = 0.0f;
+                    tens_at_strided(dest, k, l, j, i) = 0.0f;
 
                     if (k >= padding[TOP] && k < (t.dims[R] + padding[TOP]) &&
                         l >= padding[LEFT] && l < (t.dims[C] + padding[LEFT])) {
-                            tens_at(dest, k, l, j, i) = tens_at(t, k - padding[TOP], l - padding[LEFT], j, i);
+                            tens_at_strided(dest, k, l, j, i) = tens_at_strided(t, k - padding[TOP], l - padding[LEFT], j, i);
                     }
                 }
             }
@@ -316,30 +596,91 @@ void tens_softmax(tens dest, tens t)
                 float max = -FLT_MAX;
 
                 for (int l = 0; l < t.dims[R]; ++l) {
-                    if (tens_at(t, l, k, j, i) > max) max = tens_at(t, l, k, j, i);
+                    if (tens_at_strided(t, l, k, j, i) > max) max = tens_at_strided(t, l, k, j, i);
+                }
+
+                float sum = 0.0f;
+
+                for (int l = 0; l < t.dims[R]; ++l) {
+                    float val = expf(tens_at_strided(t, l, k, j, i) - max);
+
+                    tens_at_strided(dest, l, k, j, i) = val;
+
+                    sum += val;
+                }
+
+                for (int l = 0; l < t.dims[R]; ++l) {
+                    tens_at_strided(dest, l, k, j, i) /= sum;
+                }
+            }
+        }
+    }
+}
+
+/*
+ * Softmax over R followed by cross entropy against one label per column,
+ * labels[(b * D + d) * C + c], negative to skip a column. Leaves the gradient
+ * softmax(t) - onehot in dest and returns the summed loss.
+ */
+float tens_softmax_cxe(tens dest, tens t, const int *labels)
+{
+    assert(dest.dims[R] == t.dims[R]);
+    assert(dest.dims[C] == t.dims[C]);
+    assert(dest.dims[D] == t.dims[D]);
+    assert(dest.dims[B] == t.dims[B]);
+
+    float loss = 0.0f;
+
+    #pragma omp parallel for collapse(2) schedule(static) reduction(+:loss)
+    for (int i = 0; i < t.dims[B]; ++i) {
+        for (int j = 0; j < t.dims[D]; ++j) {
+            for (int k = 0; k < t.dims[C]; ++k) {
+                int label = labels[(i * t.dims[D] + j) * t.dims[C] + k];
+
+                if (label < 0) {
+                    for (int l = 0; l < t.dims[R]; ++l) {
+                        tens_at_strided(dest, l, k, j, i) = 0.0f;
+                    }
+
+                    continue;
+                }
+
+                float max = -FLT_MAX;
+
+                for (int l = 0; l < t.dims[R]; ++l) {
+                    if (tens_at_strided(t, l, k, j, i) > max) max = tens_at_strided(t, l, k, j, i);
                 }
 
+                float target = tens_at_strided(t, label, k, j, i);
                 float sum = 0.0f;
 
                 for (int l = 0; l < t.dims[R]; ++l) {
-                    float val = expf(tens_at(t, l, k, j, i) - max);
+                    float val = expf(tens_at_strided(t, l, k, j, i) - max);
 
-                    tens_at(dest, l, k, j, i) = val;
+                    tens_at_strided(dest, l, k, j, i) = val;
 
                     sum += val;
                 }
 
                 for (int l = 0; l < t.dims[R]; ++l) {
-                    tens_at(dest, l, k, j, i) /= sum;
+                    tens_at_strided(dest, l, k, j, i) /= sum;
                 }
+
+                tens_at_strided(dest, label, k, j, i) -= 1.0f;
+
+                loss += max + logf(sum) - target;
             }
         }
     }
+
+    return loss;
 }
 
 void tens_destroy(tens t)
 {
-    free(t.vals);
+    if (t.owner) {
+        free(t.vals);
+    }
 }
 
 void tens_print(tens t)
@@ -348,7 +689,7 @@ void tens_print(tens t)
         for (int j = 0; j < t.dims[D]; ++j) {
             for (int k = 0; k < t.dims[R]; ++k) {
                 for (int l = 0; l < t.dims[C]; ++l) {
-                    printf("%f ", tens_at(t, k, l, j, i));
+                    printf("%f ", tens_at_strided(t, k, l, j, i));
                 }
                 printf("\n");
             }
@@ -359,6 +700,7 @@ void tens_print(tens t)
 void tens_save(tens t, FILE *f)
 {
     assert(f != NULL);
+    assert(tens_is_contiguous(t));
 
     fwrite(t.vals, sizeof(float), t.dims[B] * t.dims[D] * t.dims[R] * t.dims[C], f);
 }
@@ -366,6 +708,7 @@ void tens_save(tens t, FILE *f)
 void tens_load(tens t, FILE *f)
 {
     assert(f != NULL);
+    assert(tens_is_contiguous(t));
 
     fread(t.vals, sizeof(float), t.dims[B] * t.dims[D] * t.dims[R] * t.dims[C], f);
 }
@@ -12,29 +12,111 @@
 #define get_directory getcwd
 #endif
 
-float rand_float(float min, float max) { return (max - min) * rand() / RAND_MAX + min; }
+/* The splitmix64 output function of seed + counter: random access, no state. */
+uint64_t rand_counter(uint64_t seed, uint64_t counter)
+{
+    uint64_t z = seed + (counter + 1) * 0x9e3779b97f4a7c15ull;
+
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+
+    return z ^ (z >> 31);
+}
+
+static uint64_t rand_key;
+static uint64_t rand_draws;
+
+/* Not thread safe: parallel code takes one stream and indexes it by element. */
+void rand_seed(uint64_t seed)
+{
+    rand_key = seed;
+    rand_draws = 0;
+}
+
+uint64_t rand_stream(void) { return rand_counter(rand_key, rand_draws++); }
+
+float rand_float(float min, float max)
+{
+    return (max - min) * ((rand_stream() >> 40) * 0x1p-24f) + min;
+}
 
 float rand_normal(float mean, float stddev)
 {
-    float u1 = rand_float(0, 1);
-    float u2 = rand_float(0, 1);
+    float z;
 
-    while (u1 == 0) u1 = rand_float(0, 1);
+    rand_normal_fill(&z, 1, rand_stream(), 0, mean, stddev);
 
-    return stddev * sqrt(-2.0 * log(u1)) * cos(2.0 * M_PI * u2) + mean;
+    return z;
+}
+
+void rand_uniform_fill(float *dest, int size, uint64_t stream, uint64_t counter,
+                       float min, float max)
+{
+    #pragma omp simd
+    for (int i = 0; i < size; ++i) {
+        dest[i] = (max - min) * ((rand_counter(stream, counter + i) >> 40) * 0x1p-24f) + min;
+    }
+}
+
+/* Box-Muller on the two halves of one draw, so element i only needs counter + i. */
+void rand_normal_fill(float *dest, int size, uint64_t stream, uint64_t counter,
+                      float mean, float stddev)
+{
+    #pragma omp simd
+    for (int i = 0; i < size; ++i) {
+        uint64_t bits = rand_counter(stream, counter + i);
+        float u1 = ((bits >> 40) + 1) * 0x1p-24f;
+        float u2 = (bits & 0xffffff) * 0x1p-24f;
+
+        dest[i] = stddev * sqrtf(-2.0f * logf(u1)) * cosf(2.0f * (float)M_PI * u2) + mean;
+    }
+}
+
+/* Bit j of dest is set with probability p, drawn from counter + j. */
+void rand_bits_fill(uint32_t *dest, int size, uint64_t stream, uint64_t counter, float p)
+{
+    uint64_t threshold = (uint64_t)(p * 0x1p24f);
+
+    for (int i = 0; i < size; i += 32) {
+        int bits = size - i < 32 ? size - i : 32;
+        uint32_t word = 0;
+
+        #pragma omp simd reduction(|:word)
+        for (int j = 0; j < bits; ++j) {
+            word |= (uint32_t)((rand_counter(stream, counter + i + j) >> 40) < threshold) << j;
+        }
+
+        dest[i / 32] = word;
+    }
 }
 
 void shuffle(void *arr, size_t type_size, int arr_size)
 {
     char *temp_arr = (char *) arr;
-	
+    char temp[type_size];
+
     for (int i = arr_size - 1; i > 0; --i) {
-        int j = rand() % (i + 1);
-        for (int k = 0; k < (int) type_size; ++k) {
-            char temp = temp_arr[i * type_size + k];
-            temp_arr[i * type_size + k] = temp_arr[j * type_size + k];
-            temp_arr[j * type_size + k] = temp;
-        }
+        int j = (int)(((rand_stream() >> 32) * (uint64_t)(i + 1)) >> 32);
+
+        memcpy(temp, temp_arr + i * type_size, type_size);
+        memcpy(temp_arr + i * type_size, temp_arr + j * type_size, type_size);
+        memcpy(temp_arr + j * type_size, temp, type_size);
+    }
+}
+
+/* Fisher-Yates over 0 .. size - 1, the same for the same seed everywhere. */
+void rand_permutation(int *perm, int size, uint64_t seed)
+{
+    for (int i = 0; i < size; ++i) {
+        perm[i] = i;
+    }
+
+    for (int i = size - 1; i > 0; --i) {
+        int j = (int)(((rand_counter(seed, i) >> 32) * (uint64_t)(i + 1)) >> 32);
+        int temp = perm[i];
+
+        perm[i] = perm[j];
+        perm[j] = temp;
     }
 }
 
@@ -0,0 +1,142 @@
+#include <stdlib.h>
+#include <string.h>
+#include <omp.h>
+#include "nn.h"
+
+/*
+ * Winograd F(2x2, 3x3) for 3x3 stride 1 convolutions with one pixel of
+ * padding on every side: y = A^T [(G g G^T) . (B^T d B)] A per 2x2 tile.
+ */
+
+void winograd_filter(float *u, const float *w, int convolutions, int x_d, int backprop)
+{
+    int out_d = backprop ? x_d : convolutions;
+    int in_d = backprop ? convolutions : x_d;
+
+    #pragma omp parallel for collapse(2) schedule(static)
+    for (int i = 0; i < convolutions; ++i) {
+        for (int j = 0; j < x_d; ++j) {
+            const float *g = w + (i * x_d + j) * 9;
+            float f[3][3];
+
+            for (int k = 0; k < 3; ++k) {
+                for (int l = 0; l < 3; ++l) {
+                    f[k][l] = backprop ? g[(2 - k) * 3 + (2 - l)] : g[k * 3 + l];
+                }
+            }
+
+            float t[4][3];
+
+            for (int l = 0; l < 3; ++l) {
+                t[0][l] = f[0][l];
+                t[1][l] = 0.5f * (f[0][l] + f[1][l] + f[2][l]);
+                t[2][l] = 0.5f * (f[0][l] - f[1][l] + f[2][l]);
+                t[3][l] = f[2][l];
+            }
+
+            int out = backprop ? j : i;
+            int in = backprop ? i : j;
+
+            for (int k = 0; k < 4; ++k) {
+                float row[4] = { t[k][0],
+                                 0.5f * (t[k][0] + t[k][1] + t[k][2]),
+                                 0.5f * (t[k][0] - t[k][1] + t[k][2]),
+                                 t[k][2] };
+
+                for (int l = 0; l < 4; ++l) {
+                    u[((k * 4 + l) * out_d + out) * in_d + in] = row[l];
+                }
+            }
+        }
+    }
+}
+
+void winograd_conv(const float *x, float *y, const float *u,
+                   int in_d, int out_d, int rows, int cols,
+                   float *v, float *m)
+{
+    int tiles_r = (rows + 1) / 2;
+    int tiles_c = (cols + 1) / 2;
+    int tiles = tiles_r * tiles_c;
+
+    #pragma omp parallel for collapse(2) schedule(static)
+    for (int i = 0; i < in_d; ++i) {
+        for (int j = 0; j < tiles; ++j) {
+            const float *x_i = x + i * rows * cols;
+            int r0 = (j / tiles_c) * 2 - 1;
+            int c0 = (j % tiles_c) * 2 - 1;
+            float d[4][4];
+
+            for (int k = 0; k < 4; ++k) {
+                for (int l = 0; l < 4; ++l) {
+                    int r = r0 + k;
+                    int c = c0 + l;
+
+                    d[k][l] = r >= 0 && r < rows && c >= 0 && c < cols ?
+                              x_i[r * cols + c] : 0.0f;
+                }
+            }
+
+            float t[4][4];
+
+            for (int l = 0; l < 4; ++l) {
+                t[0][l] = d[0][l] - d[2][l];
+                t[1][l] = d[1][l] + d[2][l];
+                t[2][l] = d[2][l] - d[1][l];
+                t[3][l] = d[1][l] - d[3][l];
+            }
+
+            for (int k = 0; k < 4; ++k) {
+                float row[4] = { t[k][0] - t[k][2],
+                                 t[k][1] + t[k][2],
+                                 t[k][2] - t[k][1],
+                                 t[k][1] - t[k][3] };
+
+                for (int l = 0; l < 4; ++l) {
+                    v[((k * 4 + l) * in_d + i) * tiles + j] = row[l];
+                }
+            }
+        }
+    }
+
+    for (int i = 0; i < 16; ++i) {
+        gemm(0, 0, out_d, tiles, in_d, 1.0f,
+             u + i * out_d * in_d, in_d,
+             v + i * in_d * tiles, tiles,
+             0.0f, m + i * out_d * tiles, tiles);
+    }
+
+    #pragma omp parallel for collapse(2) schedule(static)
+    for (int i = 0; i < out_d; ++i) {
+        for (int j = 0; j < tiles; ++j) {
+            float *y_i = y + i * rows * cols;
+            int r0 = (j / tiles_c) * 2;
+            int c0 = (j % tiles_c) * 2;
+            float s[4][4];
+
+            for (int k = 0; k < 4; ++k) {
+                for (int l = 0; l < 4; ++l) {
+                    s[k][l] = m[((k * 4 + l) * out_d + i) * tiles + j];
+                }
+            }
+
+            float t[2][4];
+
+            for (int l = 0; l < 4; ++l) {
+                t[0][l] = s[0][l] + s[1][l] + s[2][l];
+                t[1][l] = s[1][l] - s[2][l] - s[3][l];
+            }
+
+            for (int k = 0; k < 2; ++k) {
+                float out[2] = { t[k][0] + t[k][1] + t[k][2],
+                                 t[k][1] - t[k][2] - t[k][3] };
+
+                for (int l = 0; l < 2; ++l) {
+                    if (r0 + k < rows && c0 + l < cols) {
+                        y_i[(r0 + k) * cols + c0 + l] = out[l];
+                    }
+                }
+            }
+        }
+    }
+}
@@ -0,0 +1,915 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "nn.h"
+#include "utils.h"
+
+#ifndef _WIN32
+#include <unistd.h>
+#include <sys/wait.h>
+#endif
+
+#define TOLERANCE 1e-4f
+
+static int failures = 0;
+
+static void check(const char *name, float err)
+{
+    int ok = err <= TOLERANCE;
+
+    printf("%-40s %s (max err %g)\n", name, ok ? "ok" : "FAILED", err);
+
+    failures += !ok;
+}
+
+static void expect(const char *name, int ok)
+{
+    printf("%-40s %s\n", name, ok ? "ok" : "FAILED");
+
+    failures += !ok;
+}
+
+static float max_diff(const float *a, const float *b, int size)
+{
+    float err = 0.0f;
+
+    for (int i = 0; i < size; ++i) {
+        err = fmaxf(err, fabsf(a[i] - b[i]));
+    }
+
+    return err;
+}
+
+/*
+ * Forks workers ranks that each fill a buffer with rank dependent values
+ * and average it. The size is not a multiple of the rank count, so the last
+ * chunk of the ring is short. Forking is only safe before OpenMP has started
+ * a team, so every case runs in a child of the test process, which never
+ * starts one before these.
+ */
+static void test_allreduce(int workers)
+{
+#ifndef _WIN32
+    int size = 1001;
+    char name[64];
+
+    sprintf(name, "allreduce %d ranks", workers);
+    fflush(stdout);
+
+    pid_t pid = fork();
+
+    if (pid == 0) {
+        parallel p = parallel_alloc(workers);
+        parallel_fork(&p, size);
+
+        tens t = tens_alloc(size, 1, 1, 1);
+
+        for (int i = 0; i < size; ++i) {
+            t.vals[i] = (p.rank + 1) * (i % 13) + p.rank;
+        }
+
+        parallel_allreduce(p, t);
+
+        float err = 0.0f;
+
+        for (int i = 0; i < size; ++i) {
+            float mean = (workers + 1) / 2.0f * (i % 13) + (workers - 1) / 2.0f;
+
+            err = fmaxf(err, fabsf(t.vals[i] - mean));
+        }
+
+        tens e = tens_alloc(1, 1, 1, 1);
+
+        e.vals[0] = err;
+
+        parallel_allreduce(p, e);
+        parallel_join(p);
+
+        /* e holds the mean of the per rank errors, which are never negative. */
+        check(name, e.vals[0] * workers);
+
+        parallel_destroy(p);
+        exit(failures);
+    }
+
+    int status;
+
+    waitpid(pid, &status, 0);
+
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        if (!WIFEXITED(status)) {
+            printf("%-40s FAILED (crashed)\n", name);
+        }
+
+        ++failures;
+    }
+#endif
+}
+
+/* Same-padded 3x3 convolution straight from the definition. */
+static void naive_conv_forward(conv_layer *cl, tens x, tens y)
+{
+    for (int i = 0; i < cl->x_b; ++i) {
+        for (int j = 0; j < cl->convolutions; ++j) {
+            for (int k = 0; k < cl->y_r; ++k) {
+                for (int l = 0; l < cl->y_c; ++l) {
+                    float sum = tens_at(cl->b, k, l, j, 0);
+
+                    for (int m = 0; m < cl->x_d; ++m) {
+                        for (int n = 0; n < 3; ++n) {
+                            for (int o = 0; o < 3; ++o) {
+                                int r = k + n - 1;
+                                int c = l + o - 1;
+
+                                if (r < 0 || r >= cl->x_r || c < 0 || c >= cl->x_c) continue;
+
+                                sum += tens_at(x, r, c, m, i) * tens_at(cl->w, n, o, m, j);
+                            }
+                        }
+                    }
+
+                    tens_at(y, k, l, j, i) = sum;
+                }
+            }
+        }
+    }
+}
+
+static void naive_conv_backprop(conv_layer *cl, tens x, tens dy, tens dx, tens dw)
+{
+    tens_fill(dx, 0.0f);
+    tens_fill(dw, 0.0f);
+
+    for (int i = 0; i < cl->x_b; ++i) {
+        for (int j = 0; j < cl->convolutions; ++j) {
+            for (int k = 0; k < cl->y_r; ++k) {
+                for (int l = 0; l < cl->y_c; ++l) {
+                    float dy_val = tens_at(dy, k, l, j, i);
+
+                    for (int m = 0; m < cl->x_d; ++m) {
+                        for (int n = 0; n < 3; ++n) {
+                            for (int o = 0; o < 3; ++o) {
+                                int r = k + n - 1;
+                                int c = l + o - 1;
+
+                                if (r < 0 || r >= cl->x_r || c < 0 || c >= cl->x_c) continue;
+
+                                tens_at(dx, r, c, m, i) += dy_val * tens_at(cl->w, n, o, m, j);
+                                tens_at(dw, n, o, m, j) += dy_val * tens_at(x, r, c, m, i) / cl->x_b;
+                            }
+                        }
+                    }
+                }
+            }
+        }
+    }
+}
+
+/*
+ * Runs a single 3x3 same conv through the network in the given layout and
+ * compares forward, dx and dw with the naive convolution. After an SGD step
+ * the forward pass is checked again, so stale cached filter transforms show.
+ */
+static void test_conv(int rows, int cols, int layout)
+{
+    int same[4] = { 1, 1, 1, 1 };
+    int x_d = 3;
+    int convolutions = 5;
+    int x_b = 2;
+    char name[64];
+
+    nn n = nn_alloc(1);
+    nn_add_layer(&n, conv_layer_alloc(rows, cols, x_d, x_b, 3, 3, convolutions, 1, same));
+    nn_set_layout(&n, layout);
+    nn_init(n);
+
+    conv_layer *cl = (conv_layer *)n.layers[0].data;
+
+    if (cl->algo != CONV_WINOGRAD) {
+        printf("conv %dx%d does not use Winograd\n", rows, cols);
+        ++failures;
+    }
+
+    tens_normal(cl->b, 0.0f, 1.0f);
+
+    tens x = tens_alloc(rows, cols, x_d, x_b);
+    tens dy = tens_alloc(rows, cols, convolutions, x_b);
+    tens y_ref = tens_alloc(rows, cols, convolutions, x_b);
+    tens dx_ref = tens_alloc(rows, cols, x_d, x_b);
+    tens dw_ref = tens_alloc(3, 3, x_d, convolutions);
+
+    tens_normal(x, 0.0f, 1.0f);
+    tens_normal(dy, 0.0f, 1.0f);
+
+    int y_size = rows * cols * convolutions * x_b;
+    int x_size = rows * cols * x_d * x_b;
+    const char *suffix = layout == NHWC ? " nhwc" : "";
+    tens y, dx;
+
+    nn_forward(n, x, &y);
+    naive_conv_forward(cl, x, y_ref);
+
+    sprintf(name, "conv %dx%d%s forward", rows, cols, suffix);
+    check(name, max_diff(y.vals, y_ref.vals, y_size));
+
+    nn_backprop(n, dy, &dx, NULL);
+    naive_conv_backprop(cl, x, dy, dx_ref, dw_ref);
+
+    sprintf(name, "conv %dx%d%s dx", rows, cols, suffix);
+    check(name, max_diff(dx.vals, dx_ref.vals, x_size));
+
+    sprintf(name, "conv %dx%d%s dw", rows, cols, suffix);
+    check(name, max_diff(cl->dw.vals, dw_ref.vals, 9 * x_d * convolutions));
+
+    optimizer o = sgd_optimizer_alloc(0.5f, 0.0f);
+    nn_update(n, o);
+
+    nn_forward(n, x, &y);
+    naive_conv_forward(cl, x, y_ref);
+
+    sprintf(name, "conv %dx%d%s forward after update", rows, cols, suffix);
+    check(name, max_diff(y.vals, y_ref.vals, y_size));
+
+    o.destroy(o);
+
+    tens_destroy(x);
+    tens_destroy(dy);
+    tens_destroy(y_ref);
+    tens_destroy(dx_ref);
+    tens_destroy(dw_ref);
+
+    nn_destroy(n);
+}
+
+/*
+ * A strided conv that goes through im2col in both layouts, so the NHWC
+ * col2im gather is compared with the NCHW scatter.
+ */
+static void test_conv_strided(void)
+{
+    int pad[4] = { 1, 1, 1, 1 };
+    int x_b = 2;
+
+    nn a = nn_alloc(1);
+    nn b = nn_alloc(1);
+    nn_add_layer(&a, conv_layer_alloc(9, 9, 5, x_b, 3, 3, 6, 2, pad));
+    nn_add_layer(&b, conv_layer_alloc(9, 9, 5, x_b, 3, 3, 6, 2, pad));
+    nn_set_layout(&b, NHWC);
+    nn_init(a);
+
+    tens_copy(b.params, a.params);
+    nn_params_changed(b);
+
+    conv_layer *cl = (conv_layer *)a.layers[0].data;
+
+    tens x = tens_alloc(9, 9, 5, x_b);
+    tens dy = tens_alloc(cl->y_r, cl->y_c, 6, x_b);
+    tens y_a, y_b, dx_a, dx_b;
+
+    tens_normal(x, 0.0f, 1.0f);
+    tens_normal(dy, 0.0f, 1.0f);
+
+    nn_forward(a, x, &y_a);
+    nn_forward(b, x, &y_b);
+
+    check("conv stride 2 nhwc forward", max_diff(y_a.vals, y_b.vals, cl->y_r * cl->y_c * 6 * x_b));
+
+    nn_backprop(a, dy, &dx_a, NULL);
+    nn_backprop(b, dy, &dx_b, NULL);
+
+    check("conv stride 2 nhwc dx", max_diff(dx_a.vals, dx_b.vals, 9 * 9 * 5 * x_b));
+    check("conv stride 2 nhwc dw", max_diff(a.grads.vals, b.grads.vals, a.grads.dims[R]));
+
+    tens_destroy(x);
+    tens_destroy(dy);
+
+    nn_destroy(a);
+    nn_destroy(b);
+}
+
+/*
+ * Multi-head attention straight from the definition in double precision,
+ * one softmax row at a time. Like the layer, dw is the batch mean. Masked
+ * keys are left out of the softmax and padded queries produce zero.
+ */
+static void naive_attention(attention_layer *al, int causal, const int *lengths,
+                            tens x, tens dy, tens y, tens dx, tens dw_qkv, tens dw_o)
+{
+    int len = al->seq_len;
+    int d_model = al->d_model;
+    int d_k = al->d_k;
+    int stride = 3 * d_model;
+    double scale = 1.0 / sqrt(d_k);
+
+    double *qkv = malloc(len * stride * sizeof(double));
+    double *dqkv = malloc(len * stride * sizeof(double));
+    double *o = malloc(len * d_model * sizeof(double));
+    double *d_o = malloc(len * d_model * sizeof(double));
+    double *p = malloc(len * sizeof(double));
+    double *dp = malloc(len * sizeof(double));
+
+    tens_fill(dw_qkv, 0.0f);
+    tens_fill(dw_o, 0.0f);
+
+    for (int b = 0; b < al->x_b; ++b) {
+        int queries = lengths != NULL ? lengths[b] : len;
+
+        for (int t = 0; t < len; ++t) {
+            for (int f = 0; f < stride; ++f) {
+                double sum = 0.0;
+
+                for (int g = 0; g < d_model; ++g) {
+                    sum += tens_at(x, t, g, 0, b) * tens_at(al->w_qkv, g, f, 0, 0);
+                }
+
+                qkv[t * stride + f] = sum;
+                dqkv[t * stride + f] = 0.0;
+            }
+
+            for (int g = 0; g < d_model; ++g) {
+                double sum = 0.0;
+
+                for (int f = 0; f < d_model; ++f) {
+                    sum += tens_at(dy, t, f, 0, b) * tens_at(al->w_o, g, f, 0, 0);
+                }
+
+                d_o[t * d_model + g] = sum;
+                o[t * d_model + g] = 0.0;
+            }
+        }
+
+        for (int h = 0; h < al->h_R; ++h) {
+            const double *q = qkv + h * d_k;
+            const double *k = qkv + d_model + h * d_k;
+            const double *v = qkv + 2 * d_model + h * d_k;
+            double *dq = dqkv + h * d_k;
+            double *dk = dqkv + d_model + h * d_k;
+            double *dv = dqkv + 2 * d_model + h * d_k;
+
+            for (int i = 0; i < queries; ++i) {
+                double *o_i = o + i * d_model + h * d_k;
+                const double *d_o_i = d_o + i * d_model + h * d_k;
+                int keys = causal ? i + 1 : queries;
+                double max = -INFINITY;
+                double sum = 0.0;
+                double delta = 0.0;
+
+                for (int j = 0; j < keys; ++j) {
+                    p[j] = 0.0;
+
+                    for (int e = 0; e < d_k; ++e) {
+                        p[j] += q[i * stride + e] * k[j * stride + e] * scale;
+                    }
+
+                    max = fmax(max, p[j]);
+                }
+
+                for (int j = 0; j < keys; ++j) {
+                    p[j] = exp(p[j] - max);
+                    sum += p[j];
+                }
+
+                for (int j = 0; j < keys; ++j) {
+                    p[j] /= sum;
+                    dp[j] = 0.0;
+
+                    for (int e = 0; e < d_k; ++e) {
+                        o_i[e] += p[j] * v[j * stride + e];
+                        dp[j] += d_o_i[e] * v[j * stride + e];
+                        dv[j * stride + e] += p[j] * d_o_i[e];
+                    }
+
+                    delta += p[j] * dp[j];
+                }
+
+                for (int j = 0; j < keys; ++j) {
+                    double ds = p[j] * (dp[j] - delta) * scale;
+
+                    for (int e = 0; e < d_k; ++e) {
+                        dq[i * stride + e] += ds * k[j * stride + e];
+                        dk[j * stride + e] += ds * q[i * stride + e];
+                    }
+                }
+            }
+        }
+
+        for (int t = 0; t < len; ++t) {
+            for (int f = 0; f < d_model; ++f) {
+                double sum = 0.0;
+
+                for (int g = 0; g < d_model; ++g) {
+                    sum += o[t * d_model + g] * tens_at(al->w_o, g, f, 0, 0);
+                    tens_at(dw_o, g, f, 0, 0) += o[t * d_model + g] * tens_at(dy, t, f, 0, b) / al->x_b;
+                }
+
+                tens_at(y, t, f, 0, b) = sum;
+            }
+
+            for (int g = 0; g < d_model; ++g) {
+                double sum = 0.0;
+
+                for (int f = 0; f < stride; ++f) {
+                    sum += dqkv[t * stride + f] * tens_at(al->w_qkv, g, f, 0, 0);
+                    tens_at(dw_qkv, g, f, 0, 0) += tens_at(x, t, g, 0, b) * dqkv[t * stride + f] / al->x_b;
+                }
+
+                tens_at(dx, t, g, 0, b) = sum;
+            }
+        }
+    }
+
+    free(qkv);
+    free(dqkv);
+    free(o);
+    free(d_o);
+    free(p);
+    free(dp);
+}
+
+/*
+ * Runs one attention layer through the network and compares forward, dx and
+ * both weight gradients with the naive version. Sequences shorter and longer
+ * than a tile cover the single tile and the online softmax across tiles, and
+ * causal masks past a tile skip whole key tiles.
+ */
+static void test_attention(int len, int causal, const int *lengths)
+{
+    int d_model = 32;
+    int x_b = 2;
+    char name[64];
+    char label[32];
+
+    sprintf(label, "attention L=%d%s%s", len, causal ? " causal" : "", lengths != NULL ? " padded" : "");
+
+    nn n = nn_alloc(1);
+    nn_add_layer(&n, attention_layer_alloc(len, d_model, 8, x_b));
+    nn_init(n);
+
+    attention_mask(n.layers[0], causal, lengths);
+
+    attention_layer *al = (attention_layer *)n.layers[0].data;
+
+    tens x = tens_alloc(len, d_model, 1, x_b);
+    tens dy = tens_alloc(len, d_model, 1, x_b);
+    tens y_ref = tens_alloc(len, d_model, 1, x_b);
+    tens dx_ref = tens_alloc(len, d_model, 1, x_b);
+    tens dw_qkv_ref = tens_alloc(d_model, 3 * d_model, 1, 1);
+    tens dw_o_ref = tens_alloc(d_model, d_model, 1, 1);
+    tens y, dx;
+
+    tens_normal(x, 0.0f, 1.0f);
+    tens_normal(dy, 0.0f, 1.0f);
+
+    nn_forward(n, x, &y);
+    nn_backprop(n, dy, &dx, NULL);
+
+    naive_attention(al, causal, lengths, x, dy, y_ref, dx_ref, dw_qkv_ref, dw_o_ref);
+
+    int size = len * d_model * x_b;
+
+    sprintf(name, "%s forward", label);
+    check(name, max_diff(y.vals, y_ref.vals, size));
+
+    sprintf(name, "%s dx", label);
+    check(name, max_diff(dx.vals, dx_ref.vals, size));
+
+    sprintf(name, "%s dw_qkv", label);
+    check(name, max_diff(al->dw_qkv.vals, dw_qkv_ref.vals, 3 * d_model * d_model));
+
+    sprintf(name, "%s dw_o", label);
+    check(name, max_diff(al->dw_o.vals, dw_o_ref.vals, d_model * d_model));
+
+    tens_destroy(x);
+    tens_destroy(dy);
+    tens_destroy(y_ref);
+    tens_destroy(dx_ref);
+    tens_destroy(dw_qkv_ref);
+    tens_destroy(dw_o_ref);
+
+    nn_destroy(n);
+}
+
+/*
+ * A sequence padded out to 150 tokens must give the same output and
+ * gradients as the sequence alone, and the padding, including a batch entry
+ * of length zero, must give zeros.
+ */
+static void test_attention_padding(void)
+{
+    int lengths[2] = { 100, 0 };
+    int d_model = 32;
+    int size = 100 * d_model;
+
+    nn padded = nn_alloc(1);
+    nn_add_layer(&padded, attention_layer_alloc(150, d_model, 8, 2));
+    nn_init(padded);
+
+    attention_mask(padded.layers[0], 0, lengths);
+
+    nn alone = nn_alloc(1);
+    nn_add_layer(&alone, attention_layer_alloc(100, d_model, 8, 1));
+
+    tens_copy(alone.params, padded.params);
+
+    tens x = tens_alloc(150, d_model, 1, 2);
+    tens dy = tens_alloc(150, d_model, 1, 2);
+    tens x_alone = tens_view(x.vals, 100, d_model, 1, 1);
+    tens dy_alone = tens_view(dy.vals, 100, d_model, 1, 1);
+    tens y, y_alone, dx, dx_alone;
+
+    tens_normal(x, 0.0f, 1.0f);
+    tens_normal(dy, 0.0f, 1.0f);
+
+    nn_forward(padded, x, &y);
+    nn_forward(alone, x_alone, &y_alone);
+
+    check("attention padded forward", max_diff(y.vals, y_alone.vals, size));
+
+    nn_backprop(padded, dy, &dx, NULL);
+    nn_backprop(alone, dy_alone, &dx_alone, NULL);
+
+    check("attention padded dx", max_diff(dx.vals, dx_alone.vals, size));
+
+    float padding = 0.0f;
+
+    for (int i = size; i < 2 * 150 * d_model; ++i) {
+        padding = fmaxf(padding, fabsf(y.vals[i]) + fabsf(dx.vals[i]));
+    }
+
+    check("attention padding is zero", padding);
+
+    /* dw is a mean over x_b, which counts the empty entry. */
+    tens_scale(padded.grads, padded.grads, 2.0f);
+
+    check("attention padded dw", max_diff(padded.grads.vals, alone.grads.vals, padded.grads.dims[R]));
+
+    tens_destroy(x);
+    tens_destroy(dy);
+
+    nn_destroy(padded);
+    nn_destroy(alone);
+}
+
+/* Largest difference between the real rows of a padded and a packed batch. */
+static float packed_diff(tens padded, tens packed, int cols, int len,
+                         const int *lengths, const int *offsets, int count)
+{
+    float err = 0.0f;
+
+    for (int i = 0; i < count; ++i) {
+        err = fmaxf(err, max_diff(padded.vals + i * len * cols,
+                                  packed.vals + offsets[i] * cols, lengths[i] * cols));
+    }
+
+    return err;
+}
+
+/* Copies the real rows of a padded batch back to back, zeroing the tail. */
+static void pack_rows(tens packed, tens padded, int cols, int len,
+                      const int *lengths, const int *offsets, int count)
+{
+    tens_fill(packed, 0.0f);
+
+    for (int i = 0; i < count; ++i) {
+        memcpy(packed.vals + offsets[i] * cols, padded.vals + i * len * cols,
+               lengths[i] * cols * sizeof(float));
+    }
+}
+
+/*
+ * The same sequences as a padded batch with lengths and packed back to back
+ * must give the same rows, dx and gradients through a whole encoder block.
+ */
+static void test_packed_encoder(int causal)
+{
+    int lengths[4] = { 37, 100, 0, 64 };
+    int offsets[5] = { 0, 37, 137, 137, 201 };
+    int len = 100;
+    int d_model = 32;
+    int x_b = 4;
+    char name[64];
+    const char *suffix = causal ? " causal" : "";
+
+    nn padded = nn_alloc(1);
+    nn packed = nn_alloc(1);
+    nn_add_layer(&padded, encoder_block_alloc(len, d_model, 8, 64, x_b));
+    nn_add_layer(&packed, encoder_block_alloc(len, d_model, 8, 64, x_b));
+    nn_init(padded);
+
+    tens_copy(packed.params, padded.params);
+
+    encoder_mask(padded.layers[0], causal, lengths);
+    encoder_mask(packed.layers[0], causal, NULL);
+    encoder_pack(packed.layers[0], offsets, 4);
+
+    tens x = tens_alloc(len, d_model, 1, x_b);
+    tens dy = tens_alloc(len, d_model, 1, x_b);
+    tens x_packed = tens_alloc(len, d_model, 1, x_b);
+    tens dy_packed = tens_alloc(len, d_model, 1, x_b);
+    tens y, y_packed, dx, dx_packed;
+
+    tens_normal(x, 0.0f, 1.0f);
+    tens_normal(dy, 0.0f, 1.0f);
+
+    for (int i = 0; i < x_b; ++i) {
+        memset(dy.vals + (i * len + lengths[i]) * d_model, 0,
+               (len - lengths[i]) * d_model * sizeof(float));
+    }
+
+    pack_rows(x_packed, x, d_model, len, lengths, offsets, 4);
+    pack_rows(dy_packed, dy, d_model, len, lengths, offsets, 4);
+
+    nn_forward(padded, x, &y);
+    nn_forward(packed, x_packed, &y_packed);
+
+    sprintf(name, "encoder packed%s forward", suffix);
+    check(name, packed_diff(y, y_packed, d_model, len, lengths, offsets, 4));
+
+    nn_backprop(padded, dy, &dx, NULL);
+    nn_backprop(packed, dy_packed, &dx_packed, NULL);
+
+    sprintf(name, "encoder packed%s dx", suffix);
+    check(name, packed_diff(dx, dx_packed, d_model, len, lengths, offsets, 4));
+
+    sprintf(name, "encoder packed%s dw", suffix);
+    check(name, max_diff(padded.grads.vals, packed.grads.vals, padded.grads.dims[R]));
+
+    tens_destroy(x);
+    tens_destroy(dy);
+    tens_destroy(x_packed);
+    tens_destroy(dy_packed);
+
+    nn_destroy(padded);
+    nn_destroy(packed);
+}
+
+/* Positions restart at every packed sequence, so rows match the padded batch. */
+static void test_packed_embedding(void)
+{
+    int lengths[4] = { 37, 100, 0, 64 };
+    int offsets[5] = { 0, 37, 137, 137, 201 };
+    int len = 100;
+    int d_model = 32;
+    int x_b = 4;
+
+    nn padded = nn_alloc(1);
+    nn packed = nn_alloc(1);
+    nn_add_layer(&padded, embedding_layer_alloc(len, x_b, d_model, 50));
+    nn_add_layer(&packed, embedding_layer_alloc(len, x_b, d_model, 50));
+    nn_init(padded);
+
+    tens_copy(packed.params, padded.params);
+
+    embedding_pack(packed.layers[0], offsets, 4);
+
+    tens tokens = tens_alloc(len, 1, 1, x_b);
+    tens tokens_packed = tens_alloc(len, 1, 1, x_b);
+
+    for (int i = 0; i < len * x_b; ++i) {
+        tokens.vals[i] = i * 7 % 50;
+    }
+
+    pack_rows(tokens_packed, tokens, 1, len, lengths, offsets, 4);
+
+    tens dy = tens_alloc(len, d_model, 1, x_b);
+    tens dy_packed = tens_alloc(len, d_model, 1, x_b);
+    tens y, y_packed, dx, dx_packed;
+
+    tens_normal(dy, 0.0f, 1.0f);
+
+    for (int i = 0; i < x_b; ++i) {
+        memset(dy.vals + (i * len + lengths[i]) * d_model, 0,
+               (len - lengths[i]) * d_model * sizeof(float));
+    }
+
+    pack_rows(dy_packed, dy, d_model, len, lengths, offsets, 4);
+
+    nn_forward(padded, tokens, &y);
+    nn_forward(packed, tokens_packed, &y_packed);
+
+    check("embedding packed forward", packed_diff(y, y_packed, d_model, len, lengths, offsets, 4));
+
+    nn_backprop(padded, dy, &dx, NULL);
+    nn_backprop(packed, dy_packed, &dx_packed, NULL);
+
+    check("embedding packed de", max_diff(padded.grads.vals, packed.grads.vals, padded.grads.dims[R]));
+
+    tens_destroy(dy);
+    tens_destroy(dy_packed);
+    tens_destroy(tokens);
+    tens_destroy(tokens_packed);
+
+    nn_destroy(padded);
+    nn_destroy(packed);
+}
+
+/*
+ * A small conv, batchnorm, pool and dense network. After a few warmup steps
+ * have allocated every lazy buffer, further training steps must not create
+ * tensors.
+ */
+static void test_steady_allocs(int layout)
+{
+    int same[4] = { 1, 1, 1, 1 };
+    int none[4] = { 0, 0, 0, 0 };
+    int x_b = 4;
+
+    nn n = nn_alloc(16);
+    nn_add_layer(&n, conv_layer_alloc(8, 8, 3, x_b, 3, 3, 8, 1, same));
+    nn_add_layer(&n, batchnorm_layer_alloc(8, 8, 8, x_b));
+    nn_add_layer(&n, relu_layer_alloc(8, 8, 8, x_b));
+    nn_add_layer(&n, maxpool_layer_alloc(8, 8, 8, x_b, 2, 2));
+    nn_add_layer(&n, conv_layer_alloc(4, 4, 8, x_b, 1, 1, 8, 1, none));
+    nn_add_layer(&n, reshape_layer_alloc(4, 4, 8, x_b, 128, 1, 1, x_b));
+    nn_add_layer(&n, dense_layer_alloc(128, 10, x_b));
+    nn_set_layout(&n, layout);
+    nn_fuse(&n);
+    nn_init(n);
+
+    optimizer o = sgd_optimizer_alloc(0.01f, 0.9f);
+
+    tens x = tens_alloc(8, 8, 3, x_b);
+    tens dy = tens_alloc(10, 1, 1, x_b);
+    tens y, dx;
+
+    tens_normal(x, 0.0f, 1.0f);
+    tens_normal(dy, 0.0f, 1.0f);
+
+    long count = 0;
+
+    for (int i = 0; i < 5; ++i) {
+        if (i == 2) {
+            count = tens_allocations();
+        }
+
+        nn_forward(n, x, &y);
+        nn_backprop(n, dy, &dx, NULL);
+        nn_update(n, o);
+    }
+
+    long steps = tens_allocations() - count;
+    int ok = steps == 0;
+
+    printf("%-40s %s (%ld tensors allocated)\n",
+           layout == NHWC ? "steady allocs nhwc" : "steady allocs",
+           ok ? "ok" : "FAILED", steps);
+
+    failures += !ok;
+
+    o.destroy(o);
+
+    tens_destroy(x);
+    tens_destroy(dy);
+
+    nn_destroy(n);
+}
+
+static nn checkpoint_nn(int classes)
+{
+    int same[4] = { 1, 1, 1, 1 };
+    int x_b = 2;
+
+    nn n = nn_alloc(5);
+    nn_add_layer(&n, conv_layer_alloc(6, 6, 3, x_b, 3, 3, 4, 1, same));
+    nn_add_layer(&n, batchnorm_layer_alloc(6, 6, 4, x_b));
+    nn_add_layer(&n, relu_layer_alloc(6, 6, 4, x_b));
+    nn_add_layer(&n, reshape_layer_alloc(6, 6, 4, x_b, 144, 1, 1, x_b));
+    nn_add_layer(&n, dense_layer_alloc(144, classes, x_b));
+    nn_init(n);
+
+    return n;
+}
+
+/*
+ * Saves a network after a training step, so the batchnorm state is not at
+ * its initial values, and loads it into fresh networks by reading and by
+ * mapping the file. A different architecture and a corrupted payload must
+ * both be rejected.
+ */
+static void test_checkpoint(void)
+{
+    const char *path = "test_checkpoint.bin";
+    const char *corrupt_path = "test_checkpoint_corrupt.bin";
+
+    nn n = checkpoint_nn(10);
+    optimizer o = sgd_optimizer_alloc(0.1f, 0.0f);
+
+    tens x = tens_alloc(6, 6, 3, 2);
+    tens dy = tens_alloc(10, 1, 1, 2);
+    tens y, y_loaded, dx;
+
+    tens_normal(x, 0.0f, 1.0f);
+    tens_normal(dy, 0.0f, 1.0f);
+
+    nn_forward(n, x, &y);
+    nn_backprop(n, dy, &dx, NULL);
+    nn_update(n, o);
+
+    FILE *f = fopen(path, "wb");
+    nn_save(n, f);
+    fclose(f);
+
+    nn_set_mode(&n, INFERENCE);
+    nn_forward(n, x, &y);
+
+    nn loaded = checkpoint_nn(10);
+
+    f = fopen(path, "rb");
+    expect("checkpoint load", nn_load(loaded, f) == 0);
+    fclose(f);
+
+    nn_set_mode(&loaded, INFERENCE);
+    nn_forward(loaded, x, &y_loaded);
+
+    check("checkpoint load params", max_diff(loaded.params.vals, n.params.vals, n.params.dims[R]));
+    check("checkpoint load state", max_diff(loaded.state.vals, n.state.vals, n.state.dims[R]));
+    check("checkpoint load forward", max_diff(y_loaded.vals, y.vals, 20));
+
+    nn mapped = checkpoint_nn(10);
+    nn_set_mode(&mapped, INFERENCE);
+
+    expect("checkpoint mmap", nn_load_mmap(&mapped, path) == 0);
+
+    nn_forward(mapped, x, &y_loaded);
+
+    check("checkpoint mmap forward", max_diff(y_loaded.vals, y.vals, 20));
+
+    nn other = checkpoint_nn(12);
+
+    f = fopen(path, "rb");
+    expect("checkpoint rejects architecture", nn_load(other, f) == -1);
+    fclose(f);
+
+    expect("checkpoint mmap rejects architecture", nn_load_mmap(&other, path) == -1);
+
+    f = fopen(path, "rb");
+    fseek(f, 0, SEEK_END);
+    long size = ftell(f);
+    char *bytes = malloc(size);
+    fseek(f, 0, SEEK_SET);
+    fread(bytes, 1, size, f);
+    fclose(f);
+
+    bytes[size - 2] ^= 0x10;
+
+    f = fopen(corrupt_path, "wb");
+    fwrite(bytes, 1, size, f);
+    fclose(f);
+
+    f = fopen(corrupt_path, "rb");
+    expect("checkpoint rejects corrupt payload", nn_load(loaded, f) == -1);
+    fclose(f);
+
+    expect("checkpoint mmap rejects corrupt payload", nn_load_mmap(&loaded, corrupt_path) == -1);
+
+    free(bytes);
+    remove(path);
+    remove(corrupt_path);
+
+    o.destroy(o);
+
+    tens_destroy(x);
+    tens_destroy(dy);
+
+    nn_destroy(n);
+    nn_destroy(loaded);
+    nn_destroy(mapped);
+    nn_destroy(other);
+}
+
+int main(void)
+{
+    test_allreduce(2);
+    test_allreduce(3);
+
+    rand_seed(1);
+
+    test_conv(8, 8, NCHW);
+    test_conv(7, 9, NCHW);
+    test_conv(8, 8, NHWC);
+    test_conv(7, 9, NHWC);
+    test_conv_strided();
+
+    int lengths[2] = { 100, 0 };
+
+    test_attention(5, 0, NULL);
+    test_attention(150, 0, NULL);
+    test_attention(150, 1, NULL);
+    test_attention(150, 0, lengths);
+    test_attention(150, 1, lengths);
+    test_attention_padding();
+
+    test_packed_encoder(0);
+    test_packed_encoder(1);
+    test_packed_embedding();
+
+    test_steady_allocs(NCHW);
+    test_steady_allocs(NHWC);
+
+    test_checkpoint();
+
+    printf("%d failed\n", failures);
+
+    return failures != 0;
+}